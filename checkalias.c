@@ -85,7 +85,23 @@ found:
 }
 #endif
 
-int is_host_alias(const char *name, struct query *ctl, struct addrinfo **res)
+/*
+ * Verdicts of is_host_alias() during this poll, in val.status.mark.
+ * Multidrop mail asks about the same few hosts for every address of
+ * every message, and a name that is not an alias would otherwise cost
+ * DNS queries each time.
+ */
+static struct idlist *alias_memo;
+static struct idhash alias_index;
+
+void forget_host_aliases(void)
+/* drop the verdicts, for the start of a poll */
+{
+    idhash_free(&alias_index);
+    free_str_list(&alias_memo);
+}
+
+static int host_alias(const char *name, struct query *ctl, struct addrinfo **res)
 /* determine whether name is a DNS alias of the mailserver for this query */
 {
 #ifdef HAVE_RES_SEARCH
@@ -254,4 +270,29 @@ int is_host_alias(const char *name, struct query *ctl, struct addrinfo **res)
 #endif /* HAVE_RES_SEARCH */
 }
 
+int is_host_alias(const char *name, struct query *ctl, struct addrinfo **res)
+/* host_alias(), memoized for the poll */
+{
+    struct idlist *idp;
+    int olderrs = ctl->errcount, rc;
+
+    if ((idp = idhash_find(&alias_index, &alias_memo, name)))
+	return(idp->val.status.mark);
+
+    rc = host_alias(name, ctl, res);
+
+    /* a nameserver failure is no verdict; ask again next time */
+    if (ctl->errcount == olderrs)
+    {
+	idp = (struct idlist *)xmalloc(sizeof(struct idlist));
+	idp->id = xstrdup(name);
+	idp->val.status.mark = rc;
+	idp->val.status.num = 0;
+	idp->next = alias_memo;
+	alias_memo = idp;
+	idhash_add(&alias_index, idp);
+    }
+    return(rc);
+}
+
 /* checkalias.c ends here */
@@ -123,6 +123,7 @@ void dump_config(struct runctl *runp, struct query *querylist)
 {
     struct query *ctl;
     struct idlist *idp;
+    struct hdrrule *rule;
     const char *features;
 
     indent_level = 0;
@@ -197,6 +198,9 @@ void dump_config(struct runctl *runp, struct query *querylist)
     numdump("poll_interval", runp->poll_interval);
     stringdump("logfile", runp->logfile);
     stringdump("idfile", runp->idfile);
+    stringdump("dupfile", runp->dupfile);
+    stringdump("digest", runp->digest ? digest_name(runp->digest) : NULL);
+    numdump("smtpidle", runp->smtpidle);
     stringdump("postmaster", runp->postmaster);
     booldump("bouncemail", runp->bouncemail);
     booldump("spambounce", runp->spambounce);
@@ -361,6 +365,10 @@ void dump_config(struct runctl *runp, struct query *querylist)
 
 	stringdump("mda", ctl->mda);
 	stringdump("bsmtp", ctl->bsmtp);
+	stringdump("bsmtpcompress", ctl->bsmtpcompress);
+	stringdump("maildir", ctl->maildir);
+	stringdump("mbox", ctl->mbox);
+	stringdump("spool", ctl->spool);
 	indent('\0');
 	if (ctl->listener == LMTP_MODE)
 	    fputs("'lmtp':TRUE,\n", stdout);
@@ -386,6 +394,11 @@ void dump_config(struct runctl *runp, struct query *querylist)
 	stringdump("sslfingerprint", ctl->sslfingerprint);
 #endif /* SSL_ENABLE */
 	numdump("expunge", ctl->expunge);
+	numdump("folderconns", ctl->folderconns);
+	numdump("mdajobs", ctl->mdajobs);
+	numdump("maildirsync", ctl->maildirsync);
+	numdump("mboxsync", ctl->mboxsync);
+	numdump("bsmtpsync", ctl->bsmtpsync);
 	stringdump("properties", ctl->properties);
 	listdump("smtphunt", ctl->smtphunt);
 	listdump("fetchdomains", ctl->domainlist);
@@ -403,6 +416,19 @@ void dump_config(struct runctl *runp, struct query *querylist)
 	fputs("',\n", stdout);
 	listdump("mailboxes", ctl->mailboxes);
 
+	/* header rules in run control file syntax */
+	indent('\0');
+	fputs("\"rules\":[", stdout);
+	for (rule = ctl->rules; rule; rule = rule->next)
+	{
+	    fprintf(stdout, "'%s \"%s\" %s", rule_whats[rule->what],
+		    visbuf(rule->pattern), rule_actions[rule->action]);
+	    if (rule->route)
+		fprintf(stdout, " %s", visbuf(rule->route));
+	    fputs(rule->next ? "', " : "'", stdout);
+	}
+	fputs("],\n", stdout);
+
 	indent('}');
 	indent('\0'); 
 	fputc(',', stdout);
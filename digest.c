@@ -0,0 +1,193 @@
+/*
+ * digest.c -- digests of message text for duplicate detection
+ *
+ * Multidrop mode compares a digest of each message's headers with that
+ * of the message before it to drop adjacent copies.  MD5 is the
+ * traditional choice; XXH64, Yann Collet's non-cryptographic hash, is
+ * several times faster and good enough to tell messages apart when
+ * nobody is trying to forge a collision.
+ *
+ * For license terms, see the file COPYING in this directory.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#if defined(HAVE_STRINGS_H)
+#include <strings.h>
+#endif
+
+#include "fetchmail.h"
+#include "digest.h"
+
+#define XXH_PRIME1	UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME2	UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME3	UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME4	UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME5	UINT64_C(0x27D4EB2F165667C5)
+
+#define ROTL64(x, r)	((x) << (r) | (x) >> (64 - (r)))
+
+static uint64_t get64(const unsigned char *p)
+/* load a little-endian 64-bit word */
+{
+    return((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	   | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+	   | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+static uint64_t get32(const unsigned char *p)
+/* load a little-endian 32-bit word */
+{
+    return((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	   | (uint64_t)p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = ROTL64(acc, 31);
+    return(acc * XXH_PRIME1);
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxh64_round(0, v);
+    return(acc * XXH_PRIME1 + XXH_PRIME4);
+}
+
+static void xxh64_init(struct xxh64_state *st)
+{
+    memset(st, '\0', sizeof(*st));
+    st->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    st->v[1] = XXH_PRIME2;
+    st->v[2] = 0;
+    st->v[3] = -XXH_PRIME1;
+}
+
+static void xxh64_stripe(struct xxh64_state *st, const unsigned char *p)
+/* mix one 32-byte stripe into the four lanes */
+{
+    st->v[0] = xxh64_round(st->v[0], get64(p));
+    st->v[1] = xxh64_round(st->v[1], get64(p + 8));
+    st->v[2] = xxh64_round(st->v[2], get64(p + 16));
+    st->v[3] = xxh64_round(st->v[3], get64(p + 24));
+}
+
+static void xxh64_update(struct xxh64_state *st, const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+
+    st->total += len;
+    if (st->memsize + len < 32)
+    {
+	memcpy(st->mem + st->memsize, p, len);
+	st->memsize += len;
+	return;
+    }
+    if (st->memsize)
+    {
+	memcpy(st->mem + st->memsize, p, 32 - st->memsize);
+	p += 32 - st->memsize;
+	xxh64_stripe(st, st->mem);
+	st->memsize = 0;
+    }
+    for (; end - p >= 32; p += 32)
+	xxh64_stripe(st, p);
+    memcpy(st->mem, p, end - p);
+    st->memsize = end - p;
+}
+
+static uint64_t xxh64_final(const struct xxh64_state *st)
+{
+    const unsigned char *p = st->mem, *end = st->mem + st->memsize;
+    uint64_t h;
+
+    if (st->total >= 32)
+    {
+	h = ROTL64(st->v[0], 1) + ROTL64(st->v[1], 7)
+	    + ROTL64(st->v[2], 12) + ROTL64(st->v[3], 18);
+	h = xxh64_merge(h, st->v[0]);
+	h = xxh64_merge(h, st->v[1]);
+	h = xxh64_merge(h, st->v[2]);
+	h = xxh64_merge(h, st->v[3]);
+    }
+    else
+	h = st->v[2] + XXH_PRIME5;
+    h += st->total;
+
+    for (; end - p >= 8; p += 8)
+    {
+	h ^= xxh64_round(0, get64(p));
+	h = ROTL64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (end - p >= 4)
+    {
+	h ^= get32(p) * XXH_PRIME1;
+	h = ROTL64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+	p += 4;
+    }
+    for (; p < end; p++)
+    {
+	h ^= *p * XXH_PRIME5;
+	h = ROTL64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return(h);
+}
+
+int digest_lookup(const char *name)
+/* map a digest algorithm name to its DIGEST_* code, 0 if unknown */
+{
+    if (strcasecmp(name, "md5") == 0)
+	return(DIGEST_MD5);
+    else if (strcasecmp(name, "xxh64") == 0 || strcasecmp(name, "xxhash") == 0)
+	return(DIGEST_XXH64);
+    else
+	return(0);
+}
+
+const char *digest_name(int alg)
+{
+    return(alg == DIGEST_XXH64 ? "xxh64" : "md5");
+}
+
+void DigestInit(DIGEST_CTX *context, int alg)
+{
+    context->alg = (alg == DIGEST_XXH64) ? DIGEST_XXH64 : DIGEST_MD5;
+    if (context->alg == DIGEST_XXH64)
+	xxh64_init(&context->u.xxh64);
+    else
+	MD5Init(&context->u.md5);
+}
+
+void DigestUpdate(DIGEST_CTX *context, const void *buf, size_t len)
+{
+    if (context->alg == DIGEST_XXH64)
+	xxh64_update(&context->u.xxh64, (const unsigned char *)buf, len);
+    else
+	MD5Update(&context->u.md5, buf, len);
+}
+
+void DigestFinal(unsigned char *digest, DIGEST_CTX *context)
+{
+    memset(digest, '\0', DIGESTLEN);
+    if (context->alg == DIGEST_XXH64)
+    {
+	uint64_t h = xxh64_final(&context->u.xxh64);
+	int i;
+
+	for (i = 0; i < 8; i++)
+	    digest[i] = (unsigned char)(h >> (56 - 8 * i));
+    }
+    else
+	MD5Final(digest, &context->u.md5);
+    digest[DIGESTLEN - 1] = context->alg;
+}
+
+/* digest.c ends here */
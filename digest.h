@@ -0,0 +1,38 @@
+/** \file digest.h -- digests of message text for duplicate detection */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "fm_md5.h"
+
+/** state of an XXH64 hash; see digest.c */
+struct xxh64_state
+{
+    uint64_t v[4];		/**< lane accumulators */
+    uint64_t total;		/**< bytes hashed so far */
+    unsigned char mem[32];	/**< input not yet hashed, less than a stripe */
+    unsigned int memsize;	/**< bytes in \a mem */
+};
+
+/** a digest being computed with one of the DIGEST_* algorithms */
+typedef struct
+{
+    int alg;			/**< DIGEST_* algorithm */
+    union
+    {
+	MD5_CTX md5;
+	struct xxh64_state xxh64;
+    } u;
+} DIGEST_CTX;
+
+void DigestInit(DIGEST_CTX *context, int alg);
+void DigestUpdate(DIGEST_CTX *context, const void *buf, size_t len);
+/** Store the digest in the DIGESTLEN bytes at \a digest, zero-padded,
+ * with the algorithm in the last byte so that digests made with
+ * different algorithms never compare equal. */
+void DigestFinal(unsigned char *digest, DIGEST_CTX *context);
+
+#endif /* DIGEST_H */
@@ -27,6 +27,13 @@
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#else /* !HAVE_FCNTL_H */
+#ifdef HAVE_SYS_FCNTL_H
+#include <sys/fcntl.h>
+#endif /* HAVE_SYS_FCNTL_H */
+#endif /* !HAVE_FCNTL_H */
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
@@ -436,6 +443,200 @@ static int eat_trailer(int sock, struct query *ctl)
     return (ctl->server.base_protocol->trail)(sock, ctl, tag);
 }
 
+/* messages whose delivery verdict is still outstanding, oldest first */
+static struct eom_wait
+{
+    int		num;		/* message number on the server */
+    int		msgcode;
+    flag	suppress_delete;
+    pid_t	job;		/* MDA process, 0 for the listener's reply */
+    int		delivered;	/* TRUE or FALSE once known, -1 before */
+} eom_wait[MDA_MAXJOBS];
+static int eom_count;
+
+static int eom_limit(struct query *ctl)
+/* how many deliveries may be outstanding while we fetch on */
+{
+    int jobs = NUM_VALUE_OUT(ctl->mdajobs);
+
+    /* Maildir, mbox and BSMTP messages wait for their batch to be synced */
+    if (ctl->maildir || ctl->spool || ctl->mbox || ctl->bsmtp)
+    {
+	if (ctl->maildir || ctl->spool)
+	    jobs = NUM_VALUE_OUT(ctl->maildirsync);
+	else if (ctl->mbox)
+	    jobs = NUM_VALUE_OUT(ctl->mboxsync);
+	else if (strcmp(ctl->bsmtp, "-"))
+	{
+	    jobs = NUM_VALUE_OUT(ctl->bsmtpsync);
+	    /* compressed output is safe only once its stream is closed */
+	    if (ctl->bsmtpcompress && jobs == 0)
+		jobs = MDA_MAXJOBS;
+	}
+	else
+	    jobs = 0;
+	if (jobs > MDA_MAXJOBS)
+	    jobs = MDA_MAXJOBS;
+	return(jobs > 1 ? jobs : 0);
+    }
+
+    /*
+     * The listener connection can only owe us one reply.  Parallel
+     * listener connections would need the staging buffer, LMTP
+     * recipient list and reply of each kept apart; we don't do that.
+     */
+    if (!ctl->mda)
+	return(1);
+
+    /*
+     * One more MDA runs while we feed it the next message.  These may
+     * finish in any order, so messages an MDA appends to one mailbox
+     * can land there out of order.
+     */
+    if (jobs > MDA_MAXJOBS)
+	jobs = MDA_MAXJOBS;
+    return(jobs > 1 ? jobs - 1 : 0);
+}
+
+static flag will_flush(struct query *ctl, int msgcode, flag suppress_delete)
+/* will end-of-message processing delete this message on the server? */
+{
+    return(ctl->server.base_protocol->delete_msg
+	   && !suppress_delete
+	   && ((msgcode >= 0 && !ctl->keep)
+	       || (msgcode == MSGLEN_OLD && ctl->flush)
+	       || (msgcode == MSGLEN_TOOLARGE && ctl->limitflush)));
+}
+
+static int flag_message(int mailserver_socket, struct query *ctl, int num,
+			int msgcode, flag suppress_delete, flag quiet,
+			int *deletions)
+/* delete a message on the server, or mark it seen */
+{
+    int err;
+
+    if (will_flush(ctl, msgcode, suppress_delete))
+    {
+	(*deletions)++;
+	if (outlevel > O_SILENT && !quiet)
+	    report_complete(stdout, GT_(" flushed\n"));
+	err = (ctl->server.base_protocol->delete_msg)(mailserver_socket, ctl, num);
+	if (err != 0)
+	    return(err);
+    }
+    else
+    {
+	/*
+	 * To avoid flooding the logs when using --keep, report
+	 * skipping of new messages only.
+	 */
+	if (outlevel > O_SILENT && !quiet && msgcode != MSGLEN_OLD)
+	    report_complete(stdout, GT_(" not flushed\n"));
+
+	/* maybe we mark this message as seen now? */
+	if (ctl->server.base_protocol->mark_seen
+	    && !suppress_delete
+	    && (msgcode >= 0 && ctl->keep))
+	{
+	    err = (ctl->server.base_protocol->mark_seen)(mailserver_socket, ctl, num);
+	    if (err != 0)
+		return(err);
+	}
+    }
+
+    return(PS_SUCCESS);
+}
+
+static void dup_partial(int num)
+/* the listener deferred message num for some recipients only; remember
+ * that the others got it or a bounce, so that they don't get it again */
+{
+    const char *id;
+    int i;
+
+    for (i = 0; (id = lmtp_deferred(i)) != NULL; i++)
+	dup_drop(num, id);
+    if (i)
+	dup_settle(num, TRUE);
+}
+
+static void eom_verdict(struct query *ctl, struct eom_wait *wp, flag block)
+/* find out whether an outstanding delivery succeeded */
+{
+    if (wp->delivered != -1)
+	return;
+
+    /*
+     * msgblk still describes a message whose listener reply is due:
+     * eom_reap() collects that before the next message's headers are
+     * read.  MDA and batch verdicts don't look at it.
+     */
+    wp->delivered = close_sink_finish(ctl, &msgblk, wp->job, block);
+    if (wp->delivered == TRUE)
+	dup_settle(wp->num, TRUE);
+    else if (wp->delivered == FALSE)
+    {
+	if (wp->job == 0)
+	    dup_partial(wp->num);
+	ctl->errcount++;
+	if (outlevel > O_SILENT
+		&& will_flush(ctl, wp->msgcode, wp->suppress_delete))
+	    report(stdout, GT_("message %s@%s:%d was not delivered, not flushed\n"),
+		   ctl->remotename, ctl->server.truename, wp->num);
+	wp->suppress_delete = TRUE;
+    }
+}
+
+static void eom_reap(struct query *ctl)
+/* read the listener's reply to a deferred end-of-message */
+{
+    int i;
+
+    for (i = 0; i < eom_count; i++)
+	if (eom_wait[i].job == 0)
+	    eom_verdict(ctl, &eom_wait[i], TRUE);
+}
+
+static int eom_settle(int mailserver_socket, struct query *ctl, int keep,
+		      int *deletions)
+/* flag the messages whose verdict is in, oldest first, and wait for
+ * verdicts until no more than keep deliveries are outstanding */
+{
+    struct eom_wait done;
+    int err;
+
+    while (eom_count > 0)
+    {
+	eom_verdict(ctl, &eom_wait[0], eom_count > keep);
+	if (eom_wait[0].delivered == -1)
+	    break;
+
+	done = eom_wait[0];
+	memmove(eom_wait, eom_wait + 1, --eom_count * sizeof(eom_wait[0]));
+	if ((err = flag_message(mailserver_socket, ctl, done.num, done.msgcode,
+				done.suppress_delete, TRUE, deletions)))
+	    return(err);
+    }
+
+    return(PS_SUCCESS);
+}
+
+static void eom_abandon(struct query *ctl)
+/* forget outstanding deliveries, their messages stay on the server */
+{
+    int i;
+
+    for (i = 0; i < eom_count; i++)
+	if (eom_wait[i].delivered == -1)
+	{
+	    if (eom_wait[i].job > 0)
+		close_sink_finish(ctl, NULL, eom_wait[i].job, TRUE);
+	    else	/* an unread reply would desync the listener */
+		smtp_close(ctl, 0);
+	}
+    eom_count = 0;
+}
+
 static int fetch_messages(int mailserver_socket, struct query *ctl, 
 			  int count, int **msgsizes, int maxfetch,
 			  int *fetches, int *dispatches, int *deletions,
@@ -493,12 +694,17 @@ static int fetch_messages(int mailserver_socket, struct query *ctl,
      */
     force_retrieval = !peek_capable && (ctl->errcount > 0);
 
+    /* message numbers of an earlier session mean nothing now */
+    dup_forget();
+
     for (num = 1; num <= count; num++)
     {
 	flag suppress_delete = FALSE;
 	flag suppress_forward = FALSE;
 	flag suppress_readbody = FALSE;
 	flag retained = FALSE;
+	flag seen = FALSE;
+	flag deferred = FALSE;
 	int msgcode = MSGLEN_UNKNOWN;
 
 	/* check if the message is old
@@ -619,6 +825,9 @@ static int fetch_messages(int mailserver_socket, struct query *ctl,
 	    else if (err != 0)
 		return(err);
 
+	    /* the listener had the server's round trip to answer */
+	    eom_reap(ctl);
+
 	    /* -1 means we didn't see a size in the response */
 	    if (len == -1)
 	    {
@@ -654,6 +863,8 @@ static int fetch_messages(int mailserver_socket, struct query *ctl,
 
 	    if (err == PS_RETAINED)
 		suppress_forward = suppress_delete = retained = TRUE;
+	    else if (err == PS_SEEN)
+		suppress_forward = suppress_delete = seen = TRUE;
 	    else if (err == PS_TRANSIENT)
 	    {
 		suppress_delete = suppress_forward = TRUE;
@@ -771,13 +982,40 @@ static int fetch_messages(int mailserver_socket, struct query *ctl,
 			   msgblk.msglen, msgsize);
 	    }
 
-	    /* end-of-message processing starts here */
-	    if (!close_sink(ctl, &msgblk, !suppress_forward))
+	    /* the server is idle now, flag earlier messages and make
+	     * room for this one */
+	    if ((err = eom_settle(mailserver_socket, ctl,
+				  eom_limit(ctl) - 1, deletions)))
+		return(err);
+
+	    /*
+	     * End-of-message processing starts here.  If another message
+	     * follows, don't wait for the listener's reply or the MDA's
+	     * exit but request the next message first.  This one is
+	     * only deleted or marked seen once the verdict is in, so a
+	     * failed delivery loses nothing.
+	     */
+	    if (!suppress_forward && num < count
+		    && !(maxfetch && maxfetch <= *fetches + 1)
+		    && eom_count < eom_limit(ctl)
+		    && (eom_wait[eom_count].job = close_sink_nowait(ctl)) != -1)
 	    {
+		eom_wait[eom_count].num = num;
+		eom_wait[eom_count].msgcode = msgcode;
+		eom_wait[eom_count].suppress_delete = suppress_delete;
+		eom_wait[eom_count].delivered = -1;
+		eom_count++;
+		deferred = TRUE;
+	    }
+	    else if (!close_sink(ctl, &msgblk, !suppress_forward))
+	    {
+		dup_partial(num);
 		ctl->errcount++;
 		suppress_delete = TRUE;
 	    }
-	    if (!retained)
+	    else if (!suppress_forward)
+		dup_settle(num, TRUE);
+	    if (!retained && !seen)
 		(*fetches)++;
 	}
 
@@ -788,49 +1026,45 @@ flagthemail:
 	 * or had delivery refused by the SMTP server
 	 * or we've seen `accepted for delivery' and the message is shipped.
 	 * It's safe to mark the message seen and delete it on the server now.
+	 *
+	 * The exception is a message whose delivery verdict is
+	 * still outstanding; it is flagged by eom_settle() later.
 	 */
-
-	/* in softbounce mode, suppress deletion and marking as seen */
-	if (suppress_forward)
-	    suppress_delete = suppress_delete || run.softbounce;
-
-	/* maybe we delete this message now? */
-	if (retained)
+	if (deferred)
 	{
-	    if (outlevel > O_SILENT) 
-		report_complete(stdout, GT_(" retained\n"));
-	}
-	else if (ctl->server.base_protocol->delete_msg
-		 && !suppress_delete
-		 && ((msgcode >= 0 && !ctl->keep)
-		     || (msgcode == MSGLEN_OLD && ctl->flush)
-		     || (msgcode == MSGLEN_TOOLARGE && ctl->limitflush)))
-	{
-	    (*deletions)++;
-	    if (outlevel > O_SILENT) 
-		report_complete(stdout, GT_(" flushed\n"));
-	    err = (ctl->server.base_protocol->delete_msg)(mailserver_socket, ctl, num);
-	    if (err != 0)
-		return(err);
+	    if (outlevel > O_SILENT)
+		report_complete(stdout,
+				will_flush(ctl, msgcode, suppress_delete)
+				? GT_(" flushed\n") : GT_(" not flushed\n"));
 	}
 	else
 	{
-	    /*
-	     * To avoid flooding the logs when using --keep, report
-	     * skipping of new messages only.
-	     */
-	    if (outlevel > O_SILENT && msgcode != MSGLEN_OLD)
-	    report_complete(stdout, GT_(" not flushed\n"));
+	    /* flag earlier messages whose verdict came in meanwhile */
+	    if ((err = eom_settle(mailserver_socket, ctl, eom_count, deletions)))
+		return(err);
+
+	    /* in softbounce mode, suppress deletion and marking as seen */
+	    if (suppress_forward)
+		suppress_delete = suppress_delete || run.softbounce;
 
-	    /* maybe we mark this message as seen now? */
-	    if (ctl->server.base_protocol->mark_seen
-		&& !suppress_delete
-		&& (msgcode >= 0 && ctl->keep))
+	    /* maybe we delete this message now? */
+	    if (retained)
 	    {
-		err = (ctl->server.base_protocol->mark_seen)(mailserver_socket, ctl, num);
-		if (err != 0)
+		if (outlevel > O_SILENT) 
+		    report_complete(stdout, GT_(" retained\n"));
+	    }
+	    else if (seen)
+	    {
+		/* a header rule keeps it on the server, but not as new mail */
+		if (outlevel > O_SILENT)
+		    report_complete(stdout, GT_(" kept\n"));
+		if (ctl->server.base_protocol->mark_seen
+			&& (err = (ctl->server.base_protocol->mark_seen)(mailserver_socket, ctl, num)))
 		    return(err);
 	    }
+	    else if ((err = flag_message(mailserver_socket, ctl, num, msgcode,
+					 suppress_delete, FALSE, deletions)))
+		return(err);
 	}
 
 	/* perhaps this as many as we're ready to handle */
@@ -845,7 +1079,8 @@ flagthemail:
 	}
     } /* for (num = 1; num <= count; num++) */
 
-    return(PS_SUCCESS);
+    /* the last messages fetched may still await their verdict */
+    return(eom_settle(mailserver_socket, ctl, 0, deletions));
 }
 
 /* retrieve messages from server using given protocol method table */
@@ -870,6 +1105,7 @@ static int do_session(
     pass = 0;
     err = 0;
     init_transact(proto);
+    forget_host_aliases();
 
     /* set up the server-nonresponse timeout */
     alrmsave = set_signal_handler(SIGALRM, timeout_handler);
@@ -890,6 +1126,9 @@ static int do_session(
 	if (ai1) {
 	    fm_freeaddrinfo(ai1); ai1 = NULL;
 	}
+
+	/* an unread end-of-message reply would confuse the warning mail */
+	eom_abandon(ctl);
 	
 	if (js == THROW_TIMEOUT)
 	{
@@ -1313,23 +1552,23 @@ is restored."));
 
 		if (outlevel >= O_DEBUG)
 		{
-		    if (idp->id)
-			report(stdout, GT_("selecting or re-polling folder %s\n"), idp->id);
+		    if (ctl->folder)
+			report(stdout, GT_("selecting or re-polling folder %s\n"), ctl->folder);
 		    else
 			report(stdout, GT_("selecting or re-polling default folder\n"));
 		}
 
 		/* compute # of messages and number of new messages waiting */
 		stage = STAGE_GETRANGE;
-		err = (ctl->server.base_protocol->getrange)(mailserver_socket, ctl, idp->id, &count, &newm, &bytes);
+		err = (ctl->server.base_protocol->getrange)(mailserver_socket, ctl, ctl->folder, &count, &newm, &bytes);
 		if (err != 0)
 		    goto cleanUp;
 
 		/* show user how many messages we downloaded */
-		if (idp->id)
+		if (ctl->folder)
 		    (void) snprintf(buf, sizeof(buf),
 				   GT_("%s at %s (folder %s)"),
-				   ctl->remotename, ctl->server.pollname, idp->id);
+				   ctl->remotename, ctl->server.pollname, ctl->folder);
 		else
 		    (void) snprintf(buf, sizeof(buf), GT_("%s at %s"),
 				   ctl->remotename, ctl->server.pollname);
@@ -1466,6 +1705,13 @@ is restored."));
 			goto cleanUp;
 		    }
 		}
+		/*
+		 * An idling session never gets back to the main loop,
+		 * so deliver what it has spooled before idling again.
+		 */
+		if (ctl->idle && ctl->spool && !check_only)
+		    drain_spool(ctl);
+
 		/* Return now if we have reached the fetchlimit */
 		if (maxfetch && maxfetch <= fetches)
 		    goto no_error;
@@ -1499,12 +1745,14 @@ is restored."));
 	 * inactivity timeout, and (2) some MTAs (like smail) don't
 	 * deliver after each message, but rather queue up mail and
 	 * wait to actually deliver it until the input socket is
-	 * closed.
+	 * closed.  So connections are only kept for reuse when the
+	 * user asked for it with "set smtpidle".
 	 *
 	 * don't send QUIT for ODMR case because we're acting as a
 	 * proxy between the SMTP server and client.
 	 */
-	smtp_close(ctl, ctl->server.protocol != P_ODMR);
+	finish_sink(ctl);
+	smtp_park(ctl);
 	cleanupSockClose(mailserver_socket);
 	goto closeUp;
 
@@ -1516,8 +1764,11 @@ is restored."));
 	    (ctl->server.base_protocol->logout_cmd)(mailserver_socket, ctl);
 	}
 
-	/* try to clean up all streams */
+	/* try to clean up all streams; messages still waiting for
+	 * their delivery verdict stay on the server */
+	eom_abandon(ctl);
 	release_sink(ctl);
+	finish_sink(ctl);
 	/*
 	 * Sending SMTP QUIT on signal is theoretically nice, but led
 	 * to a subtle bug.  If fetchmail was terminated by signal
@@ -1603,6 +1854,243 @@ closeUp:
     return(err);
 }
 
+static int merge_session_status(int err, int newerr)
+/* combine the outcomes of two sessions polling disjoint folders */
+{
+    /* a real error from any connection wins, then actual fetches */
+    if (err != PS_SUCCESS && err != PS_NOMAIL && err != PS_MAXFETCH)
+	return(err);
+    if (newerr != PS_SUCCESS && newerr != PS_NOMAIL && newerr != PS_MAXFETCH)
+	return(newerr);
+    if (err == PS_NOMAIL)
+	return(newerr);
+    return(err);
+}
+
+/*
+ * Connections beyond the first that poll a query's folders, each in a
+ * process of its own; see do_folder_sessions().  With idle they outlive
+ * the poll cycle that started them.
+ */
+struct folder_conn
+{
+    struct folder_conn	*next;
+    struct query	*ctl;
+    int			part;	/* which share of the folders it polls */
+    pid_t		pid;
+    int			fd;	/* its struct folder_state comes here */
+};
+static struct folder_conn *folder_conns;
+
+/* what a connection's process reports back when it is done */
+struct folder_state
+{
+    int	status;			/* the session's PS_* status */
+    int	errcount;
+    int	authfailcount;
+    int	wehaveauthed;
+    int	wehavesentauthnote;
+    int	wedged;
+};
+
+static int folder_share(int maxfetch, int nconns, int part)
+/* each connection gets its share of the fetch limit */
+{
+    if (!maxfetch)
+	return(0);
+    return(maxfetch / nconns + (part < maxfetch % nconns));
+}
+
+static flag folder_conn_reap(struct folder_conn **fcp, flag block, int *err)
+/* collect a connection that is done, merging what it learned into the
+ * query; without block, leave one that is still running alone */
+{
+    struct folder_conn *fc = *fcp;
+    struct query *ctl = fc->ctl;
+    struct folder_state st;
+    pid_t pid;
+
+    /* ECHILD: the daemon's SIGCHLD handler has reaped it already */
+    while ((pid = waitpid(fc->pid, NULL, block ? 0 : WNOHANG)) < 0
+	    && errno == EINTR)
+	continue;
+    if (pid == 0)
+	return(FALSE);
+
+    /* IMAP keeps no UID lists, so the rest is auth and error state */
+    if (read(fc->fd, &st, sizeof(st)) == sizeof(st))
+    {
+	*err = merge_session_status(*err, st.status);
+	ctl->errcount += st.errcount;
+	if (st.authfailcount > ctl->authfailcount)
+	    ctl->authfailcount = st.authfailcount;
+	ctl->wehaveauthed |= st.wehaveauthed;
+	ctl->wehavesentauthnote |= st.wehavesentauthnote;
+	ctl->wedged |= st.wedged;
+    }
+    else
+    {
+	report(stderr, GT_("folder connection %d terminated abnormally\n"), fc->part);
+	*err = merge_session_status(*err, PS_UNDEFINED);
+    }
+    close(fc->fd);
+    *fcp = fc->next;
+    free(fc);
+    return(TRUE);
+}
+
+void kill_folder_conns(void)
+/* stop the connections polling folders in processes of their own */
+{
+    struct folder_conn *fc;
+
+    for (fc = folder_conns; fc; fc = fc->next)
+	kill(fc->pid, SIGTERM);
+    while ((fc = folder_conns) != NULL)
+    {
+	while (waitpid(fc->pid, NULL, 0) < 0 && errno == EINTR)
+	    continue;
+	close(fc->fd);
+	folder_conns = fc->next;
+	free(fc);
+    }
+}
+
+static int do_folder_sessions(
+	/* parsed options with merged-in defaults */
+	struct query *ctl,
+	/* protocol method table */
+	const struct method *proto,
+	/* maximum number of messages to fetch */
+	const int maxfetch)
+/* poll the selected folders over up to `folderconns' parallel connections */
+{
+    struct idlist *mailboxes = ctl->mailboxes, *idp, **parts;
+    struct folder_conn *fc, **fcp;
+    SIGHANDLERTYPE chldsave;
+    flag *mine;
+    int nconns = NUM_VALUE_OUT(ctl->folderconns), nfolders = 0;
+    int i, err, fds[2];
+    pid_t pid;
+
+    for (idp = mailboxes; idp; idp = idp->next)
+	nfolders++;
+    if (nconns > nfolders)
+	nconns = nfolders;
+    if (maxfetch && nconns > maxfetch)
+	nconns = maxfetch;
+
+    /*
+     * Deal the folders out round-robin.  Each connection is a
+     * process of its own, so the protocol module's folder state
+     * (message counts, expunge bookkeeping, capabilities) stays
+     * private to the connection that SELECTed the folder.
+     */
+    parts = (struct idlist **)xmalloc(nconns * sizeof(struct idlist *));
+    memset(parts, '\0', nconns * sizeof(struct idlist *));
+    for (i = 0, idp = mailboxes; idp; idp = idp->next, i = (i + 1) % nconns)
+	save_str(&parts[i], idp->id, 0);
+    mine = (flag *)xmalloc(nconns * sizeof(flag));
+    memset(mine, '\0', nconns * sizeof(flag));
+
+    /* we reap our own children; don't let the daemon handler eat them */
+    chldsave = set_signal_handler(SIGCHLD, SIG_DFL);
+    fflush(stdout);
+    fflush(stderr);
+
+    err = PS_NOMAIL;
+    for (i = 1; i < nconns; i++)
+    {
+	/* an idling connection from an earlier cycle may still be at it */
+	for (fcp = &folder_conns; (fc = *fcp) != NULL; fcp = &fc->next)
+	    if (fc->ctl == ctl && fc->part == i)
+		break;
+	if (fc && !folder_conn_reap(fcp, FALSE, &err))
+	    continue;
+
+	if (pipe(fds) == -1)
+	    pid = -1;
+	else if ((pid = fork()) == 0)
+	{
+	    struct folder_state st;
+
+	    close(fds[0]);
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	    /* the parent's pooled listener sockets are not ours to use,
+	     * nor are its lock file and end-of-run cleanup */
+	    smtp_pool_close(0);
+	    set_signal_handler(SIGHUP, SIG_DFL);
+	    set_signal_handler(SIGINT, SIG_DFL);
+	    set_signal_handler(SIGQUIT, SIG_DFL);
+	    set_signal_handler(SIGTERM, SIG_DFL);
+	    ctl->mailboxes = parts[i];
+	    st.status = do_session(ctl, proto, folder_share(maxfetch, nconns, i));
+	    st.errcount = ctl->errcount;
+	    st.authfailcount = ctl->authfailcount;
+	    st.wehaveauthed = ctl->wehaveauthed;
+	    st.wehavesentauthnote = ctl->wehavesentauthnote;
+	    st.wedged = ctl->wedged;
+	    if (write(fds[1], &st, sizeof(st)) != sizeof(st))
+		_exit(PS_UNDEFINED);
+	    _exit(st.status);
+	}
+	else
+	{
+	    close(fds[1]);
+	    if (pid < 0)
+		close(fds[0]);
+	}
+
+	if (pid < 0)
+	{
+	    report(stderr, GT_("fork for folder connection failed: %s\n"),
+		   strerror(errno));
+	    mine[i] = TRUE;
+	    continue;
+	}
+	fc = (struct folder_conn *)xmalloc(sizeof(struct folder_conn));
+	fc->ctl = ctl;
+	fc->part = i;
+	fc->pid = pid;
+	fc->fd = fds[0];
+	fc->next = folder_conns;
+	folder_conns = fc;
+	if (outlevel >= O_DEBUG)
+	    report(stdout, GT_("folder connection %d is process %ld\n"),
+		   i, (long)pid);
+    }
+
+    ctl->mailboxes = parts[0];
+    err = merge_session_status(err,
+		do_session(ctl, proto, folder_share(maxfetch, nconns, 0)));
+
+    /* poll the share of any connection we failed to start ourselves */
+    for (i = 1; i < nconns; i++)
+	if (mine[i])
+	{
+	    ctl->mailboxes = parts[i];
+	    err = merge_session_status(err,
+			do_session(ctl, proto, folder_share(maxfetch, nconns, i)));
+	}
+
+    /*
+     * Wait for the other connections, unless they idle: those go on
+     * watching their folders while we get back to the other accounts,
+     * and are reaped in a later cycle or stopped at the end of the run.
+     */
+    for (fcp = &folder_conns; (fc = *fcp) != NULL; )
+	if (fc->ctl != ctl || !folder_conn_reap(fcp, !ctl->idle, &err))
+	    fcp = &fc->next;
+
+    set_signal_handler(SIGCHLD, chldsave);
+    ctl->mailboxes = mailboxes;
+    for (i = 0; i < nconns; i++)
+	free_str_list(&parts[i]);
+    free(parts);
+    free(mine);
+    return(err);
+}
+
 /** retrieve messages from server using given protocol method table */
 int do_protocol(struct query *ctl /** parsed options with merged-in defaults */,
 		const struct method *proto /** protocol method table */)
@@ -1657,7 +2145,13 @@ int do_protocol(struct query *ctl /** parsed options with merged-in defaults */,
      */
     if ((ctl->keep && !ctl->flush) ||
 	proto->retry || !NUM_SPECIFIED(ctl->expunge))
+    {
+	/* several folders on a re-pollable protocol may go in parallel */
+	if (proto->retry && NUM_VALUE_OUT(ctl->folderconns) > 1
+		&& ctl->mailboxes && ctl->mailboxes->next)
+	    return(do_folder_sessions(ctl, proto, NUM_VALUE_OUT(ctl->fetchlimit)));
 	return(do_session(ctl, proto, NUM_VALUE_OUT(ctl->fetchlimit)));
+    }
     /*
      * There's an expunge limit, and it isn't handled in the driver itself.
      * OK; do multiple sessions, each fetching a limited # of messages.
@@ -0,0 +1,378 @@
+/*
+ * dupdb.c -- index of delivered messages, shared by all accounts and runs
+ *
+ * The index maps a digest of a message's Message-ID and a local
+ * recipient to the time the message was delivered to that recipient,
+ * so that a copy of the same message fetched through another account,
+ * or in a later run, is not delivered again.
+ *
+ * On disk it is a log of fixed-size records that every fetchmail
+ * process using the file appends to.  In memory it is an open-addressing
+ * hash table that picks up records appended by other processes before
+ * each lookup.  Expired records are weeded out by rewriting the log
+ * after a poll cycle once they make up most of it.
+ *
+ * For license terms, see the file COPYING in this directory.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fetchmail.h"
+#include "fm_md5.h"
+#include "i18n.h"
+#include "tunable.h"
+
+#define DUP_KEYLEN	8			/* digest bytes kept per entry */
+#define DUP_RECLEN	(DUP_KEYLEN + 4)	/* key, big-endian delivery time */
+
+struct dup_ent
+{
+    unsigned char	key[DUP_KEYLEN];
+    unsigned long	when;		/* 0 marks a free slot */
+};
+
+static struct dup_ent *dup_tab;
+static size_t dup_size, dup_count;	/* slots, and slots in use */
+
+static int dup_fd = -1;
+static dev_t dup_dev;
+static ino_t dup_ino;
+static off_t dup_loaded;		/* log records read up to here */
+static long dup_records;		/* records in the log, live or not */
+
+/* keys of messages whose delivery verdict is still open */
+struct dup_pend
+{
+    int			num;
+    char		*rcpt;
+    unsigned char	key[DUP_KEYLEN];
+};
+static struct dup_pend *dup_pending;
+static int dup_npending, dup_maxpending;
+
+static void dup_key(const char *msgid, const char *rcpt, unsigned char *key)
+/* digest a Message-ID header body and a recipient into an index key */
+{
+    MD5_CTX context;
+    unsigned char digest[16];
+    const char *cp;
+
+    MD5Init(&context);
+    /* unfold the header and ignore white space */
+    for (cp = msgid; *cp; cp++)
+    {
+	if (*cp == '\n' && cp[1] != ' ' && cp[1] != '\t')
+	    break;
+	if (!isspace((unsigned char)*cp))
+	    MD5Update(&context, cp, 1);
+    }
+    MD5Update(&context, "", 1);
+    MD5Update(&context, rcpt, strlen(rcpt));
+    MD5Final(digest, &context);
+    memcpy(key, digest, DUP_KEYLEN);
+}
+
+static flag dup_live(unsigned long when, time_t now)
+/* is an entry younger than DUP_EXPIRE? */
+{
+    return(when != 0 && (unsigned long)now - when < DUP_EXPIRE);
+}
+
+static struct dup_ent *dup_slot(const unsigned char *key)
+/* find the slot holding key, or the free slot it belongs in */
+{
+    size_t i;
+
+    i = ((size_t)key[0] | (size_t)key[1] << 8
+	 | (size_t)key[2] << 16 | (size_t)key[3] << 24) & (dup_size - 1);
+    while (dup_tab[i].when && memcmp(dup_tab[i].key, key, DUP_KEYLEN))
+	i = (i + 1) & (dup_size - 1);
+    return(&dup_tab[i]);
+}
+
+static void dup_insert(const unsigned char *key, unsigned long when,
+		       time_t now)
+/* enter a delivery into the table unless it has expired */
+{
+    struct dup_ent *ep;
+
+    if (!dup_live(when, now))
+	return;
+
+    /* keep the table at most half full */
+    if (2 * (dup_count + 1) > dup_size)
+    {
+	struct dup_ent *old = dup_tab;
+	size_t i, oldsize = dup_size;
+
+	dup_size = dup_size ? 2 * dup_size : 1024;
+	dup_tab = (struct dup_ent *)xmalloc(dup_size * sizeof(struct dup_ent));
+	memset(dup_tab, '\0', dup_size * sizeof(struct dup_ent));
+	for (i = 0; i < oldsize; i++)
+	    if (old[i].when)
+		*dup_slot(old[i].key) = old[i];
+	xfree(old);
+    }
+
+    ep = dup_slot(key);
+    if (!ep->when)
+    {
+	memcpy(ep->key, key, DUP_KEYLEN);
+	dup_count++;
+    }
+    if (when > ep->when)
+	ep->when = when;
+}
+
+static void dup_read(void)
+/* read the log records that were appended since the last call */
+{
+    unsigned char buf[DUP_RECLEN * 512];
+    ssize_t n;
+    time_t now = time(NULL);
+
+    /* pread() because forked folder connections share the file offset */
+    while ((n = pread(dup_fd, buf, sizeof(buf), dup_loaded)) >= DUP_RECLEN)
+    {
+	unsigned char *rp;
+
+	n -= n % DUP_RECLEN;	/* a record still being written */
+	for (rp = buf; rp < buf + n; rp += DUP_RECLEN)
+	{
+	    dup_insert(rp, (unsigned long)rp[DUP_KEYLEN] << 24
+		       | (unsigned long)rp[DUP_KEYLEN + 1] << 16
+		       | (unsigned long)rp[DUP_KEYLEN + 2] << 8
+		       | (unsigned long)rp[DUP_KEYLEN + 3], now);
+	    dup_records++;
+	}
+	dup_loaded += n;
+    }
+}
+
+static int dup_open(void)
+/* make sure the log open is the one named by run.dupfile */
+{
+    struct stat st;
+
+    if (dup_fd != -1)
+    {
+	/* another process may have rewritten it */
+	if (stat(run.dupfile, &st) == 0
+		&& st.st_dev == dup_dev && st.st_ino == dup_ino)
+	    return(0);
+	close(dup_fd);
+	dup_fd = -1;
+    }
+
+    if ((dup_fd = open(run.dupfile, O_RDWR | O_CREAT | O_APPEND, 0600)) == -1
+	    || fstat(dup_fd, &st) == -1)
+    {
+	report(stderr, GT_("cannot open duplicate index %s: %s\n"),
+	       run.dupfile, strerror(errno));
+	if (dup_fd != -1)
+	    close(dup_fd);
+	dup_fd = -1;
+	return(-1);
+    }
+    dup_dev = st.st_dev;
+    dup_ino = st.st_ino;
+
+    /* start over, the new log holds everything the old one did */
+    if (dup_tab)
+	memset(dup_tab, '\0', dup_size * sizeof(struct dup_ent));
+    dup_count = 0;
+    dup_loaded = 0;
+    dup_records = 0;
+    dup_read();
+    return(0);
+}
+
+static int dup_lock(short type, int cmd)
+/* lock or unlock the whole log */
+{
+    struct flock fl;
+
+    memset(&fl, '\0', sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    return(fcntl(dup_fd, cmd, &fl));
+}
+
+int dup_check(int num, const char *msgid, const char *rcpt)
+/* has message num been delivered to rcpt before?  If not, its key is
+ * kept until dup_settle() learns whether this delivery succeeded */
+{
+    unsigned char key[DUP_KEYLEN];
+    struct dup_ent *ep;
+    struct stat st;
+
+    if (dup_open() == -1)
+	return(FALSE);
+    if (fstat(dup_fd, &st) == 0 && st.st_size > dup_loaded)
+	dup_read();
+
+    dup_key(msgid, rcpt, key);
+    if (dup_tab)
+    {
+	ep = dup_slot(key);
+	if (dup_live(ep->when, time(NULL)))
+	    return(TRUE);
+    }
+
+    if (dup_npending >= dup_maxpending)
+    {
+	dup_maxpending = dup_maxpending ? 2 * dup_maxpending : 16;
+	dup_pending = (struct dup_pend *)xrealloc(dup_pending,
+		dup_maxpending * sizeof(struct dup_pend));
+    }
+    dup_pending[dup_npending].num = num;
+    dup_pending[dup_npending].rcpt = xstrdup(rcpt);
+    memcpy(dup_pending[dup_npending].key, key, DUP_KEYLEN);
+    dup_npending++;
+    return(FALSE);
+}
+
+void dup_settle(int num, flag delivered)
+/* record message num as delivered to the recipients dup_check() saw,
+ * or forget about them */
+{
+    unsigned char *buf, *rp;
+    unsigned long now = (unsigned long)time(NULL);
+    int i, j;
+
+    buf = rp = (unsigned char *)xmalloc(dup_npending * DUP_RECLEN + 1);
+    for (i = j = 0; i < dup_npending; i++)
+    {
+	if (dup_pending[i].num != num)
+	{
+	    dup_pending[j++] = dup_pending[i];
+	    continue;
+	}
+	if (delivered)
+	{
+	    memcpy(rp, dup_pending[i].key, DUP_KEYLEN);
+	    rp[DUP_KEYLEN] = (now >> 24) & 0xff;
+	    rp[DUP_KEYLEN + 1] = (now >> 16) & 0xff;
+	    rp[DUP_KEYLEN + 2] = (now >> 8) & 0xff;
+	    rp[DUP_KEYLEN + 3] = now & 0xff;
+	    dup_insert(rp, now, (time_t)now);
+	    rp += DUP_RECLEN;
+	}
+	free(dup_pending[i].rcpt);
+    }
+    dup_npending = j;
+
+    /*
+     * Append under a shared lock, so that dup_expire() in another
+     * process can't move the log away underneath us.  If it did so
+     * while we waited for the lock, append to its successor.
+     */
+    while (rp > buf && dup_open() == 0)
+    {
+	struct stat st;
+
+	if (dup_lock(F_RDLCK, F_SETLKW) == -1)
+	    break;
+	if (stat(run.dupfile, &st) == 0
+		&& st.st_dev == dup_dev && st.st_ino == dup_ino)
+	{
+	    if (write(dup_fd, buf, rp - buf) != rp - buf)
+		report(stderr, GT_("cannot write duplicate index %s: %s\n"),
+		       run.dupfile, strerror(errno));
+	    dup_lock(F_UNLCK, F_SETLK);
+	    break;
+	}
+	dup_lock(F_UNLCK, F_SETLK);
+    }
+    free(buf);
+}
+
+void dup_drop(int num, const char *rcpt)
+/* forget the key of message num for rcpt, who is to get it again */
+{
+    int i, j;
+
+    for (i = j = 0; i < dup_npending; i++)
+	if (dup_pending[i].num == num && strcmp(dup_pending[i].rcpt, rcpt) == 0)
+	    free(dup_pending[i].rcpt);
+	else
+	    dup_pending[j++] = dup_pending[i];
+    dup_npending = j;
+}
+
+void dup_forget(void)
+/* drop the keys of all messages whose verdict we won't learn */
+{
+    while (dup_npending > 0)
+	free(dup_pending[--dup_npending].rcpt);
+}
+
+void dup_expire(void)
+/* rewrite the log without expired records once they are the majority */
+{
+    char *newnam;
+    unsigned char *buf, *rp;
+    time_t now = time(NULL);
+    size_t i;
+    int fd;
+
+    if (!run.dupfile || dup_fd == -1 || dup_open() == -1)
+	return;
+    if (dup_records < DUP_MINREWRITE || dup_records < 2 * (long)dup_count)
+	return;
+
+    /* somebody else is at it, or appending; try again next time */
+    if (dup_lock(F_WRLCK, F_SETLK) == -1)
+	return;
+    dup_read();
+
+    buf = rp = (unsigned char *)xmalloc(dup_count * DUP_RECLEN + 1);
+    for (i = 0; i < dup_size; i++)
+	if (dup_live(dup_tab[i].when, now))
+	{
+	    memcpy(rp, dup_tab[i].key, DUP_KEYLEN);
+	    rp[DUP_KEYLEN] = (dup_tab[i].when >> 24) & 0xff;
+	    rp[DUP_KEYLEN + 1] = (dup_tab[i].when >> 16) & 0xff;
+	    rp[DUP_KEYLEN + 2] = (dup_tab[i].when >> 8) & 0xff;
+	    rp[DUP_KEYLEN + 3] = dup_tab[i].when & 0xff;
+	    rp += DUP_RECLEN;
+	}
+
+    newnam = (char *)xmalloc(strlen(run.dupfile) + 2);
+    strcpy(newnam, run.dupfile);
+    strcat(newnam, "_");
+    (void)unlink(newnam);
+    if ((fd = open(newnam, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1
+	    || write(fd, buf, rp - buf) != rp - buf
+	    || fsync(fd) == -1
+	    || close(fd) == -1
+	    || rename(newnam, run.dupfile) == -1)
+    {
+	report(stderr, GT_("cannot rewrite duplicate index %s: %s\n"),
+	       run.dupfile, strerror(errno));
+	(void)unlink(newnam);
+    }
+    else if (outlevel >= O_DEBUG)
+	report(stdout, GT_("duplicate index %s rewritten, %ld of %ld records kept\n"),
+	       run.dupfile, (long)((rp - buf) / DUP_RECLEN), dup_records);
+    free(newnam);
+    free(buf);
+
+    /* closing the old log drops our lock, waiting appenders move on */
+    close(dup_fd);
+    dup_fd = -1;
+    (void)dup_open();
+}
+
+/* dupdb.c ends here */
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef HAVE_SETRLIMIT
 #include <sys/resource.h>
 #endif /* HAVE_SETRLIMIT */
@@ -86,6 +87,7 @@ static time_t parsetime;	/* time of last parse */
 
 static RETSIGTYPE terminate_run(int);
 static RETSIGTYPE terminate_poll(int);
+static void drain_spools(void);
 
 #if defined(__FreeBSD__) && defined(__FreeBSD_USE_KVM)
 /* drop SGID kmem privileage until we need it */
@@ -651,6 +653,9 @@ int main(int argc, char **argv)
     set_signal_handler(SIGALRM, terminate_run);
     set_signal_handler(SIGPIPE, SIG_IGN);
     set_signal_handler(SIGQUIT, terminate_run);
+    /* unless it is a wakeup call, SIGHUP ends the run like SIGTERM */
+    if (!(run.poll_interval && getuid() == ROOT_UID))
+	set_signal_handler(SIGHUP, terminate_run);
 
     /* here's the exclusion lock */
     fm_lock_or_die();
@@ -714,6 +719,7 @@ int main(int argc, char **argv)
 	     * path wasn't used in the initial call.  (If I recall
 	     * correctly, Linux saves it but many other Unices don't.)
 	     */
+	    kill_folder_conns();
 	    execvp(argv[0], argv);
 	    report(stderr, GT_("attempt to re-exec fetchmail failed\n"));
 	}
@@ -845,6 +851,15 @@ int main(int argc, char **argv)
 	/* close connections cleanly */
 	terminate_poll(0);
 
+	/* deliver what the polls have spooled */
+	drain_spools();
+
+	/* weed out expired entries of the duplicate index */
+	dup_expire();
+
+	/* pooled listener connections would go stale while we sleep */
+	smtp_pool_expire(run.poll_interval);
+
 	/*
 	 * OK, we've polled.  Now sleep.
 	 */
@@ -904,6 +919,8 @@ int main(int argc, char **argv)
 #endif
 		for (ctl = querylist; ctl; ctl = ctl->next)
 		    ctl->wedged = FALSE;
+		/* idling folder connections start afresh as well */
+		kill_folder_conns();
 	    }
 
 	    if ((outlevel > O_SILENT && !run.use_syslog && isatty(1))
@@ -984,11 +1001,16 @@ static void optmerge(struct query *h2, struct query *h1, int force)
     FLAG_MERGE(password);
     FLAG_MERGE(mda);
     FLAG_MERGE(bsmtp);
+    FLAG_MERGE(bsmtpcompress);
+    FLAG_MERGE(maildir);
+    FLAG_MERGE(mbox);
+    FLAG_MERGE(spool);
     FLAG_MERGE(listener);
     FLAG_MERGE(smtpaddress);
     FLAG_MERGE(smtpname);
     FLAG_MERGE(preconnect);
     FLAG_MERGE(postconnect);
+    FLAG_MERGE(rules);
 
     FLAG_MERGE(keep);
     FLAG_MERGE(flush);
@@ -1020,6 +1042,11 @@ static void optmerge(struct query *h2, struct query *h1, int force)
     FLAG_MERGE(sslfingerprint);
 #endif
     FLAG_MERGE(expunge);
+    FLAG_MERGE(folderconns);
+    FLAG_MERGE(mdajobs);
+    FLAG_MERGE(maildirsync);
+    FLAG_MERGE(mboxsync);
+    FLAG_MERGE(bsmtpsync);
 
     FLAG_MERGE(properties);
 #undef FLAG_MERGE
@@ -1160,9 +1187,15 @@ static int load_params(int argc, char **argv, int optind)
 	run.idfile = cmd_run.idfile;
     if (cmd_run.pidfile)
 	run.pidfile = cmd_run.pidfile;
+    if (cmd_run.dupfile)
+	run.dupfile = cmd_run.dupfile;
+    if (cmd_run.digest)
+	run.digest = cmd_run.digest;
     /* do this before the keep/fetchall test below, otherwise -d0 may fail */
     if (cmd_run.poll_interval >= 0)
 	run.poll_interval = cmd_run.poll_interval;
+    if (cmd_run.smtpidle >= 0)
+	run.smtpidle = cmd_run.smtpidle;
     if (cmd_run.invisible)
 	run.invisible = (cmd_run.invisible == FLAG_TRUE);
     if (cmd_run.showdots)
@@ -1248,7 +1281,8 @@ static int load_params(int argc, char **argv, int optind)
 	    DEFAULT(ctl->flush, FALSE);
 	    DEFAULT(ctl->limitflush, FALSE);
 	    DEFAULT(ctl->rewrite, TRUE);
-	    DEFAULT(ctl->stripcr, (ctl->mda != (char *)NULL)); 
+	    DEFAULT(ctl->stripcr, (ctl->mda != (char *)NULL || ctl->maildir != (char *)NULL
+				   || ctl->mbox != (char *)NULL || ctl->spool != (char *)NULL));
 	    DEFAULT(ctl->forcecr, FALSE);
 	    DEFAULT(ctl->pass8bits, FALSE);
 	    DEFAULT(ctl->dropstatus, FALSE);
@@ -1311,6 +1345,10 @@ static int load_params(int argc, char **argv, int optind)
 	    if (!ctl->localnames)	/* for local delivery via SMTP */
 		save_str_pair(&ctl->localnames, user, NULL);
 
+	    /* multidrop mapping looks these up for every address */
+	    idhash_index(&ctl->localindex, ctl->localnames);
+	    idhash_index(&ctl->server.domainindex, ctl->server.localdomains);
+
 #ifndef HAVE_RES_SEARCH
 	    /* can't handle multidrop mailboxes unless we can do DNS lookups */
 	    if (MULTIDROP(ctl) && ctl->server.dns)
@@ -1357,6 +1395,23 @@ static int load_params(int argc, char **argv, int optind)
 		    exit(PS_SYNTAX);
 		}
 	    }
+	    if (ctl->spool && (ctl->maildir || ctl->mbox || ctl->bsmtp || ctl->mda))
+	    {
+		report(stderr, GT_("%s: spool only stages mail for the SMTP/LMTP listener, ignored\n"),
+		       ctl->server.pollname);
+		ctl->spool = (char *)NULL;
+	    }
+	    if (NUM_VALUE_OUT(ctl->mdajobs) > 1 && !ctl->mda)
+		report(stderr, GT_("%s: mdajobs only applies to MDA delivery, ignored\n"),
+		       ctl->server.pollname);
+	    /* the connections' processes can't share the BSMTP stream */
+	    if (NUM_VALUE_OUT(ctl->folderconns) > 1
+		    && ctl->bsmtp && !ctl->maildir && !ctl->mbox)
+	    {
+		report(stderr, GT_("%s: folderconns does not work with bsmtp, ignored\n"),
+		       ctl->server.pollname);
+		ctl->folderconns = NUM_VALUE_IN(1);
+	    }
 	    if (ctl->listener == LMTP_MODE)
 	    {
 		struct idlist	*idp;
@@ -1404,6 +1459,50 @@ static int load_params(int argc, char **argv, int optind)
     return(implicitmode);
 }
 
+static void drain_spools(void)
+/* deliver spooled mail; a daemon leaves that to a child process, so the
+ * next poll need not wait for a slow listener */
+{
+    static pid_t drainer;
+    struct query *ctl;
+
+    for (ctl = querylist; ctl; ctl = ctl->next)
+	if (ctl->active && ctl->spool)
+	    break;
+    if (!ctl || check_only)
+	return;
+
+    if (!run.poll_interval)
+    {
+	for (; ctl; ctl = ctl->next)
+	    if (ctl->active && ctl->spool)
+		drain_spool(ctl);
+	return;
+    }
+
+    /* the last drainer may still be at work */
+    if (drainer > 0 && waitpid(drainer, NULL, WNOHANG) == 0)
+	return;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((drainer = fork()) == 0)
+    {
+	/* the parent's pooled listener sockets are not ours to use */
+	smtp_pool_close(0);
+	for (; ctl; ctl = ctl->next)
+	    if (ctl->active && ctl->spool)
+		drain_spool(ctl);
+	smtp_pool_close(1);
+	_exit(0);
+    }
+    else if (drainer < 0)
+    {
+	report(stderr, GT_("fork for spool delivery failed: %s\n"), strerror(errno));
+	drainer = 0;
+    }
+}
+
 static RETSIGTYPE terminate_poll(int sig)
 /* to be executed at the end of a poll cycle */
 {
@@ -1429,6 +1528,12 @@ static RETSIGTYPE terminate_run(int sig)
 
     terminate_poll(sig);
 
+    /* folder connections idling in processes of their own end with us */
+    kill_folder_conns();
+
+    /* don't talk to the listeners if we were interrupted */
+    smtp_pool_close(sig == 0);
+
     /* 
      * Craig Metz, the RFC1938 one-time-password guy, points out:
      * "Remember that most kernels don't zero pages before handing them to the
@@ -1578,10 +1683,16 @@ static void dump_params (struct runctl *runp,
 
     if (runp->poll_interval)
 	printf(GT_("Poll interval is %d seconds\n"), runp->poll_interval);
+    if (runp->smtpidle > 0)
+	printf(GT_("Idle SMTP connections are kept open for %d seconds\n"), runp->smtpidle);
     if (runp->logfile)
 	printf(GT_("Logfile is %s\n"), runp->logfile);
     if (strcmp(runp->idfile, IDFILE_NAME))
 	printf(GT_("Idfile is %s\n"), runp->idfile);
+    if (runp->dupfile)
+	printf(GT_("Messages delivered before are skipped using index %s\n"), runp->dupfile);
+    if (runp->digest)
+	printf(GT_("Multidrop duplicates are detected by %s digest\n"), digest_name(runp->digest));
 #if defined(HAVE_SYSLOG)
     if (runp->use_syslog)
 	printf(GT_("Progress messages will be logged via syslog\n"));
@@ -1809,6 +1920,10 @@ static void dump_params (struct runctl *runp,
 		    printf(GT_("  Deletion interval between expunges forced to %d (--expunge %d).\n"), ctl->expunge, ctl->expunge);
 		else if (outlevel >= O_VERBOSE)
 		    printf(GT_("  No forced expunges (--expunge 0).\n"));
+		if (NUM_NONZERO(ctl->folderconns) && ctl->folderconns > 1)
+		    printf(GT_("  Up to %d folders will be polled in parallel (--folderconns %d).\n"), ctl->folderconns, ctl->folderconns);
+		else if (outlevel >= O_VERBOSE)
+		    printf(GT_("  Folders will be polled one at a time (--folderconns 1).\n"));
 	    }
 	}
 	else	/* ODMR or ETRN */
@@ -1824,10 +1939,38 @@ static void dump_params (struct runctl *runp,
 	    }
 	    printf("\n");
 	}
-	if (ctl->bsmtp)
+	if (ctl->bsmtp && !ctl->maildir && !ctl->mbox)
+	{
 	    printf(GT_("  Messages will be appended to %s as BSMTP\n"), visbuf(ctl->bsmtp));
+	    if (ctl->bsmtpcompress)
+		printf(GT_("  BSMTP output will be compressed with %s.\n"), visbuf(ctl->bsmtpcompress));
+	    if (NUM_VALUE_OUT(ctl->bsmtpsync) > 1)
+		printf(GT_("  Up to %d messages will be synced together (--bsmtpsync %d).\n"),
+		       NUM_VALUE_OUT(ctl->bsmtpsync), NUM_VALUE_OUT(ctl->bsmtpsync));
+	    else if (NUM_VALUE_OUT(ctl->bsmtpsync) == 1)
+		printf(GT_("  Each message will be synced to disk.\n"));
+	}
+	else if (ctl->maildir)
+	{
+	    printf(GT_("  Messages will be delivered to Maildir %s\n"), visbuf(ctl->maildir));
+	    if (NUM_VALUE_OUT(ctl->maildirsync) > 1)
+		printf(GT_("  Up to %d messages will be synced together (--maildirsync %d).\n"),
+		       NUM_VALUE_OUT(ctl->maildirsync), NUM_VALUE_OUT(ctl->maildirsync));
+	}
+	else if (ctl->mbox)
+	{
+	    printf(GT_("  Messages will be appended to mbox %s\n"), visbuf(ctl->mbox));
+	    if (NUM_VALUE_OUT(ctl->mboxsync) > 1)
+		printf(GT_("  Up to %d messages will be appended under one lock (--mboxsync %d).\n"),
+		       NUM_VALUE_OUT(ctl->mboxsync), NUM_VALUE_OUT(ctl->mboxsync));
+	}
 	else if (ctl->mda && MAILBOX_PROTOCOL(ctl))
+	{
 	    printf(GT_("  Messages will be delivered with \"%s\".\n"), visbuf(ctl->mda));
+	    if (NUM_VALUE_OUT(ctl->mdajobs) > 1)
+		printf(GT_("  Up to %d MDA processes will run at once (--mdajobs %d).\n"),
+		       NUM_VALUE_OUT(ctl->mdajobs), NUM_VALUE_OUT(ctl->mdajobs));
+	}
 	else
 	{
 	    struct idlist *idp;
@@ -1844,6 +1987,9 @@ static void dump_params (struct runctl *runp,
 		}
 		printf("\n");
 	    }
+	    if (ctl->spool)
+		printf(GT_("  Messages will be staged in spool %s first.\n"),
+		       visbuf(ctl->spool));
 	    if (ctl->smtpaddress)
 		printf(GT_("  Host part of MAIL FROM line will be %s\n"),
 		       ctl->smtpaddress);
@@ -1864,6 +2010,18 @@ static void dump_params (struct runctl *runp,
 		}
 		else if (outlevel >= O_VERBOSE)
 		    printf(GT_("  Spam-blocking disabled\n"));
+		if (ctl->rules)
+		{
+		    struct hdrrule *rule;
+
+		    printf(GT_("  Header rules, first match wins:\n"));
+		    for (rule = ctl->rules; rule; rule = rule->next)
+			printf("    %s \"%s\" %s%s%s\n",
+			       rule_whats[rule->what], visbuf(rule->pattern),
+			       rule_actions[rule->action],
+			       rule->route ? " " : "",
+			       rule->route ? rule->route : "");
+		}
 	}
 	if (ctl->preconnect)
 	    printf(GT_("  Server connection will be brought up with \"%s\".\n"),
@@ -120,7 +120,11 @@ char *strstr(const char *, const char *);
 
 #define		NAMELEN		64	/* max username length */
 #define		PASSWORDLEN	64	/* max password length */
-#define		DIGESTLEN	33	/* length of MD5 digest */
+#define		DIGESTLEN	33	/* length of message digest buffer */
+
+/* message digest algorithms, see digest.c */
+#define		DIGEST_MD5	1
+#define		DIGEST_XXH64	2
 
 /* exit code values */
 /* NOTE THAT PS_SUCCESS MUST ALWAYS BE 0 - SOME PARTS OF THE CODE
@@ -145,6 +149,7 @@ char *strstr(const char *, const char *);
 #define		PS_TRANSIENT	24	/* transient failure (internal use) */
 #define		PS_REFUSED	25	/* mail refused (internal use) */
 #define		PS_RETAINED	26	/* message retained (internal use) */
+#define		PS_SEEN		27	/* message only to be marked seen (internal use) */
 #define		PS_REPOLL	28	/* repoll immediately with changed parameters (internal use) */
 #define		PS_IDLETIMEOUT	29	/* timeout on imap IDLE (internal use) */
 #define		PS_UNTAGGED	30	/* untagged response on imap command (internal use) */
@@ -178,9 +183,12 @@ struct runctl
     char	*logfile;	/** where to write log information */
     char	*idfile;	/** where to store UID data */
     char	*pidfile;	/** where to record the PID of daemon mode processes */
+    char	*dupfile;	/** where to index delivered messages (NULL == off) */
+    int		digest;		/** DIGEST_* algorithm for multidrop duplicates (0 == MD5) */
     const char	*postmaster;
     char	*properties;
     int		poll_interval;	/** poll interval in seconds (daemon mode, 0 == off) */
+    int		smtpidle;	/** seconds to keep idle listener connections (0 == off) */
     flag	bouncemail;
     flag	spambounce;
     flag	softbounce;
@@ -208,6 +216,15 @@ struct idlist
     struct idlist *next;		/**< pointer to next list element */
 };
 
+/** Case-blind hash index over the ids of an idlist, built by
+ * idhash_index(); the list itself stays the authority. */
+struct idhash
+{
+    struct idlist **tab;	/**< open addressing, NULL marks a free slot */
+    size_t size;		/**< number of slots, a power of two or 0 */
+    size_t count;		/**< number of slots in use */
+};
+
 /** List of possible values for idlist::mark */
 enum {
 UID_UNSEEN=	0,		/**< id hasn't been seen */
@@ -258,6 +275,28 @@ struct method		/* describe methods for protocol state machine */
 
 enum badheader { BHREJECT = 0, BHACCEPT };
 
+/* what a header rule's pattern is matched against */
+#define		RULE_HEADER	1	/* each header line */
+#define		RULE_SENDER	2	/* envelope sender, From and Sender addresses */
+#define		RULE_RECIPIENT	3	/* To, Cc and envelope recipient addresses */
+#define		RULE_LISTID	4	/* the List-Id header */
+
+/* what a header rule does with a message it matches */
+#define		RULE_SKIP	1	/* leave it on the server untouched */
+#define		RULE_KEEP	2	/* leave it on the server, marked seen */
+#define		RULE_REJECT	3	/* delete it without delivery */
+#define		RULE_ROUTE	4	/* deliver it to another local name */
+
+struct hdrrule			/* header rule, tried before the body is fetched */
+{
+    int what;			/* RULE_HEADER etc. */
+    int action;			/* RULE_SKIP etc. */
+    char *pattern;		/* extended regular expression, as given */
+    void *regex;		/* compiled pattern, a regex_t */
+    char *route;		/* local name for RULE_ROUTE */
+    struct hdrrule *next;
+};
+
 struct hostdata		/* shared among all user connections to given server */
 {
     /* rc file data */
@@ -265,6 +304,7 @@ struct hostdata		/* shared among all user connections to given server */
     char *via;				/* "true" server name if non-NULL */
     struct idlist *akalist;		/* server name first, then akas */
     struct idlist *localdomains;	/* list of pass-through domains */
+    struct idhash domainindex;		/* localdomains, hashed */
     int protocol;			/* protocol type */
     const char *service;		/* service name */
     int interval;			/* # cycles to skip between polls */
@@ -324,6 +364,7 @@ struct query
 
     /* per-user data */
     struct idlist *localnames;	/* including calling user's name */
+    struct idhash localindex;	/* localnames, hashed by remote name */
     int wildcard;		/* should unmatched names be passed through */
     char *remotename;		/* remote login name to use */
     char *password;		/* remote password to use */
@@ -335,8 +376,13 @@ struct query
     char *smtpaddress;		/* address to force in RCPT TO */ 
     char *smtpname;             /* full RCPT TO name, including domain */
     struct idlist *antispam;	/* list of listener's antispam response */
+    struct hdrrule *rules;	/* header rules, first match wins */
     const char *mda;		/* local MDA to pass mail to */
     char *bsmtp;		/* BSMTP output file */
+    char *bsmtpcompress;	/* compressor for BSMTP output */
+    char *maildir;		/* Maildir to deliver to */
+    char *mbox;			/* mbox file to append to */
+    char *spool;		/* spool to stage mail for the listener in */
     char listener;		/* what's the listener's wire protocol? */
 #define SMTP_MODE	'S'
 #define LMTP_MODE	'L'
@@ -364,6 +410,11 @@ struct query
     int fastuidlcount;		/* internal count for frequency of binary search */
     int	batchlimit;		/* max # msgs to pass in single SMTP session */
     int	expunge;		/* max # msgs to pass between expunges */
+    int	folderconns;		/* max # server connections for folders */
+    int	mdajobs;		/* max # MDA processes running at once */
+    int	maildirsync;		/* # Maildir messages synced together */
+    int	mboxsync;		/* # mbox messages appended under one lock */
+    int	bsmtpsync;		/* # BSMTP messages synced together */
     flag use_ssl;		/* use SSL encrypted session */
     char *sslkey;		/* optional SSL private key file */
     char *sslcert;		/* optional SSL certificate file */
@@ -391,12 +442,12 @@ struct query
     struct idlist *skipped;	/* messages skipped on the mail server */
     struct idlist *oldsaved, *newsaved;
     struct idlist **oldsavedend;
-    char lastdigest[DIGESTLEN];	/* last MD5 hash seen on this connection */
+    char lastdigest[DIGESTLEN];	/* last digest seen on this connection */
     char *folder;		/* folder currently being polled */
 
     /* internal use -- per-message state */
     int mimemsg;		/* bitmask indicating MIME body-type */
-    unsigned char digest[DIGESTLEN];	/* md5 digest buffer */
+    unsigned char digest[DIGESTLEN];	/* digest buffer, algorithm in last byte */
 
     /* internal use -- housekeeping */
     struct query *next;		/* next query control block in chain */
@@ -515,6 +566,7 @@ void set_timeout(int);
 int is_idletimeout(void);
 void resetidletimeout(void);
 int do_protocol(struct query *, const struct method *);
+void kill_folder_conns(void);
 
 /* transact.c: transaction support */
 /** \ingroup gen_recv_split
@@ -535,6 +587,9 @@ int readheaders(int sock,
 		       int num,
 		       flag *suppress_readbody);
 int readbody(int sock, struct query *ctl, flag forward, int len);
+extern const char *const rule_whats[], *const rule_actions[];
+const char *add_hdrrule(struct hdrrule **rules, const char *what,
+			char *pattern, int action, char *route);
 #if defined(HAVE_STDARG_H)
 void gen_send(int sock, const char *, ... )
     __attribute__ ((format (printf, 2, 3)))
@@ -577,6 +632,9 @@ extern int mytimeout;
 #define XMIT_ACCEPT	1	/* accepted; matches local domain or name */
 #define XMIT_REJECT	2	/* rejected; no match */
 #define XMIT_RCPTBAD	3	/* SMTP listener rejected the name */ 
+#define XMIT_FAILED	4	/* spooled message refused for good */
+#define XMIT_DEFERRED	5	/* ...or only for now */
+#define XMIT_DONE	6	/* spooled message delivered to it */
 
 /* idle.c */
 int interruptible_idle(int interval);
@@ -584,13 +642,22 @@ extern volatile int lastsig;
 
 /* sink.c: forwarding */
 void smtp_close(struct query *, int);
+void smtp_park(struct query *);
+void smtp_pool_expire(int);
+void smtp_pool_close(int);
 int smtp_open(struct query *);
 int smtp_setup(struct query *);
 char *rcpt_address(struct query *, const char *, int);
 int stuffline(struct query *, char *);
+int stuffbuf(struct query *, char *, size_t);
 int open_sink(struct query*, struct msgblk *, int*, int*);
 void release_sink(struct query *);
+void finish_sink(struct query *);
+int drain_spool(struct query *);
 int close_sink(struct query *, struct msgblk *, flag);
+pid_t close_sink_nowait(struct query *);
+int close_sink_finish(struct query *, struct msgblk *, pid_t, flag);
+const char *lmtp_deferred(int);
 int open_warning_by_mail(struct query *);
 #if defined(HAVE_STDARG_H)
 void stuff_warning(const char *, struct query *, const char *, ... )
@@ -602,7 +669,27 @@ void stuff_warning();
 void close_warning_by_mail(struct query *, struct msgblk *);
 
 /* rfc822.c: RFC822 header parsing */
-char *reply_hack(char *, const char *, size_t *);
+struct rfc822_iter		/* walk over the addresses of one header */
+{
+    const char *begin;		/* start of the header */
+    const char *hp;		/* next byte to look at */
+    const char *end;		/* end of the header text */
+    int state, oldstate;	/* scanner state, see rfc822_next() */
+};
+
+struct rfc822_addr		/* an address found by rfc822_next() */
+{
+    const char *start;		/* its first byte in the header */
+    size_t len;			/* bytes from there through its last byte */
+    flag clean;			/* nothing within the span was dropped */
+    flag bracketed;		/* it was enclosed in <> */
+};
+
+size_t rfc822_hdrlen(const char *);
+void rfc822_begin(struct rfc822_iter *, const char *, size_t);
+int rfc822_next(struct rfc822_iter *, struct rfc822_addr *, char *, size_t);
+size_t reply_hack_room(const char *, const char *);
+size_t reply_hack(char *, size_t, size_t, const char *);
 char *nxtaddr(const char *);
 
 /* uid.c: UID support */
@@ -614,6 +701,13 @@ void uid_discard_new_list(struct query *ctl);
 void uid_reset_num(struct query *ctl);
 void write_saved_lists(struct query *hostlist, const char *idfile);
 
+/* dupdb.c: cross-account duplicate index */
+int dup_check(int num, const char *msgid, const char *rcpt);
+void dup_settle(int num, flag delivered);
+void dup_drop(int num, const char *rcpt);
+void dup_forget(void);
+void dup_expire(void);
+
 /* idlist.c */
 struct idlist *save_str(struct idlist **idl, const char *str, flag status);
 void free_str_list(struct idlist **idl);
@@ -630,6 +724,10 @@ char *idpair_find(struct idlist **idl, const char *id);
 int delete_str(struct idlist **idl, long num);
 struct idlist *copy_str_list(struct idlist *idl);
 void append_str_list(struct idlist **idl, struct idlist **nidl);
+void idhash_add(struct idhash *h, struct idlist *idp);
+void idhash_index(struct idhash *h, struct idlist *idl);
+struct idlist *idhash_find(const struct idhash *h, struct idlist **idl, const char *id);
+void idhash_free(struct idhash *h);
 
 /* rcfile_y.y */
 int prc_parse_file(const char *, const flag);
@@ -646,7 +744,7 @@ int from64tobits(void *, const char *, int maxlen);
 #define MSG_NEEDS_DECODE  0x80
 extern void UnMimeHeader(char *buf);
 extern int  MimeBodyType(char *hdrs, int WantDecode);
-extern int  UnMimeBodyline(char **buf, flag delimited, flag issoftline);
+extern int  UnMimeBodyline(char **buf, size_t len, flag delimited, flag issoftline);
 
 /* interface.c */
 void interface_init(void);
@@ -679,6 +777,10 @@ struct query *hostalloc(struct query *);
 int parsecmdline (int, char **, struct runctl *, struct query *);
 char *prependdir (const char *, const char *);
 char *MD5Digest (unsigned const char *);
+
+/* digest.c */
+int digest_lookup(const char *name);
+const char *digest_name(int alg);
 void hmac_md5 (const unsigned char *, size_t, const unsigned char *, size_t, unsigned char *, size_t);
 int POP3_auth_rpa(char *, char *, int socket);
 typedef RETSIGTYPE (*SIGHANDLERTYPE) (int);
@@ -692,6 +794,7 @@ char *visbuf(const char *);
 const char *showproto(int);
 void dump_config(struct runctl *runp, struct query *querylist);
 int is_host_alias(const char *, struct query *, struct addrinfo **);
+void forget_host_aliases(void);
 
 extern struct addrinfo *ai0, *ai1;
 
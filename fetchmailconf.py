@@ -19,6 +19,9 @@ class Configuration:
 	self.poll_interval = 0		# Normally, run in foreground
 	self.logfile = None		# No logfile, initially
 	self.idfile = os.environ["HOME"] + "/.fetchids"	 # Default idfile, initially
+	self.dupfile = None		# No duplicate index, initially
+	self.digest = None		# MD5 multidrop digests, initially
+	self.smtpidle = 0		# Close listener connections, initially
 	self.postmaster = None		# No last-resort address, initially
 	self.bouncemail = TRUE		# Bounce errors to users
 	self.spambounce = FALSE		# Bounce spam errors
@@ -31,6 +34,9 @@ class Configuration:
 	    ('poll_interval',	'Int'),
 	    ('logfile',	 'String'),
 	    ('idfile',	  'String'),
+	    ('dupfile',	  'String'),
+	    ('digest',	  'String'),
+	    ('smtpidle',	'Int'),
 	    ('postmaster',	'String'),
 	    ('bouncemail',	'Boolean'),
 	    ('spambounce',	'Boolean'),
@@ -47,6 +53,12 @@ class Configuration:
 	    str = str + ("set logfile \"%s\"\n" % (self.logfile,));
 	if self.idfile != ConfigurationDefaults.idfile:
 	    str = str + ("set idfile \"%s\"\n" % (self.idfile,));
+	if self.dupfile != ConfigurationDefaults.dupfile:
+	    str = str + ("set dupfile \"%s\"\n" % (self.dupfile,));
+	if self.digest != ConfigurationDefaults.digest:
+	    str = str + ("set digest \"%s\"\n" % (self.digest,));
+	if self.smtpidle > 0:
+	    str = str + "set smtpidle " + `self.smtpidle` + "\n"
 	if self.postmaster != ConfigurationDefaults.postmaster:
 	    str = str + ("set postmaster \"%s\"\n" % (self.postmaster,));
 	if self.bouncemail:
@@ -243,8 +255,13 @@ class User:
 	self.postconnect = None	# Connection wrapup
 	self.mda = None		# Mail Delivery Agent
 	self.bsmtp = None	# BSMTP output file
+	self.bsmtpcompress = None	# BSMTP output compressor
+	self.maildir = None	# Maildir to deliver to
+	self.mbox = None	# mbox file to append to
+	self.spool = None	# spool directory for the listener
 	self.lmtp = FALSE	# Use LMTP rather than SMTP?
 	self.antispam = ""	# Listener's spam-block code
+	self.rules = []		# Header rules, first match wins
 	self.keep = FALSE	# Keep messages
 	self.flush = FALSE	# Flush messages
 	self.limitflush = FALSE	# Flush oversized messages
@@ -264,6 +281,11 @@ class User:
 	self.fastuidl = 4	# Do fast uidl 3 out of 4 times
 	self.batchlimit = 0	# Max message forwarded per batch
 	self.expunge = 0	# Interval between expunges (IMAP)
+	self.folderconns = 0	# Parallel connections for folders (IMAP)
+	self.mdajobs = 0	# MDA processes running at once
+	self.maildirsync = 0	# Maildir messages synced together
+	self.mboxsync = 0	# mbox messages appended under one lock
+	self.bsmtpsync = 0	# BSMTP messages synced together
 	self.ssl = 0		# Enable Seccure Socket Layer
 	self.sslkey = None	# SSL key filename
 	self.sslcert = None	# SSL certificate filename
@@ -284,6 +306,10 @@ class User:
 	    ('postconnect', 'String'),
 	    ('mda',	 'String'),
 	    ('bsmtp',	    'String'),
+	    ('bsmtpcompress', 'String'),
+	    ('maildir',	    'String'),
+	    ('mbox',	    'String'),
+	    ('spool',	    'String'),
 	    ('lmtp',	'Boolean'),
 	    ('antispam',    'String'),
 	    ('keep',	'Boolean'),
@@ -305,6 +331,11 @@ class User:
 	    ('fastuidl',    'Int'),
 	    ('batchlimit',  'Int'),
 	    ('expunge',     'Int'),
+	    ('folderconns', 'Int'),
+	    ('mdajobs',     'Int'),
+	    ('maildirsync', 'Int'),
+	    ('mboxsync',    'Int'),
+	    ('bsmtpsync',   'Int'),
 	    ('ssl',	 'Boolean'),
 	    ('sslkey',	    'String'),
 	    ('sslcert',     'String'),
@@ -391,6 +422,16 @@ class User:
 	    res = res + " sslfingerprint " + `self.sslfingerprint`
 	if self.expunge != UserDefaults.expunge:
 	    res = res + " expunge " + `self.expunge`
+	if self.folderconns != UserDefaults.folderconns:
+	    res = res + " folderconns " + `self.folderconns`
+	if self.mdajobs != UserDefaults.mdajobs:
+	    res = res + " mdajobs " + `self.mdajobs`
+	if self.maildirsync != UserDefaults.maildirsync:
+	    res = res + " maildirsync " + `self.maildirsync`
+	if self.mboxsync != UserDefaults.mboxsync:
+	    res = res + " mboxsync " + `self.mboxsync`
+	if self.bsmtpsync != UserDefaults.bsmtpsync:
+	    res = res + " bsmtpsync " + `self.bsmtpsync`
 	res = res + "\n"
 	trimmed = self.smtphunt;
 	if trimmed != [] and trimmed[len(trimmed) - 1] == "localhost":
@@ -415,13 +456,15 @@ class User:
 	     for x in self.mailboxes:
 		res = res + ' "%s"' % x
 	     res = res + "\n"
-	for fld in ('smtpaddress', 'preconnect', 'postconnect', 'mda', 'bsmtp', 'properties'):
+	for fld in ('smtpaddress', 'preconnect', 'postconnect', 'mda', 'bsmtp', 'bsmtpcompress', 'maildir', 'mbox', 'spool', 'properties'):
 	    if getattr(self, fld):
 		res = res + " %s %s\n" % (fld, `getattr(self, fld)`)
 	if self.lmtp != UserDefaults.lmtp:
 	    res = res + flag2str(self.lmtp, 'lmtp')
 	if self.antispam != UserDefaults.antispam:
 	    res = res + "    antispam " + self.antispam + "\n"
+	for x in self.rules:
+	    res = res + "    rule " + x + "\n"
 	return res;
 
     def __str__(self):
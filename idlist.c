@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <limits.h>
+#include <ctype.h>
 #if defined(STDC_HEADERS)
 #include <stdlib.h>
 #include <string.h>
@@ -258,4 +259,82 @@ void append_str_list(struct idlist **idl, struct idlist **nidl)
 	append_str_list(&(*idl)->next, nidl);
 }
 
+/** Hash id \a id case-blind (FNV-1a over the lowercased bytes). */
+static size_t idhash_hash(const char *id)
+{
+    size_t h = 2166136261U;
+
+    for (; *id; id++)
+	h = (h ^ (unsigned char)tolower((unsigned char)*id)) * 16777619U;
+    return h;
+}
+
+/** \return the slot of index \a h holding id \a id, or the free slot
+ * where it belongs. */
+static struct idlist **idhash_slot(const struct idhash *h, const char *id)
+{
+    size_t i = idhash_hash(id) & (h->size - 1);
+
+    while (h->tab[i] && strcasecmp(h->tab[i]->id, id) != 0)
+	i = (i + 1) & (h->size - 1);
+    return &h->tab[i];
+}
+
+/** Enter list element \a idp into index \a h, unless an element with
+ * the same id is there already, so that lookups find the first one of
+ * the list as str_in_list() does. */
+void idhash_add(struct idhash *h, struct idlist *idp)
+{
+    struct idlist **slot;
+
+    /* keep the table at most half full */
+    if (2 * (h->count + 1) > h->size)
+    {
+	struct idlist **old = h->tab;
+	size_t i, oldsize = h->size;
+
+	h->size = h->size ? 2 * h->size : 16;
+	h->tab = (struct idlist **)xmalloc(h->size * sizeof(struct idlist *));
+	memset(h->tab, '\0', h->size * sizeof(struct idlist *));
+	for (i = 0; i < oldsize; i++)
+	    if (old[i])
+		*idhash_slot(h, old[i]->id) = old[i];
+	free(old);
+    }
+
+    slot = idhash_slot(h, idp->id);
+    if (!*slot)
+    {
+	*slot = idp;
+	h->count++;
+    }
+}
+
+/** Build index \a h over all elements of idlist \a idl. */
+void idhash_index(struct idhash *h, struct idlist *idl)
+{
+    idhash_free(h);
+    for (; idl; idl = idl->next)
+	if (idl->id)
+	    idhash_add(h, idl);
+}
+
+/** Look up \a id case-blind in idlist \a idl, through index \a h if
+ * one has been built.  \return the first element with that id, NULL if
+ * there is none. */
+struct idlist *idhash_find(const struct idhash *h, struct idlist **idl, const char *id)
+{
+    if (!h->size)
+	return str_in_list(idl, id, TRUE);
+    return *idhash_slot(h, id);
+}
+
+/** Free the table of index \a h, but not the list it indexes. */
+void idhash_free(struct idhash *h)
+{
+    free(h->tab);
+    h->tab = NULL;
+    h->size = h->count = 0;
+}
+
 /* idlist.c ends here */
@@ -50,6 +50,92 @@ static int actual_deletions = 0;
 static int saved_timeout = 0, idle_timeout = 0;
 static time_t idle_start_time = 0;
 
+/* for "IMAP> NOTIFY" (RFC5465), watching several folders while idling */
+static flag do_notify = FALSE, notify_set = FALSE;
+static struct idlist *notify_pending;	/* folders reported to have new mail */
+
+static void imap_idle_done(int sock)
+/* an unsolicited update ended the idle: ship DONE and restore state */
+{
+    /* If IDLE isn't supported, we were only sending NOOPs anyway. */
+    if (has_idle)
+    {
+	/* we do our own write and report here to disable tagging */
+	SockWrite(sock, "DONE\r\n", 6);
+	if (outlevel >= O_MONITOR)
+	    report(stdout, "IMAP> DONE\n");
+    }
+
+    mytimeout = saved_timeout;
+    stage = STAGE_GETRANGE;
+}
+
+static int same_mailbox(const char *a, const char *b)
+/* compare mailbox names, NULL meaning INBOX; only INBOX ignores case */
+{
+    if (!a)
+	a = "INBOX";
+    if (!b)
+	b = "INBOX";
+    if (strcasecmp(a, "INBOX") == 0)
+	return(strcasecmp(b, "INBOX") == 0);
+    return(strcmp(a, b) == 0);
+}
+
+static int notify_status(int sock, const char *buf)
+/* note the mailbox named in a NOTIFY-generated "* STATUS" response */
+{
+    char name[MSGBUFSIZE+1], *np = name;
+    const char *cp = buf + 9;	/* skip "* STATUS " */
+    struct idlist *idp;
+
+    if (*cp == '{')
+    {
+	/* a literal; the name starts the next line */
+	char line[MSGBUFSIZE+1], *t;
+	long len;
+	int ok;
+
+	errno = 0;
+	len = strtol(cp + 1, &t, 10);
+	if (errno || t == cp + 1 || *t != '}' || len < 0 || len > MSGBUFSIZE)
+	{
+	    report(stderr, GT_("bogus mailbox name in \"%s\"\n"), buf);
+	    return(PS_PROTOCOL);
+	}
+	if ((ok = gen_recv(sock, line, sizeof(line))))
+	    return(ok);
+	if (strlen(line) < (size_t)len)
+	{
+	    report(stderr, GT_("bogus mailbox name in \"%s\"\n"), buf);
+	    return(PS_PROTOCOL);
+	}
+	memcpy(name, line, len);
+	np = name + len;
+    }
+    else if (*cp == '"')
+    {
+	for (cp++; *cp && *cp != '"' && np < name + MSGBUFSIZE; cp++)
+	{
+	    if (*cp == '\\' && cp[1])
+		cp++;
+	    *np++ = *cp;
+	}
+    }
+    else
+	while (*cp && !isspace((unsigned char)*cp) && np < name + MSGBUFSIZE)
+	    *np++ = *cp++;
+    *np = '\0';
+
+    if (!name[0])
+	return(PS_SUCCESS);
+    for (idp = notify_pending; idp; idp = idp->next)
+	if (same_mailbox(idp->id, name))
+	    return(PS_SUCCESS);
+    save_str(&notify_pending, name, FALSE);
+    return(PS_SUCCESS);
+}
+
 static int imap_untagged_response(int sock, const char *buf)
 /* interpret untagged status responses */
 {
@@ -105,19 +191,21 @@ static int imap_untagged_response(int sock, const char *buf)
 	 * shipped.  The idling flag also gets cleared on a timeout.
 	 */
 	if (stage == STAGE_IDLE)
-	{
-	    /* If IDLE isn't supported, we were only sending NOOPs anyway. */
-	    if (has_idle)
-	    {
-		/* we do our own write and report here to disable tagging */
-		SockWrite(sock, "DONE\r\n", 6);
-		if (outlevel >= O_MONITOR)
-		    report(stdout, "IMAP> DONE\n");
-	    }
+	    imap_idle_done(sock);
+    }
+    else if (do_notify && !strncmp(buf, "* STATUS ", 9))
+    {
+	/*
+	 * RFC5465 NOTIFY reports new mail in watched folders other
+	 * than the selected one this way.  Remember the folder, and
+	 * stop idling so that imap_getrange() can go and fetch it.
+	 */
+	int ok;
 
-	    mytimeout = saved_timeout;
-	    stage = STAGE_GETRANGE;
-	}
+	if ((ok = notify_status(sock, buf)))
+	    return(ok);
+	if (stage == STAGE_IDLE)
+	    imap_idle_done(sock);
     }
     /* we now compute recentcount as a difference between
      * new and old EXISTS, hence disable RECENT check */
@@ -368,6 +456,8 @@ static int capa_probe(int sock, struct query *ctl)
      * and after each timeout (including timeouts during idles).
      */
     do_idle = ctl->idle;
+    do_notify = notify_set = FALSE;
+    free_str_list(&notify_pending);
     if (ctl->idle)
     {
 	if (strstr(capabilities, "IDLE"))
@@ -376,6 +466,15 @@ static int capa_probe(int sock, struct query *ctl)
 	    has_idle = FALSE;
 	if (outlevel >= O_VERBOSE)
 	    report(stdout, GT_("will idle after poll\n"));
+
+	/* idling on several folders of this connection needs NOTIFY */
+	if (ctl->mailboxes && ctl->mailboxes->next)
+	{
+	    if (strstr(capabilities, "NOTIFY"))
+		do_notify = TRUE;
+	    else if (outlevel > O_SILENT)
+		report(stderr, GT_("server lacks NOTIFY, only the first folder of this connection will be idled on\n"));
+	}
     }
 
     peek_capable = (imap_version >= IMAP4);
@@ -716,6 +815,8 @@ static int imap_idle(int sock)
 	 * at least every 28 minutes:
 	 * (the server may have an inactivity timeout) */
 	mytimeout = idle_timeout = 1680; /* 28 min */
+	/* pooled listener connections would go stale meanwhile */
+	smtp_pool_expire(idle_timeout);
 	time(&idle_start_time);
 	stage = STAGE_IDLE;
 	/* enter IDLE mode */
@@ -745,6 +846,7 @@ static int imap_idle(int sock)
 	     * with RFC 2060 section 5.3. Wait for that with a low
 	     * timeout */
 	    mytimeout = idle_timeout = 28;
+	    smtp_pool_expire(idle_timeout);
 	    time(&idle_start_time);
 	    stage = STAGE_IDLE;
 	    /* We are waiting for notification; no tag needed */
@@ -873,6 +975,113 @@ static int imap_search(int sock, struct query *ctl, int count)
     return(ok);
 }
 
+static int imap_select(int sock, struct query *ctl, const char *folder)
+/* select a folder and expunge leftover deletions */
+{
+    int ok;
+
+    oldcount = count = 0;
+    ok = gen_transact(sock, 
+		      check_only ? "EXAMINE \"%s\"" : "SELECT \"%s\"",
+		      folder ? folder : "INBOX");
+    /* imap_ok returns PS_LOCKBUSY for READ-ONLY folders,
+     * which we can safely use in fetchall keep only */
+    if (ok == PS_LOCKBUSY && ctl->fetchall && ctl-> keep)
+	ok = 0;
+
+    if (ok != 0)
+    {
+	report(stderr, GT_("mailbox selection failed\n"));
+	return(ok);
+    }
+    else if (outlevel >= O_DEBUG)
+	report(stdout, ngettext("%d message waiting after first poll\n",
+				"%d messages waiting after first poll\n",
+				count), count);
+
+    /*
+     * We should have an expunge here to
+     * a) avoid fetching deleted mails during 'fetchall'
+     * b) getting a wrong count of mails during 'no fetchall'
+     */
+    if (!check_only && !ctl->keep && count > 0)
+    {
+	ok = internal_expunge(sock);
+	if (ok)
+	{
+	    report(stderr, GT_("expunge failed\n"));
+	    return(ok);
+	}
+	if (outlevel >= O_DEBUG)
+	    report(stdout, ngettext("%d message waiting after expunge\n",
+				    "%d messages waiting after expunge\n",
+				    count), count);
+    }
+
+    return(PS_SUCCESS);
+}
+
+static int imap_notify(int sock, struct query *ctl)
+/* ask for RFC5465 notification of new mail in all of our folders */
+{
+    char buf[MSGBUFSIZE+1];
+    struct idlist *idp;
+    size_t len;
+    int ok;
+
+    strlcpy(buf, "NOTIFY SET (selected (MessageNew MessageExpunge)) (mailboxes (",
+	    sizeof(buf));
+    for (idp = ctl->mailboxes; idp; idp = idp->next)
+    {
+	len = strlen(buf);
+	snprintf(buf + len, sizeof(buf) - len, "%s\"%s\"",
+		 idp == ctl->mailboxes ? "" : " ",
+		 idp->id ? idp->id : "INBOX");
+    }
+    strlcat(buf, ") (MessageNew MessageExpunge))", sizeof(buf));
+
+    if ((ok = gen_transact(sock, "%s", buf)))
+    {
+	report(stderr, GT_("NOTIFY failed, only the first folder of this connection will be idled on\n"));
+	do_notify = FALSE;
+	return(ok == PS_ERROR ? PS_SUCCESS : ok);
+    }
+
+    /* the other folders haven't been looked at yet in this session */
+    for (idp = ctl->mailboxes; idp; idp = idp->next)
+	if (idp->id && !same_mailbox(idp->id, ctl->folder))
+	    save_str(&notify_pending, idp->id, FALSE);
+    return(PS_SUCCESS);
+}
+
+static char *notify_next_folder(struct query *ctl)
+/* pick the next folder with new mail other than the selected one */
+{
+    while (notify_pending)
+    {
+	struct idlist *head = notify_pending, *idp;
+	char *folder = NULL;
+
+	notify_pending = head->next;
+	for (idp = ctl->mailboxes; idp; idp = idp->next)
+	    if (same_mailbox(head->id, idp->id))
+	    {
+		folder = idp->id;
+		break;
+	    }
+	free(head->id);
+	free(head);
+
+	if (folder && !same_mailbox(folder, ctl->folder))
+	{
+	    if (outlevel >= O_DEBUG)
+		report(stdout, GT_("new mail notified in folder %s\n"), folder);
+	    return(folder);
+	}
+    }
+    return(NULL);
+}
+
 static int imap_getrange(int sock, 
 			 struct query *ctl, 
 			 const char *folder, 
@@ -880,6 +1089,7 @@ static int imap_getrange(int sock,
 /* get range of messages to be fetched */
 {
     int ok;
+    flag reselect = FALSE;
 
     /* find out how many messages are waiting */
     *bytes = -1;
@@ -896,7 +1106,14 @@ static int imap_getrange(int sock,
 	 * this is a while loop because imap_idle() might return on other
 	 * mailbox changes also */
 	while (recentcount == 0 && do_idle) {
-	    smtp_close(ctl, 1);
+	    /* with NOTIFY, move on to any other folder that got mail */
+	    if (do_notify && (folder = notify_next_folder(ctl)))
+	    {
+		reselect = TRUE;
+		break;
+	    }
+	    finish_sink(ctl);
+	    smtp_park(ctl);
 	    ok = imap_idle(sock);
 	    if (ok)
 	    {
@@ -904,58 +1121,42 @@ static int imap_getrange(int sock,
 		return(ok);
 	    }
 	}
-	/* if recentcount is 0, return no mail */
-	if (recentcount == 0)
-		count = 0;
-	if (outlevel >= O_DEBUG)
-	    report(stdout, ngettext("%d message waiting after re-poll\n",
-				    "%d messages waiting after re-poll\n",
-				    count), count);
+	if (!reselect)
+	{
+	    /* if recentcount is 0, return no mail */
+	    if (recentcount == 0)
+		    count = 0;
+	    if (outlevel >= O_DEBUG)
+		report(stdout, ngettext("%d message waiting after re-poll\n",
+					"%d messages waiting after re-poll\n",
+					count), count);
+	}
     }
-    else
-    {
-	oldcount = count = 0;
-	ok = gen_transact(sock, 
-			  check_only ? "EXAMINE \"%s\"" : "SELECT \"%s\"",
-			  folder ? folder : "INBOX");
-	/* imap_ok returns PS_LOCKBUSY for READ-ONLY folders,
-	 * which we can safely use in fetchall keep only */
-	if (ok == PS_LOCKBUSY && ctl->fetchall && ctl-> keep)
-	    ok = 0;
 
-	if (ok != 0)
-	{
-	    report(stderr, GT_("mailbox selection failed\n"));
+    if (pass == 1 || reselect)
+    {
+	ctl->folder = (char *)folder;
+	if ((ok = imap_select(sock, ctl, folder)))
 	    return(ok);
-	}
-	else if (outlevel >= O_DEBUG)
-	    report(stdout, ngettext("%d message waiting after first poll\n",
-				    "%d messages waiting after first poll\n",
-				    count), count);
 
-	/*
-	 * We should have an expunge here to
-	 * a) avoid fetching deleted mails during 'fetchall'
-	 * b) getting a wrong count of mails during 'no fetchall'
-	 */
-	if (!check_only && !ctl->keep && count > 0)
+	if (do_notify && !notify_set)
 	{
-	    ok = internal_expunge(sock);
-	    if (ok)
-	    {
-		report(stderr, GT_("expunge failed\n"));
+	    notify_set = TRUE;
+	    if ((ok = imap_notify(sock, ctl)))
 		return(ok);
-	    }
-	    if (outlevel >= O_DEBUG)
-		report(stdout, ngettext("%d message waiting after expunge\n",
-					"%d messages waiting after expunge\n",
-					count), count);
 	}
 
 	if (count == 0 && do_idle)
 	{
 	    /* no messages?  then we may need to idle until we get some */
 	    while (count == 0) {
+		if (do_notify && (folder = notify_next_folder(ctl)))
+		{
+		    ctl->folder = (char *)folder;
+		    if ((ok = imap_select(sock, ctl, folder)))
+			return(ok);
+		    continue;
+		}
 		ok = imap_idle(sock);
 		if (ok)
 		{
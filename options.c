@@ -55,7 +55,19 @@ enum {
     LA_IDLE,
     LA_NOSOFTBOUNCE,
     LA_SOFTBOUNCE,
-    LA_BADHEADER
+    LA_BADHEADER,
+    LA_FOLDERCONNS,
+    LA_SMTPIDLE,
+    LA_MDAJOBS,
+    LA_MAILDIR,
+    LA_MAILDIRSYNC,
+    LA_MBOX,
+    LA_MBOXSYNC,
+    LA_BSMTPSYNC,
+    LA_BSMTPCOMPRESS,
+    LA_SPOOL,
+    LA_DUPFILE,
+    LA_DIGEST
 };
 
 /* options still left: CgGhHjJoORTWxXYz */
@@ -80,6 +92,8 @@ static const struct option longoptions[] = {
   {"fetchmailrc",required_argument,(int *) 0, 'f' },
   {"idfile",	required_argument, (int *) 0, 'i' },
   {"pidfile",	required_argument, (int *) 0, LA_PIDFILE },
+  {"dupfile",	required_argument, (int *) 0, LA_DUPFILE },
+  {"digest",	required_argument, (int *) 0, LA_DIGEST },
   {"postmaster",required_argument, (int *) 0, LA_POSTMASTER },
   {"nobounce",	no_argument,	   (int *) 0, LA_NOBOUNCE },
   {"nosoftbounce", no_argument,	   (int *) 0, LA_NOSOFTBOUNCE },
@@ -122,8 +136,18 @@ static const struct option longoptions[] = {
   {"fetchsizelimit",required_argument, (int *) 0, LA_FETCHSIZELIMIT },
   {"fastuidl",	required_argument, (int *) 0, LA_FASTUIDL },
   {"expunge",	required_argument, (int *) 0, 'e' },
+  {"folderconns",required_argument, (int *) 0, LA_FOLDERCONNS },
+  {"smtpidle",	required_argument, (int *) 0, LA_SMTPIDLE },
+  {"mdajobs",	required_argument, (int *) 0, LA_MDAJOBS },
+  {"maildir",	required_argument, (int *) 0, LA_MAILDIR },
+  {"maildirsync",	required_argument, (int *) 0, LA_MAILDIRSYNC },
+  {"mbox",	required_argument, (int *) 0, LA_MBOX },
+  {"mboxsync",	required_argument, (int *) 0, LA_MBOXSYNC },
+  {"spool",	required_argument, (int *) 0, LA_SPOOL },
   {"mda",	required_argument, (int *) 0, 'm' },
   {"bsmtp",	required_argument, (int *) 0, LA_BSMTP },
+  {"bsmtpsync",	required_argument, (int *) 0, LA_BSMTPSYNC },
+  {"bsmtpcompress",	required_argument, (int *) 0, LA_BSMTPCOMPRESS },
   {"lmtp",	no_argument,	   (int *) 0, LA_LMTP },
 
 #ifdef SSL_ENABLE
@@ -249,6 +273,7 @@ int parsecmdline (int argc /** argument count */,
     char *buf, *cp;
 
     rctl->poll_interval = -1;
+    rctl->smtpidle = -1;
 
     memset(ctl, '\0', sizeof(struct query));    /* start clean */
     ctl->smtp_socket = -1;
@@ -302,6 +327,15 @@ int parsecmdline (int argc /** argument count */,
 	case LA_PIDFILE:
 	    rctl->pidfile = prependdir (optarg, currentwd);
 	    break;
+	case LA_DUPFILE:
+	    rctl->dupfile = prependdir (optarg, currentwd);
+	    break;
+	case LA_DIGEST:
+	    if (!(rctl->digest = digest_lookup(optarg))) {
+		fprintf(stderr,GT_("Invalid digest algorithm `%s' specified.\n"), optarg);
+		errflag++;
+	    }
+	    break;
 	case LA_POSTMASTER:
 	    rctl->postmaster = (char *) xstrdup(optarg);
 	    break;
@@ -514,6 +548,25 @@ int parsecmdline (int argc /** argument count */,
 	    c = xatoi(optarg, &errflag);
 	    ctl->expunge = NUM_VALUE_IN(c);
 	    break;
+	case LA_FOLDERCONNS:
+	    c = xatoi(optarg, &errflag);
+	    ctl->folderconns = NUM_VALUE_IN(c);
+	    break;
+	case LA_MDAJOBS:
+	    c = xatoi(optarg, &errflag);
+	    ctl->mdajobs = NUM_VALUE_IN(c);
+	    break;
+	case LA_MAILDIRSYNC:
+	    c = xatoi(optarg, &errflag);
+	    ctl->maildirsync = NUM_VALUE_IN(c);
+	    break;
+	case LA_MBOXSYNC:
+	    c = xatoi(optarg, &errflag);
+	    ctl->mboxsync = NUM_VALUE_IN(c);
+	    break;
+	case LA_SMTPIDLE:
+	    rctl->smtpidle = xatoi(optarg, &errflag);
+	    break;
 	case 'm':
 	    ctl->mda = xstrdup(optarg);
 	    ocount++;
@@ -522,6 +575,25 @@ int parsecmdline (int argc /** argument count */,
 	    ctl->bsmtp = prependdir (optarg, currentwd);
 	    ocount++;
 	    break;
+	case LA_BSMTPSYNC:
+	    c = xatoi(optarg, &errflag);
+	    ctl->bsmtpsync = NUM_VALUE_IN(c);
+	    break;
+	case LA_BSMTPCOMPRESS:
+	    ctl->bsmtpcompress = xstrdup(optarg);
+	    break;
+	case LA_MAILDIR:
+	    ctl->maildir = prependdir (optarg, currentwd);
+	    ocount++;
+	    break;
+	case LA_MBOX:
+	    ctl->mbox = prependdir (optarg, currentwd);
+	    ocount++;
+	    break;
+	case LA_SPOOL:
+	    ctl->spool = prependdir (optarg, currentwd);
+	    ocount++;
+	    break;
 	case LA_LMTP:
 	    ctl->listener = LMTP_MODE;
 	    break;
@@ -634,6 +706,8 @@ int parsecmdline (int argc /** argument count */,
 	P(GT_("  -f, --fetchmailrc specify alternate run control file\n"));
 	P(GT_("  -i, --idfile      specify alternate UIDs file\n"));
 	P(GT_("      --pidfile     specify alternate PID (lock) file\n"));
+	P(GT_("      --dupfile     skip messages delivered before, across accounts\n"));
+	P(GT_("      --digest      multidrop duplicate digest (md5, xxh64)\n"));
 	P(GT_("      --postmaster  specify recipient of last resort\n"));
 	P(GT_("      --nobounce    redirect bounces from user to postmaster.\n"));
 	P(GT_("      --nosoftbounce fetchmail deletes permanently undeliverable messages.\n"));
@@ -685,12 +759,22 @@ int parsecmdline (int argc /** argument count */,
 	P(GT_("      --smtpname    set SMTP full name username@domain\n"));
 	P(GT_("  -Z, --antispam,   set antispam response values\n"));
 	P(GT_("  -b, --batchlimit  set batch limit for SMTP connections\n"));
+	P(GT_("      --smtpidle    keep idle SMTP connections open for n seconds\n"));
 	P(GT_("  -B, --fetchlimit  set fetch limit for server connections\n"));
 	P(GT_("      --fetchsizelimit set fetch message size limit\n"));
 	P(GT_("      --fastuidl    do a binary search for UIDLs\n"));
 	P(GT_("  -e, --expunge     set max deletions between expunges\n"));
+	P(GT_("      --folderconns set max server connections for folders (IMAP only)\n"));
 	P(GT_("  -m, --mda         set MDA to use for forwarding\n"));
+	P(GT_("      --mdajobs     set max MDA processes running at once\n"));
 	P(GT_("      --bsmtp       set output BSMTP file\n"));
+	P(GT_("      --bsmtpsync   set # BSMTP messages to sync together\n"));
+	P(GT_("      --bsmtpcompress compress BSMTP output with this program\n"));
+	P(GT_("      --maildir     deliver to this Maildir\n"));
+	P(GT_("      --maildirsync set # Maildir messages to sync together\n"));
+	P(GT_("      --mbox        append to this mbox file\n"));
+	P(GT_("      --mboxsync    set # mbox messages to append under one lock\n"));
+	P(GT_("      --spool       stage mail for the listener in this directory\n"));
 	P(GT_("      --lmtp        use LMTP (RFC2033) for delivery\n"));
 	P(GT_("  -r, --folder      specify remote folder name\n"));
 	P(GT_("      --showdots    show progress dots even in logfiles\n"));
@@ -46,6 +46,7 @@ static flag trailer;
 static void record_current(void);
 static void user_reset(void);
 static void reset_server(const char *name, int skip);
+static void rule_add(char *what, char *pattern, int action, char *route);
 
 /* these should be of size PATH_MAX */
 char currentwd[1024] = "", rcfiledir[1024] = "";
@@ -67,9 +68,11 @@ extern char * yytext;
 %token SMTPADDRESS SMTPNAME SPAMRESPONSE PRECONNECT POSTCONNECT LIMIT WARNINGS
 %token INTERFACE MONITOR PLUGIN PLUGOUT
 %token IS HERE THERE TO MAP
-%token BATCHLIMIT FETCHLIMIT FETCHSIZELIMIT FASTUIDL EXPUNGE PROPERTIES
+%token BATCHLIMIT FETCHLIMIT FETCHSIZELIMIT FASTUIDL EXPUNGE FOLDERCONNS
+%token MDAJOBS MAILDIR MAILDIRSYNC MBOX MBOXSYNC BSMTPSYNC BSMTPCOMPRESS SPOOL
+%token PROPERTIES
 %token SET LOGFILE DAEMON SYSLOG IDFILE PIDFILE INVISIBLE POSTMASTER BOUNCEMAIL
-%token SPAMBOUNCE SOFTBOUNCE SHOWDOTS
+%token SPAMBOUNCE SOFTBOUNCE SHOWDOTS SMTPIDLE DUPFILE DIGEST
 %token BADHEADER ACCEPT REJECT_
 %token <proto> PROTO AUTHTYPE
 %token <sval>  STRING
@@ -79,7 +82,7 @@ extern char * yytext;
 %token DNS SERVICE PORT UIDL INTERVAL MIMEDECODE IDLE CHECKALIAS 
 %token SSL SSLKEY SSLCERT SSLPROTO SSLCERTCK SSLCERTFILE SSLCERTPATH SSLCOMMONNAME SSLFINGERPRINT
 %token PRINCIPAL ESMTPNAME ESMTPPASSWORD
-%token TRACEPOLLS
+%token TRACEPOLLS RULE
 
 %expect 2
 
@@ -101,7 +104,14 @@ optmap		: MAP | /* EMPTY */;
 statement	: SET LOGFILE optmap STRING	{run.logfile = prependdir ($4, rcfiledir); free($4);}
 		| SET IDFILE optmap STRING	{run.idfile = prependdir ($4, rcfiledir); free($4);}
 		| SET PIDFILE optmap STRING	{run.pidfile = prependdir ($4, rcfiledir); free($4);}
+		| SET DUPFILE optmap STRING	{run.dupfile = prependdir ($4, rcfiledir); free($4);}
+		| SET DIGEST optmap STRING	{
+			    if (!(run.digest = digest_lookup($4)))
+				yyerror(GT_("unknown digest algorithm"));
+			    free($4);
+			}
 		| SET DAEMON optmap NUMBER	{run.poll_interval = $4;}
+		| SET SMTPIDLE optmap NUMBER	{run.smtpidle = $4;}
 		| SET POSTMASTER optmap STRING	{run.postmaster = $4;}
 		| SET BOUNCEMAIL		{run.bouncemail = TRUE;}
 		| SET NO BOUNCEMAIL		{run.bouncemail = FALSE;}
@@ -316,6 +326,10 @@ user_option	: TO mapping_list HERE
 		| SPAMRESPONSE num_list
 		| MDA STRING		{current.mda         = $2;}
 		| BSMTP STRING		{current.bsmtp       = prependdir ($2, rcfiledir); free($2);}
+		| BSMTPCOMPRESS STRING	{current.bsmtpcompress = $2;}
+		| MAILDIR STRING	{current.maildir     = prependdir ($2, rcfiledir); free($2);}
+		| MBOX STRING		{current.mbox        = prependdir ($2, rcfiledir); free($2);}
+		| SPOOL STRING		{current.spool       = prependdir ($2, rcfiledir); free($2);}
 		| LMTP			{current.listener    = LMTP_MODE;}
 		| PRECONNECT STRING	{current.preconnect  = $2;}
 		| POSTCONNECT STRING	{current.postconnect = $2;}
@@ -371,8 +385,18 @@ user_option	: TO mapping_list HERE
 		| FASTUIDL NUMBER	{current.fastuidl    = NUM_VALUE_IN($2);}
 		| BATCHLIMIT NUMBER	{current.batchlimit  = NUM_VALUE_IN($2);}
 		| EXPUNGE NUMBER	{current.expunge     = NUM_VALUE_IN($2);}
+		| FOLDERCONNS NUMBER	{current.folderconns = NUM_VALUE_IN($2);}
+		| MDAJOBS NUMBER	{current.mdajobs     = NUM_VALUE_IN($2);}
+		| MAILDIRSYNC NUMBER	{current.maildirsync = NUM_VALUE_IN($2);}
+		| MBOXSYNC NUMBER	{current.mboxsync    = NUM_VALUE_IN($2);}
+		| BSMTPSYNC NUMBER	{current.bsmtpsync   = NUM_VALUE_IN($2);}
 
 		| PROPERTIES STRING	{current.properties  = $2;}
+
+		| RULE STRING STRING SKIP	{rule_add($2, $3, RULE_SKIP, NULL);}
+		| RULE STRING STRING KEEP	{rule_add($2, $3, RULE_KEEP, NULL);}
+		| RULE STRING STRING REJECT_	{rule_add($2, $3, RULE_REJECT, NULL);}
+		| RULE STRING STRING TO STRING	{rule_add($2, $3, RULE_ROUTE, $5);}
 		;
 %%
 
@@ -499,6 +523,20 @@ int prc_parse_file (const char *pathname, const flag securecheck)
 	return(PS_SUCCESS);
 }
 
+static void rule_add(char *what, char *pattern, int action, char *route)
+/* append a header rule to the current user record */
+{
+    const char *err = add_hdrrule(&current.rules, what, pattern, action, route);
+
+    free(what);
+    if (err)
+    {
+	yyerror(err);
+	free(pattern);
+	xfree(route);
+    }
+}
+
 static void reset_server(const char *name, int skip)
 /* clear the entire global record and initialize it with a new name */
 {
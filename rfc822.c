@@ -4,8 +4,10 @@ NAME:
    rfc822.c -- code for slicing and dicing RFC822 mail headers
 
 ENTRY POINTS:
-   nextaddr() -- parse the next address out of an RFC822 header
+   rfc822_begin(), rfc822_next() -- walk the addresses of an RFC822 header
+   nxtaddr() -- parse the next address out of an RFC822 header
    reply_hack() -- append hostname to local header addresses 
+   reply_hack_room() -- bound the growth of a header under reply_hack()
 
 THEORY:
    How to parse RFC822 headers in C. This is not a fully conformant
@@ -16,7 +18,8 @@ Really perverse combinations of quoting and commenting could break it.
 AUTHOR:
    Eric S. Raymond <esr@thyrsus.com>, 1997.  This source code example
 is part of fetchmail and the Unix Cookbook, and are released under the
-MIT license.  Compile with -DMAIN to build the demonstrator.
+MIT license.  Compile with -DMAIN to build the demonstrator, and with
+-DMAIN -DBENCH for a microbenchmark.
 
 ******************************************************************************/
 
@@ -48,198 +51,42 @@ const char *program_name = "rfc822";
 
 #define BEFORE_EOL(s)	(strcspn((s), "\r\n"))
 
-char *reply_hack(
-	char *buf		/* header to be hacked */,
-	const char *host	/* server hostname */,
-	size_t *length)
-/* hack message headers so replies will work properly */
+static int address_header(const char *buf)
+/* is this one of the headers reply_hack() rewrites? */
 {
-    char *from, *cp, last_nws = '\0', *parens_from = NULL;
-    int parendepth, state, has_bare_name_part, has_host_part;
-#ifndef MAIN
-    int addresscount = 1;
-#endif /* MAIN */
-
-    if (strncasecmp("From:", buf, 5)
-	&& strncasecmp("To:", buf, 3)
-	&& strncasecmp("Reply-To:", buf, 9)
-	&& strncasecmp("Return-Path:", buf, 12)
-	&& strncasecmp("Cc:", buf, 3)
-	&& strncasecmp("Bcc:", buf, 4)
-	&& strncasecmp("Resent-From:", buf, 12)
-	&& strncasecmp("Resent-To:", buf, 10)
-	&& strncasecmp("Resent-Cc:", buf, 10)
-	&& strncasecmp("Resent-Bcc:", buf, 11)
-	&& strncasecmp("Apparently-From:", buf, 16)
-	&& strncasecmp("Apparently-To:", buf, 14)
-	&& strncasecmp("Sender:", buf, 7)
-	&& strncasecmp("Resent-Sender:", buf, 14)
-       ) {
-	return(buf);
-    }
-
-#ifndef MAIN
-    if (outlevel >= O_DEBUG) {
-	report_build(stdout, GT_("About to rewrite %s...\n"), (cp = sdump(buf, BEFORE_EOL(buf))));
-	xfree(cp);
-    }
-
-    /* make room to hack the address; buf must be malloced */
-    for (cp = buf; *cp; cp++)
-	if (*cp == ',' || isspace((unsigned char)*cp))
-	    addresscount++;
-    buf = (char *)xrealloc(buf, strlen(buf) + addresscount * (strlen(host) + 1) + 1);
-#endif /* MAIN */
-
-    /*
-     * This is going to foo up on some ill-formed addresses.
-     * Note that we don't rewrite the fake address <> in order to
-     * avoid screwing up bounce suppression with a null Return-Path.
-     */
-
-    parendepth = state = 0;
-    has_host_part = has_bare_name_part = FALSE;
-    for (from = buf; *from; from++)
-    {
-#ifdef MAIN
-	if (verbose)
-	{
-	    printf("state %d: %s", state, buf);
-	    printf("%*s^\n", (int)(from - buf + 10), " ");
-	}
-#endif /* MAIN */
-	if (state != 2)
-	{
-	    if (*from == '(')
-		++parendepth;
-	    else if (*from == ')')
-		--parendepth;
-	}
-
-	if (!parendepth && !has_host_part)
-	    switch (state)
-	    {
-	    case 0:	/* before header colon */
-		if (*from == ':')
-		    state = 1;
-		break;
-
-	    case 1:	/* we've seen the colon, we're looking for addresses */
-		if (!isspace((unsigned char)*from))
-		    last_nws = *from;
-		if (*from == '<')
-		    state = 3;
-		else if (*from == '@' || *from == '!')
-		    has_host_part = TRUE;
-		else if (*from == '"')
-		    state = 2;
-		/*
-		 * Not expanding on last non-WS == ';' deals with groupnames,
-		 * an obscure misfeature described in sections
-		 * 6.1, 6.2.6, and A.1.5 of the RFC822 standard.
-		 */
-		else if ((*from == ',' || HEADER_END(from))
-			 && has_bare_name_part
-			 && !has_host_part
-			 && last_nws != ';')
-		{
-		    int hostlen;
-		    char *p;
-
-		    p = from;
-		    if (parens_from)
-			from = parens_from;
-		    while (isspace((unsigned char)*from) || (*from == ','))
-			--from;
-		    from++;
-		    hostlen = strlen(host);
-		    for (cp = from + strlen(from); cp >= from; --cp)
-			cp[hostlen+1] = *cp;
-		    *from++ = '@';
-		    memcpy(from, host, hostlen);
-		    from = p + hostlen + 1;
-		    has_host_part = TRUE;
-		} 
-		else if (from[1] == '('
-			 && has_bare_name_part
-			 && !has_host_part
-			 && last_nws != ';' && last_nws != ')')
-		{
-		    parens_from = from;
-		} 
-		else if (!isspace((unsigned char)*from))
-		    has_bare_name_part = TRUE;
-		break;
-
-	    case 2:	/* we're in a string */
-		if (*from == '"')
-		{
-		    char	*bp;
-		    int		bscount;
-
-		    bscount = 0;
-		    for (bp = from - 1; *bp == '\\'; bp--)
-			bscount++;
-		    if (!(bscount % 2))
-			state = 1;
-		}
-		break;
-
-	    case 3:	/* we're in a <>-enclosed address */
-		if (*from == '@' || *from == '!')
-		    has_host_part = TRUE;
-		else if (*from == '>' && (from > buf && from[-1] != '<'))
-		{
-		    state = 1;
-		    if (!has_host_part)
-		    {
-			int hostlen;
-
-			hostlen = strlen(host);
-			for (cp = from + strlen(from); cp >= from; --cp)
-			    cp[hostlen+1] = *cp;
-			*from++ = '@';
-			memcpy(from, host, hostlen);
-			from += hostlen;
-			has_host_part = TRUE;
-		    }
-		}
-		break;
-	    }
-
-	/*
-	 * If we passed a comma, reset everything.
-	 */
-	if ((from > buf && from[-1] == ',') && !parendepth) {
-	  has_host_part = has_bare_name_part = FALSE;
-	  parens_from = NULL;
-	}
-    }
-
-#ifndef MAIN
-    if (outlevel >= O_DEBUG) {
-	report_complete(stdout, GT_("...rewritten version is %s.\n"),
-			(cp = sdump(buf, BEFORE_EOL(buf))));
-	xfree(cp)
-    }
-
-#endif /* MAIN */
-    *length = strlen(buf);
-    return(buf);
+    return(!strncasecmp("From:", buf, 5)
+	|| !strncasecmp("To:", buf, 3)
+	|| !strncasecmp("Reply-To:", buf, 9)
+	|| !strncasecmp("Return-Path:", buf, 12)
+	|| !strncasecmp("Cc:", buf, 3)
+	|| !strncasecmp("Bcc:", buf, 4)
+	|| !strncasecmp("Resent-From:", buf, 12)
+	|| !strncasecmp("Resent-To:", buf, 10)
+	|| !strncasecmp("Resent-Cc:", buf, 10)
+	|| !strncasecmp("Resent-Bcc:", buf, 11)
+	|| !strncasecmp("Apparently-From:", buf, 16)
+	|| !strncasecmp("Apparently-To:", buf, 14)
+	|| !strncasecmp("Sender:", buf, 7)
+	|| !strncasecmp("Resent-Sender:", buf, 14));
 }
 
-char *nxtaddr(const char *hdr /* header to be parsed, NUL to continue previous hdr */)
-/* parse addresses in succession out of a specified RFC822 header */
+size_t reply_hack_room(
+	const char *buf		/* header to be hacked */,
+	const char *host	/* server hostname */)
+/* how many bytes reply_hack() may add to buf, 0 if it won't touch it */
 {
-    static char address[BUFSIZ];
-    static size_t tp;
-    static const char *hp;
-    static int	state, oldstate;
-#ifdef MAIN
-    static const char *orighdr;
-#endif /* MAIN */
-    int parendepth = 0;
+    const char *cp;
+    size_t addresscount = 1;
+
+    if (!address_header(buf))
+	return(0);
+    /* reply_hack() extends the first address and at most one per comma */
+    for (cp = buf; (cp = strchr(cp, ',')); cp++)
+	addresscount++;
+    return(addresscount * (strlen(host) + 1));
+}
 
+/* scanner states of rfc822_next() */
 #define START_HDR	0	/* before header colon */
 #define SKIP_JUNK	1	/* skip whitespace, \n, and junk */
 #define BARE_ADDRESS	2	/* collecting address without delimiters */
@@ -248,121 +95,170 @@ char *nxtaddr(const char *hdr /* header to be parsed, NUL to continue previous h
 #define INSIDE_BRACKETS	5	/* inside bracketed address */
 #define ENDIT_ALL	6	/* after last address */
 
-#define NEXTTP()	((tp < sizeof(address)-1) ? tp++ : tp)
+size_t rfc822_hdrlen(const char *hdr)
+/* length of the header at hdr, through the newline that ends it */
+{
+    const char *cp;
 
-    if (hdr)
-    {
-	hp = hdr;
-	state = START_HDR;
-#ifdef MAIN
-	orighdr = hdr;
-#endif /* MAIN */
-	tp = 0;
-    }
+    for (cp = hdr; *cp; cp++)
+	if (HEADER_END(cp))
+	    return(cp + 1 - hdr);
+    return(cp - hdr);
+}
 
-    if (!hp) return NULL;
+void rfc822_begin(struct rfc822_iter *it, const char *hdr, size_t len)
+/* set up to walk the addresses of the len bytes of header at hdr */
+{
+    it->begin = it->hp = hdr;
+    it->end = hdr + len;
+    it->state = it->oldstate = START_HDR;
+}
 
-    for (; *hp; hp++)
+int rfc822_next(struct rfc822_iter *it, struct rfc822_addr *addr,
+		char *buf, size_t size)
+/*
+ * Find the next address in the header that it walks, and describe it
+ * in addr as a span of the header.  The span runs from the first to
+ * the last byte of the address; unless addr->clean is set, comments or
+ * white space within it are not part of the address.  If buf is not
+ * NULL, also store the address itself there, cut to size - 1 bytes.
+ * Return FALSE, and store an empty string, after the last address.
+ *
+ * The header ends at a newline that is not followed by white space,
+ * at a NUL, or after len bytes, whichever comes first.  Nothing is
+ * allocated and nothing is written to the header, so any number of
+ * walks may be going on at the same time.
+ */
+{
+    const char *hp, *last = NULL;
+    size_t n = 0;			/* bytes of address seen so far */
+    int parendepth = 0;
+
+/* take the byte at p into the address */
+#define TAKE(p)	do { \
+	if (!n) \
+	    addr->start = (p); \
+	else if ((p) != last + 1) \
+	    addr->clean = FALSE; \
+	if (buf && n + 1 < size) \
+	    buf[n] = *(p); \
+	last = (p); \
+	n++; \
+    } while (0)
+
+/* drop what we have and start over after the byte at p */
+#define RESTART(p) do { \
+	n = 0; \
+	addr->start = (p) + 1; \
+	addr->clean = addr->bracketed = TRUE; \
+    } while (0)
+
+/* return the address that ends at last */
+#define FOUND() do { \
+	addr->len = n ? (size_t)(last + 1 - addr->start) : 0; \
+	if (buf && size) \
+	    buf[n < size ? n : size - 1] = '\0'; \
+	return(TRUE); \
+    } while (0)
+
+    addr->start = it->hp;
+    addr->len = 0;
+    addr->clean = TRUE;
+    addr->bracketed = FALSE;
+
+    for (hp = it->hp; hp < it->end && *hp; hp++)
     {
 #ifdef MAIN
 	if (verbose)
 	{
-	    printf("state %d: %s", state, orighdr);
-	    printf("%*s^\n", (int)(hp - orighdr + 10), " ");
+	    printf("state %d: %.*s", it->state, (int)(it->end - it->begin), it->begin);
+	    printf("%*s^\n", (int)(hp - it->begin + 10), " ");
 	}
 #endif /* MAIN */
 
-	if (state == ENDIT_ALL)		/* after last address */
-	    return(NULL);
-	else if (HEADER_END(hp))
-	{
-	    state = ENDIT_ALL;
-	    if (tp)
-	    {
-		while (tp > 0 && isspace((unsigned char)address[tp - 1]))
-		    tp--;
-		address[tp] = '\0';
-		tp = 0;
-		return (address);
-	    }
-	    return(NULL);
-	}
+	if (it->state == ENDIT_ALL)	/* after last address */
+	    break;
+	else if (hp[0] == '\n' && (hp + 1 == it->end || (hp[1] != ' ' && hp[1] != '\t')))
+	    break;
 	else if (*hp == '\\')		/* handle RFC822 escaping */
 	{
-	    if (state != INSIDE_PARENS)
+	    if (it->state != INSIDE_PARENS)
 	    {
-		address[NEXTTP()] = *hp++;	/* take the escape */
-		address[NEXTTP()] = *hp;	/* take following unsigned char */
+		TAKE(hp);			/* take the escape */
+		if (hp + 1 < it->end && hp[1])
+		{
+		    hp++;
+		    TAKE(hp);			/* take following char */
+		}
 	    }
 	}
-	else switch (state)
+	else switch (it->state)
 	{
 	case START_HDR:   /* before header colon */
 	    if (*hp == ':')
-		state = SKIP_JUNK;
+		it->state = SKIP_JUNK;
 	    break;
 
 	case SKIP_JUNK:		/* looking for address start */
 	    if (*hp == '"')	/* quoted string */
 	    {
-		oldstate = SKIP_JUNK;
-	        state = INSIDE_DQUOTE;
-		address[NEXTTP()] = *hp;
+		it->oldstate = SKIP_JUNK;
+		it->state = INSIDE_DQUOTE;
+		TAKE(hp);
 	    }
 	    else if (*hp == '(')	/* address comment -- ignore */
 	    {
 		parendepth = 1;
-		oldstate = SKIP_JUNK;
-		state = INSIDE_PARENS;    
+		it->oldstate = SKIP_JUNK;
+		it->state = INSIDE_PARENS;
 	    }
 	    else if (*hp == '<')	/* begin <address> */
 	    {
-		state = INSIDE_BRACKETS;
-		tp = 0;
+		it->state = INSIDE_BRACKETS;
+		RESTART(hp);
 	    }
 	    else if (*hp != ',' && !isspace((unsigned char)*hp))
 	    {
 		--hp;
-	        state = BARE_ADDRESS;
+		it->state = BARE_ADDRESS;
 	    }
 	    break;
 
 	case BARE_ADDRESS:   	/* collecting address without delimiters */
 	    if (*hp == ',')  	/* end of address */
 	    {
-		if (tp)
+		if (n)
 		{
-		    address[NEXTTP()] = '\0';
-		    state = SKIP_JUNK;
-		    tp = 0;
-		    return(address);
+		    it->state = SKIP_JUNK;
+		    it->hp = hp;
+		    FOUND();
 		}
 	    }
 	    else if (*hp == '(')  	/* beginning of comment */
 	    {
 		parendepth = 1;
-		oldstate = BARE_ADDRESS;
-		state = INSIDE_PARENS;    
+		it->oldstate = BARE_ADDRESS;
+		it->state = INSIDE_PARENS;
 	    }
 	    else if (*hp == '<')  	/* beginning of real address */
 	    {
-		state = INSIDE_BRACKETS;
-		tp = 0;
+		it->state = INSIDE_BRACKETS;
+		RESTART(hp);
 	    }
 	    else if (*hp == '"')        /* quoted word, copy verbatim */
 	    {
-	        oldstate = state;
-		state = INSIDE_DQUOTE;
-                address[NEXTTP()] = *hp;
-            }
+		it->oldstate = it->state;
+		it->state = INSIDE_DQUOTE;
+		TAKE(hp);
+	    }
 	    else if (!isspace((unsigned char)*hp)) 	/* just take it, ignoring whitespace */
-		address[NEXTTP()] = *hp;
+		TAKE(hp);
 	    break;
 
 	case INSIDE_DQUOTE:	/* we're in a quoted string, copy verbatim */
-	    address[NEXTTP()] = *hp;
+	    TAKE(hp);
 	    if (*hp == '"')
-		state = oldstate;
+		it->state = it->oldstate;
 	    break;
 
 	case INSIDE_PARENS:	/* we're in a parenthesized comment, ignore */
@@ -371,55 +267,217 @@ char *nxtaddr(const char *hdr /* header to be parsed, NUL to continue previous h
 	    else if (*hp == ')')
 		--parendepth;
 	    if (parendepth == 0)
-		state = oldstate;
+		it->state = it->oldstate;
 	    break;
 
 	case INSIDE_BRACKETS:	/* possible <>-enclosed address */
 	    if (*hp == '>')	/* end of address */
 	    {
-		address[NEXTTP()] = '\0';
-		state = SKIP_JUNK;
-		++hp;
-		tp = 0;
-		return(address);
+		it->state = SKIP_JUNK;
+		it->hp = hp + 1;
+		FOUND();
 	    }
 	    else if (*hp == '<')	/* nested <> */
-	        tp = 0;
+		RESTART(hp);
 	    else if (*hp == '"')	/* quoted address */
 	    {
-	        address[NEXTTP()] = *hp;
-		oldstate = INSIDE_BRACKETS;
-		state = INSIDE_DQUOTE;
+		TAKE(hp);
+		it->oldstate = INSIDE_BRACKETS;
+		it->state = INSIDE_DQUOTE;
 	    }
 	    else			/* just copy address */
-		address[NEXTTP()] = *hp;
+		TAKE(hp);
 	    break;
 	}
     }
 
+    /* end of header; white space taken last is in a quoted or bracketed run */
+    it->hp = hp;
+    it->state = ENDIT_ALL;
+    if (!n)
+    {
+	if (buf && size)
+	    buf[0] = '\0';
+	return(FALSE);
+    }
+    while (n > 0 && isspace((unsigned char)*last))
+    {
+	n--;
+	last--;
+    }
+    FOUND();
+
+#undef TAKE
+#undef RESTART
+#undef FOUND
+}
+
+char *nxtaddr(const char *hdr /* header to be parsed, NUL to continue previous hdr */)
+/* parse addresses in succession out of a specified RFC822 header;
+ * keeps its place in static storage, see rfc822_next() for a re-entrant walk */
+{
+    static char address[BUFSIZ];
+    static struct rfc822_iter it;
+    struct rfc822_addr addr;
+
+    if (hdr)
+	rfc822_begin(&it, hdr, rfc822_hdrlen(hdr));
+    else if (!it.hp)
+	return(NULL);
+    return(rfc822_next(&it, &addr, address, sizeof(address)) ? address : NULL);
+}
+
+static int needs_host(const struct rfc822_addr *addr)
+/* should reply_hack() append the server name to this address? */
+{
+    const char *cp, *end = addr->start + addr->len;
+    int quoted = FALSE, bare = addr->bracketed;
+
+    /*
+     * Leave alone the fake address <>, so as not to screw up bounce
+     * suppression with a null Return-Path, and the end of a group
+     * (an obscure misfeature described in sections 6.1, 6.2.6, and
+     * A.1.5 of the RFC822 standard).
+     */
+    if (!addr->len || end[-1] == ';')
+	return(FALSE);
+    for (cp = addr->start; cp < end; cp++)
+    {
+	if (*cp == '\\' && cp + 1 < end)
+	    cp++;
+	else if (*cp == '"')
+	    quoted = !quoted;
+	else if (!quoted && (*cp == '@' || *cp == '!'))
+	    return(FALSE);
+	else if (!quoted && !isspace((unsigned char)*cp))
+	    bare = TRUE;
+    }
+    /* a lone quoted string is a name, not a mailbox */
+    return(bare);
+}
+
+static const char *next_local(struct rfc822_iter *it,
+			      const char **prev, int *comma)
+/* end of the next address reply_hack() extends, NULL if there is none */
+{
+    struct rfc822_addr addr;
+
+    while (rfc822_next(it, &addr, NULL, 0))
+    {
+	const char *end = addr.start + addr.len;
+
+	if (!*comma && memchr(*prev, ',', addr.start - *prev))
+	    *comma = TRUE;
+	*prev = end;
+	if (*comma && needs_host(&addr))
+	{
+	    *comma = FALSE;
+	    return(end);
+	}
+    }
     return(NULL);
 }
 
+size_t reply_hack(
+	char *buf		/* header to be hacked */,
+	size_t len		/* its length */,
+	size_t room		/* reply_hack_room(buf, host) */,
+	const char *host	/* server hostname */)
+/* hack message headers so replies will work properly; return new length */
+{
+    struct rfc822_iter it;
+    const char *src, *cp, *end, *prev;
+    char *to;
+    size_t hostlen;
+    int comma;
+#ifndef MAIN
+    char *dump;
+#endif /* MAIN */
+
+    if (!room)
+	return(len);
+
+    /* most headers name no local address; leave those where they are */
+    rfc822_begin(&it, buf, len);
+    prev = buf;
+    comma = TRUE;
+    if (!next_local(&it, &prev, &comma))
+	return(len);
+
+#ifndef MAIN
+    if (outlevel >= O_DEBUG) {
+	report_build(stdout, GT_("About to rewrite %s...\n"), (dump = sdump(buf, BEFORE_EOL(buf))));
+	xfree(dump);
+    }
+#endif /* MAIN */
+
+    /*
+     * The caller made room bytes of space after buf.  Move the header
+     * to the end of that space and copy it back in one pass, appending
+     * @host to local addresses as we go.  The copy never catches up
+     * with what the walk has yet to look at: every address we extend
+     * is the first one after a comma or the first one of the header,
+     * and the room allows for exactly that many.
+     *
+     * This is going to foo up on some ill-formed addresses.
+     */
+    hostlen = strlen(host);
+    src = (const char *)memmove(buf + room, buf, len + 1);
+    to = buf;
+    cp = prev = src;
+    comma = TRUE;
+    rfc822_begin(&it, src, len);
+    while ((end = next_local(&it, &prev, &comma)))
+    {
+	memmove(to, cp, end - cp);
+	to += end - cp;
+	*to++ = '@';
+	memcpy(to, host, hostlen);
+	to += hostlen;
+	cp = end;
+    }
+    memmove(to, cp, src + len + 1 - cp);
+    len = (to - buf) + (src + len - cp);
+
+#ifndef MAIN
+    if (outlevel >= O_DEBUG) {
+	report_complete(stdout, GT_("...rewritten version is %s.\n"),
+			(dump = sdump(buf, BEFORE_EOL(buf))));
+	xfree(dump);
+    }
+#endif /* MAIN */
+    return(len);
+}
+
 #ifdef MAIN
+#ifndef BENCH
 static void parsebuf(char *longbuf, int reply)
 {
-    char	*cp;
-    size_t	dummy;
-
     if (reply)
     {
-	reply_hack(longbuf, "HOSTNAME.NET", &dummy);
-	printf("Rewritten buffer: %s", (char *)longbuf);
+	/* reply_hack() needs room after the header */
+	size_t len = strlen(longbuf);
+	size_t room = reply_hack_room(longbuf, "HOSTNAME.NET");
+	char *hacked = (char *)malloc(len + room + 1);
+
+	if (!hacked)
+	    exit(EXIT_FAILURE);
+	strcpy(hacked, longbuf);
+	reply_hack(hacked, len, room, "HOSTNAME.NET");
+	printf("Rewritten buffer: %s", hacked);
+	free(hacked);
     }
     else
-	if ((cp = nxtaddr(longbuf)) != (char *)NULL)
-	    do {
-		printf("\t-> \"%s\"\n", (char *)cp);
-	    } while
-		((cp = nxtaddr((char *)NULL)) != (char *)NULL);
-}
-
+    {
+	struct rfc822_iter	it;
+	struct rfc822_addr	addr;
+	char			address[BUFSIZ];
 
+	rfc822_begin(&it, longbuf, strlen(longbuf));
+	while (rfc822_next(&it, &addr, address, sizeof(address)))
+	    printf("\t-> \"%s\"\n", address);
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -467,6 +525,112 @@ int main(int argc, char *argv[])
     }
     exit(0);
 }
+#else /* BENCH */
+#include <time.h>
+
+#define BENCH_ADDRS	2000	/* addresses in the header */
+#define BENCH_ROUNDS	500
+#define BENCH_HOST	"HOSTNAME.NET"
+
+static char *bench_header(void)
+/* a To: header with addresses in the usual forms, half of them local */
+{
+    char *hdr = (char *)malloc(BENCH_ADDRS * 64), *tp = hdr;
+    int i;
+
+    if (!hdr)
+	exit(EXIT_FAILURE);
+    tp += sprintf(tp, "To: ");
+    for (i = 0; i < BENCH_ADDRS; i++)
+    {
+	if (i)
+	    tp += sprintf(tp, i % 4 ? ", " : ",\n\t");
+	switch (i % 4)
+	{
+	case 0:
+	    tp += sprintf(tp, "\"User %d\" <user%d@example.com>", i, i);
+	    break;
+	case 1:
+	    tp += sprintf(tp, "user%d@example.com (User %d)", i, i);
+	    break;
+	case 2:
+	    tp += sprintf(tp, "user%d", i);
+	    break;
+	case 3:
+	    tp += sprintf(tp, "User %d <user%d>", i, i);
+	    break;
+	}
+    }
+    sprintf(tp, "\n");
+    return(hdr);
+}
+
+static void bench_report(const char *name, clock_t start, size_t len,
+			 long got, long want)
+{
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-28s %8.0f MB/s%s\n", name,
+	   secs > 0 ? BENCH_ROUNDS * (len / 1048576.0) / secs : 0.0,
+	   got == want ? "" : "  WRONG RESULT");
+}
+
+int main(int argc, char *argv[])
+{
+    char *hdr, *work, address[BUFSIZ];
+    struct rfc822_iter it;
+    struct rfc822_addr addr;
+    size_t len, room, newlen = 0;
+    clock_t start;
+    long got;
+    int i;
+
+    (void)argc;
+    (void)argv;
+
+    hdr = bench_header();
+    len = strlen(hdr);
+    room = reply_hack_room(hdr, BENCH_HOST);
+    if (!(work = (char *)malloc(len + room + 1)))
+	exit(EXIT_FAILURE);
+    printf("%d addresses in a %lu byte header, %d rounds\n",
+	   BENCH_ADDRS, (unsigned long)len, BENCH_ROUNDS);
+
+    start = clock();
+    for (got = i = 0; i < BENCH_ROUNDS; i++)
+	if (nxtaddr(hdr))
+	    for (got++; nxtaddr(NULL); got++)
+		continue;
+    bench_report("nxtaddr", start, len, got, (long)BENCH_ADDRS * BENCH_ROUNDS);
+
+    start = clock();
+    for (got = i = 0; i < BENCH_ROUNDS; i++)
+	for (rfc822_begin(&it, hdr, len);
+	     rfc822_next(&it, &addr, address, sizeof(address)); got++)
+	    continue;
+    bench_report("rfc822_next, copying", start, len, got, (long)BENCH_ADDRS * BENCH_ROUNDS);
+
+    start = clock();
+    for (got = i = 0; i < BENCH_ROUNDS; i++)
+	for (rfc822_begin(&it, hdr, len);
+	     rfc822_next(&it, &addr, NULL, 0); got++)
+	    continue;
+    bench_report("rfc822_next, spans only", start, len, got, (long)BENCH_ADDRS * BENCH_ROUNDS);
+
+    start = clock();
+    for (i = 0; i < BENCH_ROUNDS; i++)
+    {
+	memcpy(work, hdr, len + 1);
+	newlen = reply_hack(work, len, room, BENCH_HOST);
+    }
+    bench_report("reply_hack", start, len, (long)newlen,
+		 (long)(len + (BENCH_ADDRS / 2) * (sizeof(BENCH_HOST))));
+
+    free(work);
+    free(hdr);
+    exit(0);
+}
+#endif /* BENCH */
 #endif /* MAIN */
 
 /* rfc822.c end */
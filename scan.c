@@ -0,0 +1,381 @@
+/*
+ * scan.c -- find and remove special bytes in message text, quote From_ lines
+ *
+ * Message text passes through a few loops that look at every byte:
+ * dropping NULs from header lines, stripping carriage returns, and
+ * checking whether a block of body text holds lines that need
+ * byte-stuffing or a CR.  scan_bytes() answers the latter in one pass,
+ * with SSE2 or AVX2 where the CPU has them, chosen at run time, and
+ * plain C elsewhere.  scan_strip() moves the runs between unwanted
+ * bytes with memchr() and memmove(), which the C library vectorises.
+ * scan_mboxrd() quotes From_ lines for mbox delivery, in text that may
+ * come in blocks splitting a line anywhere.
+ *
+ * Build with -DSTANDALONE for a microbenchmark; with -c, it only checks
+ * scan_mboxrd() on text split at every offset.
+ *
+ * For license terms, see the file COPYING in this directory.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+/* AVX2 code needs the target attribute and run-time CPU detection */
+#if defined(SCAN_SSE2) && defined(__GNUC__) \
+    && (defined(__clang__) || __GNUC__ > 4 \
+	|| (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define SCAN_AVX2
+#endif
+
+#define SCAN_ALL	(SCAN_NUL | SCAN_CR | SCAN_LF | SCAN_BARELF | SCAN_DOTLINE)
+
+static unsigned int scan_run(const char *buf, size_t len, int prev)
+/* portable scan_bytes(); prev is the byte before buf, -1 if none */
+{
+    const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+    unsigned int flags = 0;
+
+    for (; p < end; prev = *p++)
+	switch (*p)
+	{
+	case '\0':
+	    flags |= SCAN_NUL;
+	    break;
+	case '\r':
+	    flags |= SCAN_CR;
+	    break;
+	case '\n':
+	    flags |= SCAN_LF;
+	    if (prev != '\r')
+		flags |= SCAN_BARELF;
+	    break;
+	case '.':
+	    if (prev == '\n')
+		flags |= SCAN_DOTLINE;
+	    break;
+	}
+    return(flags);
+}
+
+static unsigned int scan_portable(const char *buf, size_t len)
+{
+    return(scan_run(buf, len, -1));
+}
+
+#ifdef SCAN_SSE2
+static unsigned int scan_masks(unsigned int nul, unsigned int cr,
+			       unsigned int lf, unsigned int dot, int prev)
+/* turn the match masks of one vector into SCAN_* flags; bit i stands
+ * for byte i, prev is the byte before the vector */
+{
+    unsigned int flags = 0;
+
+    if (nul)
+	flags |= SCAN_NUL;
+    if (cr)
+	flags |= SCAN_CR;
+    if (lf)
+    {
+	flags |= SCAN_LF;
+	if (lf & ~(cr << 1 | (prev == '\r')))
+	    flags |= SCAN_BARELF;
+    }
+    if (dot & (lf << 1 | (prev == '\n')))
+	flags |= SCAN_DOTLINE;
+    return(flags);
+}
+
+#define PREV(p, buf)	((p) > (buf) ? (unsigned char)(p)[-1] : -1)
+
+static unsigned int scan_sse2(const char *buf, size_t len)
+{
+    const __m128i nul = _mm_setzero_si128(), cr = _mm_set1_epi8('\r'),
+	lf = _mm_set1_epi8('\n'), dot = _mm_set1_epi8('.');
+    const char *p = buf, *end = buf + (len & ~(size_t)15);
+    unsigned int flags = 0;
+
+    for (; p < end && flags != SCAN_ALL; p += 16)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	flags |= scan_masks(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nul)),
+			    _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)),
+			    _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)),
+			    _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)),
+			    PREV(p, buf));
+    }
+    return(flags | scan_run(p, buf + len - p, PREV(p, buf)));
+}
+#endif /* SCAN_SSE2 */
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2")))
+static unsigned int scan_avx2(const char *buf, size_t len)
+{
+    const __m256i nul = _mm256_setzero_si256(), cr = _mm256_set1_epi8('\r'),
+	lf = _mm256_set1_epi8('\n'), dot = _mm256_set1_epi8('.');
+    const char *p = buf, *end = buf + (len & ~(size_t)31);
+    unsigned int flags = 0;
+
+    for (; p < end && flags != SCAN_ALL; p += 32)
+    {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	flags |= scan_masks(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nul)),
+			    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr)),
+			    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)),
+			    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot)),
+			    PREV(p, buf));
+    }
+    return(flags | scan_run(p, buf + len - p, PREV(p, buf)));
+}
+#endif /* SCAN_AVX2 */
+
+static unsigned int (*scan_impl)(const char *, size_t);
+
+static void scan_choose(void)
+/* pick the fastest implementation this CPU runs */
+{
+    scan_impl = scan_portable;
+#ifdef SCAN_SSE2
+    scan_impl = scan_sse2;
+#endif
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	scan_impl = scan_avx2;
+#endif
+}
+
+unsigned int scan_bytes(const char *buf, size_t len)
+{
+    if (!scan_impl)
+	scan_choose();
+    return(scan_impl(buf, len));
+}
+
+size_t scan_strip(char *buf, size_t len, int c)
+{
+    char *tp, *sp, *hit, *end = buf + len;
+
+    if (!(tp = (char *)memchr(buf, c, len)))
+	return(len);
+    for (sp = tp + 1; sp < end; sp = hit + 1)
+    {
+	if (!(hit = (char *)memchr(sp, c, end - sp)))
+	    hit = end;
+	memmove(tp, sp, hit - sp);
+	tp += hit - sp;
+    }
+    return(tp - buf);
+}
+
+static void scan_unhold(struct scan_from *st, void (*put)(const char *, size_t))
+/* pass on the start of a line held back by scan_mboxrd() */
+{
+    for (; st->gt > 0; st->gt--)
+	put(">", 1);
+    if (st->nfrom)
+	put("From ", st->nfrom);
+    st->nfrom = 0;
+    st->midline = 1;
+}
+
+void scan_mboxrd(struct scan_from *st, const char *buf, size_t len,
+		 void (*put)(const char *, size_t))
+{
+    const char *sp = buf, *end = buf + len, *nl;
+
+    if (!buf)
+    {
+	if (st->gt || st->nfrom)
+	    scan_unhold(st, put);
+	return;
+    }
+    while (sp < end)
+    {
+	/* a line start is held back until it is clear what it reads */
+	if (!st->midline)
+	{
+	    for (; sp < end && st->nfrom == 0 && *sp == '>'; sp++)
+		st->gt++;
+	    for (; sp < end && st->nfrom < 5 && *sp == "From "[st->nfrom]; sp++)
+		st->nfrom++;
+	    if (sp == end && st->nfrom < 5)
+		break;
+	    if (st->nfrom == 5)
+		put(">", 1);
+	    scan_unhold(st, put);
+	    continue;
+	}
+	if ((nl = (const char *)memchr(sp, '\n', end - sp)) != NULL)
+	    nl++;
+	else
+	    nl = end;
+	put(sp, nl - sp);
+	st->midline = (nl[-1] != '\n');
+	sp = nl;
+    }
+}
+
+#ifdef STANDALONE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SIZE	(4 * 1024 * 1024)
+#define BENCH_ROUNDS	50
+
+static double bench_bytes(const char *name, unsigned int (*fn)(const char *, size_t),
+			  const char *buf, size_t len, unsigned int want)
+{
+    clock_t start = clock();
+    unsigned int got = 0;
+    double secs;
+    int i;
+
+    for (i = 0; i < BENCH_ROUNDS; i++)
+	got |= fn(buf, len);
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-24s %8.0f MB/s%s\n", name,
+	   secs > 0 ? BENCH_ROUNDS * (len / 1048576.0) / secs : 0.0,
+	   got == want ? "" : "  WRONG RESULT");
+    return(secs);
+}
+
+static size_t strip_bytewise(char *buf, size_t len, int c)
+/* the loop scan_strip() replaced */
+{
+    char *sp, *tp;
+
+    for (sp = tp = buf; sp < buf + len; sp++)
+	if (*sp != c)
+	    *tp++ = *sp;
+    return(tp - buf);
+}
+
+static void bench_strip(const char *name, size_t (*fn)(char *, size_t, int),
+			const char *text, char *buf, size_t len)
+{
+    clock_t start;
+    double secs = 0;
+    size_t got = 0;
+    int i;
+
+    for (i = 0; i < BENCH_ROUNDS; i++)
+    {
+	memcpy(buf, text, len);
+	start = clock();
+	got = fn(buf, len, '\r');
+	secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    printf("%-24s %8.0f MB/s  (%lu bytes left)\n", name,
+	   secs > 0 ? BENCH_ROUNDS * (len / 1048576.0) / secs : 0.0,
+	   (unsigned long)got);
+}
+
+static char check_out[256];
+static size_t check_len;
+
+static void check_put(const char *buf, size_t len)
+{
+    if (check_len + len <= sizeof(check_out))
+	memcpy(check_out + check_len, buf, len);
+    check_len += len;
+}
+
+static int check_mboxrd(void)
+/* quote From_ lines in text split in three at every pair of offsets */
+{
+    static const char text[] =
+	"From a\nx From b\n>From c\n>>From d\n>>From\nFrom\n>Fro\nFrom ";
+    static const char want[] =
+	">From a\nx From b\n>>From c\n>>>From d\n>>From\nFrom\n>Fro\n>From ";
+    size_t len = sizeof(text) - 1, i, j;
+    struct scan_from st;
+    int errors = 0;
+
+    for (i = 0; i <= len; i++)
+	for (j = i; j <= len; j++)
+	{
+	    memset(&st, 0, sizeof(st));
+	    check_len = 0;
+	    scan_mboxrd(&st, text, i, check_put);
+	    scan_mboxrd(&st, text + i, j - i, check_put);
+	    scan_mboxrd(&st, text + j, len - j, check_put);
+	    scan_mboxrd(&st, NULL, 0, check_put);
+	    if (check_len != sizeof(want) - 1 || memcmp(check_out, want, check_len))
+	    {
+		printf("scan_mboxrd: wrong result when split at %lu and %lu\n",
+		       (unsigned long)i, (unsigned long)j);
+		errors++;
+	    }
+	}
+    return(errors);
+}
+
+int main(int argc, char **argv)
+{
+    char *text, *buf, *p;
+    unsigned int want;
+    int line;
+
+    if (check_mboxrd())
+	return(EXIT_FAILURE);
+    if (argc > 1 && !strcmp(argv[1], "-c"))
+	return(EXIT_SUCCESS);
+
+    /* mail-like text: CRLF lines of 20 to 99 bytes, some dot-stuffed */
+    text = (char *)malloc(BENCH_SIZE);
+    buf = (char *)malloc(BENCH_SIZE);
+    if (!text || !buf)
+	return(EXIT_FAILURE);
+    srand(1);
+    for (p = text, line = 0; p < text + BENCH_SIZE - 128; line++)
+    {
+	int n = 20 + rand() % 80;
+
+	if (line % 100 == 7)
+	    *p++ = '.';
+	while (n--)
+	    *p++ = 'a' + rand() % 26;
+	*p++ = '\r';
+	*p++ = '\n';
+    }
+    while (p < text + BENCH_SIZE)
+	*p++ = 'z';
+
+    want = scan_run(text, BENCH_SIZE, -1);
+    printf("scan_bytes over %d MB of text, flags %#x\n",
+	   BENCH_SIZE / 1048576, want);
+    bench_bytes("portable", scan_portable, text, BENCH_SIZE, want);
+#ifdef SCAN_SSE2
+    bench_bytes("SSE2", scan_sse2, text, BENCH_SIZE, want);
+#endif
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	bench_bytes("AVX2", scan_avx2, text, BENCH_SIZE, want);
+#endif
+    bench_bytes("scan_bytes (chosen)", scan_bytes, text, BENCH_SIZE, want);
+
+    printf("stripping CRs\n");
+    bench_strip("byte by byte", strip_bytewise, text, buf, BENCH_SIZE);
+    bench_strip("scan_strip", scan_strip, text, buf, BENCH_SIZE);
+
+    free(text);
+    free(buf);
+    return(EXIT_SUCCESS);
+}
+#endif /* STANDALONE */
+
+/* scan.c ends here */
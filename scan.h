@@ -0,0 +1,39 @@
+/** \file scan.h -- find and remove special bytes in message text, quote From_ lines */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* what scan_bytes() found in a buffer */
+#define SCAN_NUL	0x01	/**< a NUL byte */
+#define SCAN_CR		0x02	/**< a carriage return */
+#define SCAN_LF		0x04	/**< a line feed */
+#define SCAN_BARELF	0x08	/**< a line feed without a CR before it */
+#define SCAN_DOTLINE	0x10	/**< a line after the first that starts with '.' */
+
+/** Report which of the SCAN_* conditions occur in the \a len bytes at
+ * \a buf, in one pass.  A line feed at the very start counts as bare. */
+unsigned int scan_bytes(const char *buf, size_t len);
+
+/** Remove every byte \a c from the \a len bytes at \a buf, moving the
+ * rest together, and return the new length. */
+size_t scan_strip(char *buf, size_t len, int c);
+
+/** State of scan_mboxrd() between the blocks of a message; zero it
+ * before the first. */
+struct scan_from {
+    int		midline;	/**< the next byte does not start a line */
+    size_t	gt;		/**< held back: the '>' run starting a line... */
+    int		nfrom;		/**< ...and the part of "From " after it */
+};
+
+/** Pass the \a len bytes at \a buf on to \a put, quoting every line
+ * that reads ">*From " with another '>' (mboxrd style).  The text may
+ * be split anywhere; a line start that might still turn into a From_
+ * line is held back in \a st.  With \a buf NULL, at the end of the
+ * message, whatever is held back is passed on. */
+void scan_mboxrd(struct scan_from *st, const char *buf, size_t len,
+		 void (*put)(const char *, size_t));
+
+#endif
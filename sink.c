@@ -31,26 +31,154 @@
 #endif
 #include  <ctype.h>
 #include  <langinfo.h>
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+#include  <spawn.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include  <fcntl.h>
+#else /* !HAVE_FCNTL_H */
+#ifdef HAVE_SYS_FCNTL_H
+#include  <sys/fcntl.h>
+#endif /* HAVE_SYS_FCNTL_H */
+#endif /* !HAVE_FCNTL_H */
 
 #include  "fetchmail.h"
 
-/* for W* macros after pclose() */
+/* for W* macros after waitpid() */
 #define _USE_BSD
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <utime.h>
 
 #include  "socket.h"
 #include  "smtp.h"
 #include  "i18n.h"
+#include  "tunable.h"
+#include  "scan.h"
 
 /* BSD portability hack...I know, this is an ugly place to put it */
 #if !defined(SIGCHLD) && defined(SIGCLD)
 #define SIGCHLD	SIGCLD
 #endif
 
-/* makes the open_sink()/close_sink() pair non-reentrant */
-static int lmtp_responses;
+/*
+ * Recipients the LMTP listener accepted, in RCPT TO order, and what its
+ * reply after the end of message said for each; a NULL id stands for
+ * the postmaster we fell back to.  Makes the open_sink()/close_sink()
+ * pair non-reentrant.
+ */
+#define LMTP_OWED	0	/* no reply read yet */
+#define LMTP_OK		1	/* delivered */
+#define LMTP_FAILED	2	/* refused for good, to be bounced */
+#define LMTP_DEFERRED	3	/* refused for now, to be retried */
+static struct lmtp_rcpt
+{
+    const char	*id;
+    char	status;
+}
+*lmtp_rcpt;
+static int lmtp_responses, lmtp_rcptsize;
+
+static void lmtp_add(const char *id)
+/* remember an accepted recipient; one LMTP reply is owed for each */
+{
+    if (lmtp_responses >= lmtp_rcptsize)
+    {
+	lmtp_rcptsize = lmtp_rcptsize ? 2 * lmtp_rcptsize : 16;
+	lmtp_rcpt = (struct lmtp_rcpt *)xrealloc(lmtp_rcpt,
+				sizeof(struct lmtp_rcpt) * lmtp_rcptsize);
+    }
+    lmtp_rcpt[lmtp_responses].id = id;
+    lmtp_rcpt[lmtp_responses++].status = LMTP_OWED;
+}
+
+const char *lmtp_deferred(int n)
+/* the n-th recipient the LMTP listener deferred the last message for,
+ * NULL past the last one */
+{
+    int i;
+
+    for (i = 0; i < lmtp_responses; i++)
+	if (lmtp_rcpt[i].id && lmtp_rcpt[i].status == LMTP_DEFERRED
+		&& n-- == 0)
+	    return lmtp_rcpt[i].id;
+    return NULL;
+}
+
+/*
+ * Message text for the SMTP/LMTP listener is staged here rather than
+ * written line by line.  Whenever a chunk has piled up it is shipped
+ * as far as the listener takes it without waiting, so we can go on
+ * reading from the mail server while the listener works through the
+ * text.  We only wait for the listener when the buffer is full, and
+ * before we need a reply from it.
+ */
+static char *lsn_buf;
+static size_t lsn_off, lsn_len;	/* unsent text is lsn_buf[lsn_off..lsn_len) */
+static size_t lsn_tried;	/* lsn_len at the last attempt to ship */
+static flag lsn_err;		/* the listener connection failed */
+
+static int lsn_push(struct query *ctl, flag block)
+/* ship staged text to the listener; all of it if block is set, else as
+ * much as goes without waiting.  Returns -1 if the connection failed. */
+{
+    int n;
+
+    lsn_tried = lsn_len;
+    while (!lsn_err && lsn_off < lsn_len)
+    {
+	if (block)
+	    n = SockWrite(ctl->smtp_socket, lsn_buf + lsn_off, lsn_len - lsn_off);
+	else
+	{
+#ifdef MSG_DONTWAIT
+	    n = send(ctl->smtp_socket, lsn_buf + lsn_off, lsn_len - lsn_off,
+		     MSG_DONTWAIT);
+	    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			  || errno == EINTR))
+		return(0);
+#else
+	    n = SockWrite(ctl->smtp_socket, lsn_buf + lsn_off, lsn_len - lsn_off);
+#endif /* MSG_DONTWAIT */
+	}
+	if (n <= 0)
+	    lsn_err = TRUE;
+	else
+	    lsn_off += n;
+    }
+    lsn_off = lsn_len = lsn_tried = 0;
+    return(lsn_err ? -1 : 0);
+}
+
+static int lsn_write(struct query *ctl, const char *buf, size_t len)
+/* stage message text for the listener */
+{
+    if (lsn_err)
+	return(-1);
+    if (!lsn_buf)
+	lsn_buf = (char *)xmalloc(LISTENER_BUFSIZE);
+    if (lsn_len + len > LISTENER_BUFSIZE)
+    {
+	/* reclaim what was shipped, and wait if that doesn't do */
+	memmove(lsn_buf, lsn_buf + lsn_off, lsn_len - lsn_off);
+	lsn_tried -= lsn_off;
+	lsn_len -= lsn_off;
+	lsn_off = 0;
+	if (lsn_len + len > LISTENER_BUFSIZE && lsn_push(ctl, TRUE) < 0)
+	    return(-1);
+	if (len > LISTENER_BUFSIZE)
+	    return(SockWrite(ctl->smtp_socket, buf, len));
+    }
+    memcpy(lsn_buf + lsn_len, buf, len);
+    lsn_len += len;
+    if (lsn_len - lsn_tried >= LISTENER_CHUNK && lsn_push(ctl, FALSE) < 0)
+	return(-1);
+    return((int)len);
+}
 
 void smtp_close(struct query *ctl, int sayquit)
 /* close the socket to SMTP server */
@@ -62,6 +190,8 @@ void smtp_close(struct query *ctl, int sayquit)
 	SockClose(ctl->smtp_socket);
 	ctl->smtp_socket = -1;
     }
+    lsn_off = lsn_len = lsn_tried = 0;
+    lsn_err = FALSE;
     batchcount = 0;
 }
 
@@ -76,6 +206,173 @@ static void smtp_rset(struct query *ctl)
     }
 }
 
+/* idle listener connections kept for reuse ("set smtpidle") */
+static struct smtp_idle
+{
+    char	*host;		/* smtphunt entry, NULL if the slot is free */
+    int		sock;
+    char	mode;		/* SMTP_MODE or LMTP_MODE */
+    char	*helo;		/* name we greeted the listener with */
+    char	*authname;	/* ESMTP AUTH name we logged in with */
+    char	*authpass;	/* ...and the password that went with it */
+    char	*plugout;	/* plugout command the socket runs through */
+    int		esmtp_options;	/* extensions offered in the EHLO reply */
+    time_t	parked;		/* when the connection went idle */
+} smtp_pool[SMTP_POOLSIZE];
+
+static int strsame(const char *a, const char *b)
+/* compare two optional strings */
+{
+    if (!a || !b)
+	return(a == b);
+    return(strcmp(a, b) == 0);
+}
+
+static void smtp_pool_free(struct smtp_idle *ip)
+/* release a pool slot without touching its socket */
+{
+    xfree(ip->host);
+    xfree(ip->helo);
+    xfree(ip->authname);
+    xfree(ip->authpass);
+    xfree(ip->plugout);
+}
+
+static void smtp_pool_drop(struct smtp_idle *ip, int sayquit)
+/* close a pooled connection and release its slot */
+{
+    if (sayquit)
+	SMTP_quit(ip->sock, ip->mode);
+    SockClose(ip->sock);
+    smtp_pool_free(ip);
+}
+
+void smtp_pool_expire(int wait)
+/* close pooled connections that will have been idle for too long after
+ * we have waited another wait seconds without looking at them */
+{
+    time_t now = time((time_t *)NULL);
+    struct smtp_idle *ip;
+
+    for (ip = smtp_pool; ip < smtp_pool + SMTP_POOLSIZE; ip++)
+	if (ip->host && now + wait - ip->parked >= run.smtpidle)
+	{
+	    if (outlevel >= O_DEBUG)
+		report(stdout, GT_("closing idle connection to %s\n"), ip->host);
+	    smtp_pool_drop(ip, 1);
+	}
+}
+
+void smtp_pool_close(int sayquit)
+/* close all pooled listener connections */
+{
+    struct smtp_idle *ip;
+
+    for (ip = smtp_pool; ip < smtp_pool + SMTP_POOLSIZE; ip++)
+	if (ip->host)
+	    smtp_pool_drop(ip, sayquit);
+}
+
+void smtp_park(struct query *ctl)
+/* done with this query's listener connection; keep it for reuse if we can */
+{
+    struct smtp_idle *ip, *oldest = smtp_pool;
+
+    /* ODMR hands the socket over to the client side, never reuse it */
+    if (run.smtpidle <= 0 || ctl->smtp_socket == -1
+	    || ctl->server.protocol == P_ODMR)
+    {
+	smtp_close(ctl, ctl->server.protocol != P_ODMR);
+	return;
+    }
+
+    smtp_pool_expire(0);
+    for (ip = smtp_pool; ip < smtp_pool + SMTP_POOLSIZE; ip++)
+    {
+	if (!ip->host)
+	    break;
+	if (ip->parked < oldest->parked)
+	    oldest = ip;
+    }
+    if (ip == smtp_pool + SMTP_POOLSIZE)
+    {
+	smtp_pool_drop(oldest, 1);
+	ip = oldest;
+    }
+
+    ip->host = xstrdup(ctl->smtphost);
+    ip->sock = ctl->smtp_socket;
+    ip->mode = ctl->smtphostmode;
+    ip->helo = xstrdup(run.invisible ? ctl->server.truename : fetchmailhost);
+    ip->authname = ctl->server.esmtp_name ? xstrdup(ctl->server.esmtp_name) : NULL;
+    ip->authpass = ctl->server.esmtp_password ? xstrdup(ctl->server.esmtp_password) : NULL;
+    ip->plugout = ctl->server.plugout ? xstrdup(ctl->server.plugout) : NULL;
+    ip->esmtp_options = ctl->server.esmtp_options;
+    ip->parked = time((time_t *)NULL);
+
+    if (outlevel >= O_DEBUG)
+	report(stdout, GT_("keeping idle connection to %s\n"), ip->host);
+
+    ctl->smtp_socket = -1;
+    batchcount = 0;
+}
+
+static void smtp_unpark(struct query *ctl)
+/* pick up a pooled connection to one of this query's listeners */
+{
+    const char *id_me = run.invisible ? ctl->server.truename : fetchmailhost;
+    struct idlist *idp;
+    struct smtp_idle *ip;
+
+    smtp_pool_expire(0);
+    for (idp = ctl->smtphunt; idp; idp = idp->next)
+	for (ip = smtp_pool; ip < smtp_pool + SMTP_POOLSIZE; ip++)
+	{
+	    char *cp;
+
+	    if (!ip->host || strcmp(ip->host, idp->id) != 0
+		    || ip->mode != (idp->id[0] == '/' ? LMTP_MODE : ctl->listener)
+		    || !strsame(ip->helo, id_me)
+		    || !strsame(ip->authname, ctl->server.esmtp_name)
+		    || !strsame(ip->authpass, ctl->server.esmtp_password)
+		    || !strsame(ip->plugout, ctl->server.plugout))
+		continue;
+
+	    /* the listener may have timed us out in the meantime */
+	    if (SMTP_rset(ip->sock, ip->mode) != SM_OK)
+	    {
+		smtp_pool_drop(ip, 0);
+		continue;
+	    }
+
+	    ctl->smtp_socket = ip->sock;
+	    ctl->smtphost = idp->id;
+	    ctl->smtphostmode = ip->mode;
+	    ctl->server.esmtp_options = ip->esmtp_options;
+	    smtp_pool_free(ip);
+
+	    /* same canonicalization domain as a fresh connection would get */
+	    xfree(ctl->destaddr);
+	    if (ctl->smtpaddress)
+		ctl->destaddr = xstrdup(ctl->smtpaddress);
+	    else if (ctl->smtphost[0] != '/')
+	    {
+		ctl->destaddr = xstrdup(ctl->smtphost);
+		if ((cp = strrchr(ctl->destaddr, '/')))
+		    *cp = 0;
+	    }
+	    if (!ctl->destaddr || !ctl->destaddr[0])
+	    {
+		xfree(ctl->destaddr);
+		ctl->destaddr = xstrdup("localhost");
+	    }
+
+	    if (outlevel >= O_DEBUG)
+		report(stdout, GT_("reusing idle connection to %s\n"), ctl->smtphost);
+	    return;
+	}
+}
+
 int smtp_setup(struct query *ctl)
 /* try to open a socket to the appropriate SMTP server for this query */ 
 {
@@ -91,6 +388,10 @@ int smtp_setup(struct query *ctl)
 	batchcount++;
     }
 
+    /* maybe an earlier query left a connection we can use */
+    if (ctl->smtp_socket == -1 && run.smtpidle > 0)
+	smtp_unpark(ctl);
+
     /* if no socket to any SMTP host is already set up, try to open one */
     if (ctl->smtp_socket == -1) 
     {
@@ -633,10 +934,75 @@ static int handle_smtp_report_without_bounce(struct query *ctl, struct msgblk *m
 /* these are shared by open_sink and stuffline */
 static FILE *sinkfp;
 
+/* CHUNKING (RFC 3030) state: message text is collected and shipped by BDAT */
+static flag bdat_mode;
+static char *bdat_buf;
+static size_t bdat_len, bdat_size;
+static int bdat_err;			/* error reply to an earlier chunk */
+static char bdat_response[MSGBUFSIZE];
+
+static int bdat_ship(struct query *ctl, flag last)
+/* ship the collected message text as a BDAT chunk */
+{
+    int smtp_err = bdat_err;
+
+    /* after a failed chunk, RFC 3030 forbids sending any more */
+    if (smtp_err == SM_OK)
+    {
+	smtp_err = SMTP_bdat(ctl->smtp_socket, ctl->smtphostmode,
+			     bdat_buf, bdat_len, last);
+	if (smtp_err == SM_ERROR)
+	{
+	    bdat_err = smtp_err;
+	    strlcpy(bdat_response, smtp_response, sizeof(bdat_response));
+	}
+    }
+    else if (last)
+	strlcpy(smtp_response, bdat_response, sizeof(smtp_response));
+    bdat_len = 0;
+    return(smtp_err);
+}
+
+static int bdat_write(struct query *ctl, const char *buf, size_t len)
+/* add message text to the current BDAT chunk */
+{
+    if (bdat_len > 0 && bdat_len + len > BDAT_CHUNKSIZE
+	    && bdat_ship(ctl, FALSE) == SM_UNRECOVERABLE)
+	return(-1);
+
+    if (bdat_len + len > bdat_size)
+    {
+	bdat_size = bdat_len + len > BDAT_CHUNKSIZE ? bdat_len + len : BDAT_CHUNKSIZE;
+	bdat_buf = (char *)xrealloc(bdat_buf, bdat_size);
+    }
+    memcpy(bdat_buf + bdat_len, buf, len);
+    bdat_len += len;
+    return((int)len);
+}
+
+/*
+ * BSMTP delivery: the file stays open for all messages of a poll.  With
+ * a compressor, each batch becomes one compressed stream; gzip, bzip2,
+ * xz and zstd all read concatenated streams as one.
+ */
+static int bsmtp_fd = -1;	/* the file, while a compressor writes it */
+static pid_t bsmtp_zpid;	/* compressor process, if any */
+static long bsmtp_bytes;	/* written since the last sync */
+
+/* the spool is written like a Maildir */
+#define MAILDIR_SINK(ctl)	((ctl)->maildir || (ctl)->spool)
+
+static int maildir_write(const char *buf, size_t len);
+static int mbox_write(const char *buf, size_t len);
+
+/* does the next text shipped by stuffbuf() start a line? */
+static flag stuff_bol = TRUE;
+/* ...and was the last byte shipped a CR, so that a leading LF isn't bare? */
+static flag stuff_cr = FALSE;
+
 int stuffline(struct query *ctl, char *buf)
 /* ship a line to the given control block's output sink (SMTP server or MDA) */
 {
-    int	n, oldphase;
     char *last;
 
     if (!buf)
@@ -649,14 +1015,47 @@ int stuffline(struct query *ctl, char *buf)
     while ((last += strlen(last)) && (last[-1] != '\n'))
         last++;
 
+    return(stuffbuf(ctl, buf, last - buf));
+}
+
+static int stuffout(struct query *ctl, const char *buf, size_t len)
+/* write message text to the output sink as is */
+{
+    int n = 0;
+
+    if (MAILDIR_SINK(ctl))
+	n = maildir_write(buf, len);
+    else if (ctl->mbox)
+	n = mbox_write(buf, len);
+    else if (ctl->mda || ctl->bsmtp) {
+	n = fwrite(buf, 1, len, sinkfp);
+	if (ferror(sinkfp)) n = -1;
+	else if (ctl->bsmtp) bsmtp_bytes += n;
+    } else if (bdat_mode)
+	n = bdat_write(ctl, buf, len);
+    else if (ctl->smtp_socket != -1)
+	n = lsn_write(ctl, buf, len);
+    return(n);
+}
+
+static int stuffslice(struct query *ctl, char *buf, size_t len)
+/* ship message text that holds at most one line start and one line end */
+{
+    int	n, m, oldphase;
+    flag bol = stuff_bol, cr = stuff_cr, fixcr = FALSE;
+
+    if (len == 0)
+	return 0;
+    stuff_bol = (buf[len - 1] == '\n');
+    stuff_cr = (buf[len - 1] == '\r');
+
     /* fix message lines that have only \n termination (for qmail) */
-    if (ctl->forcecr)
+    if (ctl->forcecr && !ctl->stripcr && buf[len - 1] == '\n')
     {
-        if (last - 1 == buf || last[-2] != '\r')
+        if (len == 1 ? !cr : buf[len - 2] != '\r')
 	{
-	    last[-1] = '\r';
-	    *last++  = '\n';
-	    *last    = '\0';
+	    fixcr = TRUE;
+	    len--;		/* shipped as \r\n after the rest */
 	}
     }
 
@@ -666,25 +1065,27 @@ int stuffline(struct query *ctl, char *buf)
     /*
      * SMTP byte-stuffing.  We only do this if the protocol does *not*
      * use .<CR><LF> as EOM.  If it does, the server will already have
-     * decorated any . lines it sends back up.
+     * decorated any . lines it sends back up.  The rest of a line that
+     * was too long to read at once is no line of its own.
      */
-    if (*buf == '.')
+    if (bol && len && *buf == '.')
     {
 	if (ctl->server.base_protocol->delimited)	/* server has already byte-stuffed */
 	{
-	    if (ctl->mda) {
-		/* writing to MDA, undo byte-stuffing */
+	    if (ctl->mda || MAILDIR_SINK(ctl) || ctl->mbox || bdat_mode) {
+		/* writing to MDA, mailbox or BDAT chunks, undo byte-stuffing */
 		++buf;
+		--len;
 	    } else {
 		/* writing to SMTP, leave the byte-stuffing in place */;
 	    }
 	}
         else /* if (!protocol->delimited)	-- not byte-stuffed already */
 	{
-	    /* byte-stuff it */
-	    if (!ctl->mda)  {
+	    /* byte-stuff it, unless BDAT makes that unnecessary */
+	    if (!ctl->mda && !MAILDIR_SINK(ctl) && !ctl->mbox && !bdat_mode)  {
 		if (!ctl->bsmtp) {
-		    n = SockWrite(ctl->smtp_socket, buf, 1);
+		    n = lsn_write(ctl, buf, 1);
 		} else {
 		    n = fwrite(buf, 1, 1, sinkfp);
 		    if (ferror(sinkfp)) n = -1;
@@ -697,41 +1098,53 @@ int stuffline(struct query *ctl, char *buf)
 
     /* we may need to strip carriage returns */
     if (ctl->stripcr)
-    {
-	char	*sp, *tp;
+	len = scan_strip(buf, len, '\r');
 
-	for (sp = tp = buf; sp < last; sp++)
-	    if (*sp != '\r')
-		*tp++ =  *sp;
-	*tp = '\0';
-        last = tp;
-    }
-
-    n = 0;
-    if (ctl->mda || ctl->bsmtp) {
-	n = fwrite(buf, 1, last - buf, sinkfp);
-	if (ferror(sinkfp)) n = -1;
-    } else if (ctl->smtp_socket != -1)
-	n = SockWrite(ctl->smtp_socket, buf, last - buf);
+    n = stuffout(ctl, buf, len);
+    if (fixcr && n >= 0)
+	n = (m = stuffout(ctl, "\r\n", 2)) < 0 ? m : n + m;
 
     phase = oldphase;
 
     return(n);
 }
 
+int stuffbuf(struct query *ctl, char *buf, size_t len)
+/* ship len bytes of message text, whole lines or not, to the output sink */
+{
+    char *start = buf, *end = buf + len, *nl = buf;
+    unsigned int found;
+    int n, total = 0;
+
+    /* lines that start with a dot, or need a CR, go one by one */
+    found = scan_bytes(buf, len);
+    if (!(found & SCAN_DOTLINE) && !(ctl->forcecr && (found & SCAN_BARELF)))
+	return(stuffslice(ctl, buf, len));
+    while ((nl = (char *)memchr(nl, '\n', end - nl)) != NULL && ++nl < end)
+	if (*nl == '.'
+		|| (ctl->forcecr && (nl - 1 == buf ? !stuff_cr : nl[-2] != '\r')))
+	{
+	    if ((n = stuffslice(ctl, start, nl - start)) < 0)
+		return(n);
+	    total += n;
+	    start = nl;
+	}
+    if ((n = stuffslice(ctl, start, end - start)) < 0)
+	return(n);
+    return(total + n);
+}
+
+static int bsmtp_open(struct query *ctl);
+
 static int open_bsmtp_sink(struct query *ctl, struct msgblk *msg,
 	      int *good_addresses, int *bad_addresses)
 /* open a BSMTP stream */
 {
     struct	idlist *idp;
     int		need_anglebrs;
+    long	sent = 0;
 
-    if (strcmp(ctl->bsmtp, "-") == 0)
-	sinkfp = stdout;
-    else
-	sinkfp = fopen(ctl->bsmtp, "a");
-
-    if (!sinkfp || ferror(sinkfp)) {
+    if (bsmtp_open(ctl) || ferror(sinkfp)) {
 	report(stderr, GT_("BSMTP file open failed: %s\n"), 
 		strerror(errno));
         return(PS_BSMTP);
@@ -739,21 +1152,21 @@ static int open_bsmtp_sink(struct query *ctl, struct msgblk *msg,
 
     /* see the ap computation under the SMTP branch */
     need_anglebrs = (msg->return_path[0] != '<');
-    fprintf(sinkfp,
+    sent += fprintf(sinkfp,
 	    "MAIL FROM:%s%s%s",
 	    need_anglebrs ? "<" : "",
 	    (msg->return_path[0]) ? msg->return_path : user,
 	    need_anglebrs ? ">" : "");
 
     if (ctl->pass8bits || (ctl->mimemsg & MSG_IS_8BIT))
-	fputs(" BODY=8BITMIME", sinkfp);
+	sent += fprintf(sinkfp, " BODY=8BITMIME");
     else if (ctl->mimemsg & MSG_IS_7BIT)
-	fputs(" BODY=7BIT", sinkfp);
+	sent += fprintf(sinkfp, " BODY=7BIT");
 
     /* exim's BSMTP processor does not handle SIZE */
     /* fprintf(sinkfp, " SIZE=%d", msg->reallen); */
 
-    fprintf(sinkfp, "\r\n");
+    sent += fprintf(sinkfp, "\r\n");
 
     /*
      * RFC 1123 requires that the domain name part of the
@@ -769,12 +1182,13 @@ static int open_bsmtp_sink(struct query *ctl, struct msgblk *msg,
     for (idp = msg->recipients; idp; idp = idp->next)
 	if (idp->val.status.mark == XMIT_ACCEPT)
 	{
-	    fprintf(sinkfp, "RCPT TO:<%s>\r\n",
+	    sent += fprintf(sinkfp, "RCPT TO:<%s>\r\n",
 		rcpt_address (ctl, idp->id, 1));
 	    (*good_addresses)++;
 	}
 
-    fputs("DATA\r\n", sinkfp);
+    sent += fprintf(sinkfp, "DATA\r\n");
+    bsmtp_bytes += sent;
 
     if (fflush(sinkfp) || ferror(sinkfp))
     {
@@ -837,34 +1251,11 @@ static int is_dottedquad(const char *hostname)
     (*hostname == '\0');
 }
 
-static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
-	      int *good_addresses, int *bad_addresses /* this must be signed, to prevent endless loop in from_addresses */)
-/* open an SMTP stream */
+static const char *mail_from(struct query *ctl, struct msgblk *msg,
+			     char *addr, size_t len)
+/* the envelope sender for the listener; addr is used if one is made up */
 {
     const char	*ap;
-    struct	idlist *idp;
-    char		options[MSGBUFSIZE]; 
-    char		addr[HOSTLEN+USERNAMELEN+1];
-#ifdef EXPLICIT_BOUNCE_ON_BAD_ADDRESS
-    char		**from_responses;
-#endif /* EXPLICIT_BOUNCE_ON_BAD_ADDRESS */
-    int		total_addresses;
-    int		force_transient_error = 0;
-    int		smtp_err;
-
-    /*
-     * Compute ESMTP options.
-     */
-    options[0] = '\0';
-    if (ctl->server.esmtp_options & ESMTP_8BITMIME) {
-	 if (ctl->pass8bits || (ctl->mimemsg & MSG_IS_8BIT))
-	    strcpy(options, " BODY=8BITMIME");
-	 else if (ctl->mimemsg & MSG_IS_7BIT)
-	    strcpy(options, " BODY=7BIT");
-    }
-
-    if ((ctl->server.esmtp_options & ESMTP_SIZE) && msg->reallen > 0)
-	sprintf(options + strlen(options), " SIZE=%d", msg->reallen);
 
     /*
      * Try to get the SMTP listener to take the Return-Path
@@ -899,16 +1290,16 @@ static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
     {
       if (strchr(ctl->remotename,'@') || strchr(ctl->remotename,'!'))
       {
-	snprintf(addr, sizeof(addr), "%s", ctl->remotename);
+	snprintf(addr, len, "%s", ctl->remotename);
       }
       else if (is_dottedquad(ctl->server.truename))
       {
-	snprintf(addr, sizeof(addr), "%s@[%s]", ctl->remotename,
+	snprintf(addr, len, "%s@[%s]", ctl->remotename,
 		ctl->server.truename);
       }
       else
       {
-	snprintf(addr, sizeof(addr),
+	snprintf(addr, len,
 	      "%s@%s", ctl->remotename, ctl->server.truename);
       }
 	ap = addr;
@@ -922,19 +1313,92 @@ static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
     {
       if (is_dottedquad(ctl->server.truename))
       {
-	snprintf(addr, sizeof(addr), "%s@[%s]", msg->return_path,
+	snprintf(addr, len, "%s@[%s]", msg->return_path,
 		ctl->server.truename);
       }
       else
       {
-	snprintf(addr, sizeof(addr), "%s@%s",
+	snprintf(addr, len, "%s@%s",
 		msg->return_path, ctl->server.truename);
       }
 	ap = addr;
     }
 
-    if ((smtp_err = SMTP_from(ctl->smtp_socket, ctl->smtphostmode,
-		    ap, options)) == SM_UNRECOVERABLE)
+    return(ap);
+}
+
+static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
+	      int *good_addresses, int *bad_addresses /* this must be signed, to prevent endless loop in from_addresses */)
+/* open an SMTP stream */
+{
+    const char	*ap;
+    struct	idlist *idp;
+    char		options[MSGBUFSIZE]; 
+    char		addr[HOSTLEN+USERNAMELEN+1];
+#ifdef EXPLICIT_BOUNCE_ON_BAD_ADDRESS
+    char		**from_responses;
+#endif /* EXPLICIT_BOUNCE_ON_BAD_ADDRESS */
+    int		total_addresses;
+    int		force_transient_error = 0;
+    int		smtp_err;
+    /* RFC 2033 requires every LMTP server to do PIPELINING */
+    flag	pipelining = (ctl->server.esmtp_options & ESMTP_PIPELINING) != 0
+			  || ctl->smtphostmode == LMTP_MODE;
+
+    /* text still staged from a message we didn't finish goes first */
+    if (lsn_push(ctl, TRUE) < 0)
+    {
+	smtp_close(ctl, 0);
+	return(PS_TRANSIENT);
+    }
+
+    /*
+     * Compute ESMTP options.
+     */
+    options[0] = '\0';
+    if ((ctl->server.esmtp_options & (ESMTP_CHUNKING | ESMTP_BINARYMIME))
+	    == (ESMTP_CHUNKING | ESMTP_BINARYMIME)
+	    && (ctl->pass8bits || (ctl->mimemsg & MSG_IS_8BIT)))
+	strcpy(options, " BODY=BINARYMIME");
+    else if (ctl->server.esmtp_options & ESMTP_8BITMIME) {
+	 if (ctl->pass8bits || (ctl->mimemsg & MSG_IS_8BIT))
+	    strcpy(options, " BODY=8BITMIME");
+	 else if (ctl->mimemsg & MSG_IS_7BIT)
+	    strcpy(options, " BODY=7BIT");
+    }
+
+    if ((ctl->server.esmtp_options & ESMTP_SIZE) && msg->reallen > 0)
+	sprintf(options + strlen(options), " SIZE=%d", msg->reallen);
+
+    ap = mail_from(ctl, msg, addr, sizeof(addr));
+
+    /*
+     * If the listener does PIPELINING (RFC 2920), ship MAIL FROM and
+     * all RCPT TO commands in one burst and collect the replies in
+     * order below, rather than waiting a round trip for each of them.
+     * DATA is left out of the burst so that the postmaster fallback
+     * and the transient-error RSET below work just as without it.
+     */
+    total_addresses = 0;
+    if (pipelining)
+    {
+	SMTP_queue_from(ctl->smtphostmode, ap, options);
+	for (idp = msg->recipients; idp; idp = idp->next)
+	    if (idp->val.status.mark == XMIT_ACCEPT)
+	    {
+		SMTP_queue_rcpt(ctl->smtphostmode, rcpt_address(ctl, idp->id, 1));
+		total_addresses++;
+	    }
+	if (SMTP_flush(ctl->smtp_socket) != SM_OK)
+	{
+	    smtp_close(ctl, 0);
+	    return(PS_TRANSIENT);
+	}
+	smtp_err = SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_MAIL);
+    }
+    else
+	smtp_err = SMTP_from(ctl->smtp_socket, ctl->smtphostmode, ap, options);
+    if (smtp_err == SM_UNRECOVERABLE)
     {
 	smtp_close(ctl, 0);
 	return(PS_TRANSIENT);
@@ -943,6 +1407,14 @@ static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
     {
 	int err = handle_smtp_report(ctl, msg); /* map to PS_TRANSIENT or PS_REFUSED */
 
+	/* eat the replies to the pipelined RCPT TO commands */
+	while (pipelining && total_addresses--)
+	    if (SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_RCPT)
+		    == SM_UNRECOVERABLE)
+	    {
+		smtp_close(ctl, 0);
+		return(PS_TRANSIENT);
+	    }
 	smtp_rset(ctl);    /* stay on the safe side */
 	return(err);
     }
@@ -961,8 +1433,11 @@ static int open_smtp_sink(struct query *ctl, struct msgblk *msg,
 	{
 	    const char *address;
 	    address = rcpt_address (ctl, idp->id, 1);
-	    if ((smtp_err = SMTP_rcpt(ctl->smtp_socket, ctl->smtphostmode,
-			    address)) == SM_UNRECOVERABLE)
+	    if (pipelining)
+		smtp_err = SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_RCPT);
+	    else
+		smtp_err = SMTP_rcpt(ctl->smtp_socket, ctl->smtphostmode, address);
+	    if (smtp_err == SM_UNRECOVERABLE)
 	    {
 		smtp_close(ctl, 0);
 transient:
@@ -974,7 +1449,10 @@ transient:
 		return(PS_TRANSIENT);
 	    }
 	    if (smtp_err == SM_OK)
+	    {
 		(*good_addresses)++;
+		lmtp_add(idp->id);
+	    }
 	    else
 	    {
 		switch (handle_smtp_report_without_bounce(ctl, msg))
@@ -1062,15 +1540,27 @@ transient:
 	    return(PS_REFUSED);
 	}
 
+	lmtp_add(NULL);
+
 	if (outlevel >= O_VERBOSE)
 	    report(stderr, GT_("no address matches; forwarding to %s.\n"), run.postmaster);
     }
 
+    /*
+     * A CHUNKING listener takes the message text as BDAT chunks,
+     * which need neither DATA, dot-stuffing nor a terminating dot.
+     */
+    if (ctl->server.esmtp_options & ESMTP_CHUNKING)
+    {
+	bdat_mode = TRUE;
+	bdat_len = 0;
+	bdat_err = smtp_err = SM_OK;
+    }
     /* 
      * Tell the listener we're ready to send data.
      * Some listeners (like zmailer) may return antispam errors here.
      */
-    if ((smtp_err = SMTP_data(ctl->smtp_socket, ctl->smtphostmode))
+    else if ((smtp_err = SMTP_data(ctl->smtp_socket, ctl->smtphostmode))
 	    == SM_UNRECOVERABLE)
     {
 	smtp_close(ctl, 0);
@@ -1083,41 +1573,218 @@ transient:
 	return(err);
     }
 
-    /*
-     * We need to stash this away in order to know how many
-     * response lines to expect after the LMTP end-of-message.
-     */
-    lmtp_responses = *good_addresses;
-
     return(PS_SUCCESS);
 }
 
-static int open_mda_sink(struct query *ctl, struct msgblk *msg,
-	      int *good_addresses, int *bad_addresses)
-/* open a stream to a local MDA */
+static pid_t mda_pid;		/* MDA process we're feeding through sinkfp */
+static int mda_jobs;		/* MDA processes left running by close_sink_nowait() */
+
+extern char **environ;
+
+static FILE *mda_open(const char *file, char *const argv[], pid_t *pid,
+		      int outfd)
+/* start an MDA reading from a pipe; like popen(3) with "w", but without
+ * a shell unless argv asks for one, and keeping the process ID.  Unless
+ * outfd is -1, it becomes the program's standard output. */
 {
-#ifdef HAVE_SETEUID
-    uid_t orig_uid;
-#endif /* HAVE_SETEUID */
-    struct	idlist *idp;
-    int	length = 0, fromlen = 0, nameslen = 0;
-    char	*names = NULL, *before, *after, *from = NULL;
+    int pfd[2];
+    FILE *fp;
+
+    if (pipe(pfd) == -1)
+	return((FILE *)NULL);
+    /* neither this MDA nor those started later may hold our end open */
+    fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+    fcntl(pfd[1], F_SETPIPE_SZ, MDA_PIPEBUFSIZE);
+#endif /* F_SETPIPE_SZ */
+
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+    {
+	posix_spawn_file_actions_t fa;
+	int rc;
 
-    (void)bad_addresses;
-    xfree(ctl->destaddr);
-    ctl->destaddr = xstrdup("localhost");
+	posix_spawn_file_actions_init(&fa);
+	if (pfd[0] != STDIN_FILENO)
+	{
+	    posix_spawn_file_actions_adddup2(&fa, pfd[0], STDIN_FILENO);
+	    posix_spawn_file_actions_addclose(&fa, pfd[0]);
+	}
+	if (outfd != -1 && outfd != STDOUT_FILENO)
+	    posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+	rc = posix_spawnp(pid, file, &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (rc != 0)
+	{
+	    close(pfd[0]);
+	    close(pfd[1]);
+	    errno = rc;
+	    return((FILE *)NULL);
+	}
+    }
+#else
+    if ((*pid = fork()) == -1)
+    {
+	close(pfd[0]);
+	close(pfd[1]);
+	return((FILE *)NULL);
+    }
+    if (*pid == 0)
+    {
+	if (pfd[0] != STDIN_FILENO)
+	{
+	    dup2(pfd[0], STDIN_FILENO);
+	    close(pfd[0]);
+	}
+	if (outfd != -1 && outfd != STDOUT_FILENO)
+	    dup2(outfd, STDOUT_FILENO);
+	execvp(file, argv);
+	_exit(127);
+    }
+#endif /* _POSIX_SPAWN */
 
-    for (idp = msg->recipients; idp; idp = idp->next)
-	if (idp->val.status.mark == XMIT_ACCEPT)
-	    (*good_addresses)++;
+    close(pfd[0]);
+    if ((fp = fdopen(pfd[1], "w")) == NULL)
+    {
+	close(pfd[1]);
+	waitpid(*pid, NULL, 0);
+	return((FILE *)NULL);
+    }
+    setvbuf(fp, (char *)NULL, _IOFBF, MDA_PIPEBUFSIZE);
+    return(fp);
+}
 
-    length = strlen(ctl->mda);
-    before = xstrdup(ctl->mda);
+static int mda_wait(pid_t pid, flag block)
+/* wait for an MDA process; returns its status, -1 on error, or -2 if
+ * it is still running and we must not block */
+{
+    int status;
+    pid_t got;
+
+    while ((got = waitpid(pid, &status, block ? 0 : WNOHANG)) == -1
+	   && errno == EINTR)
+	continue;
+    if (got == 0)
+	return(-2);
+    return(got == -1 ? -1 : status);
+}
 
-    /* get user addresses for %T (or %s for backward compatibility) */
-    if (strstr(before, "%s") || strstr(before, "%T"))
+static int mda_status(int rc, int err, int e, int e2)
+/* report on the fate of an MDA delivery; TRUE means it succeeded */
+{
+    if (rc || err)
     {
-	/*
+	if (err) {
+	    report(stderr, GT_("Error writing to MDA: %s\n"), strerror(e2));
+	} else if (rc != -1 && WIFSIGNALED(rc)) {
+	    report(stderr, 
+		    GT_("MDA died of signal %d\n"), WTERMSIG(rc));
+	} else if (rc != -1 && WIFEXITED(rc)) {
+	    report(stderr, 
+		    GT_("MDA returned nonzero status %d\n"), WEXITSTATUS(rc));
+	} else {
+	    report(stderr,
+		    GT_("Strange: MDA waitpid returned %d and errno %d/%s, cannot handle at %s:%d\n"),
+		    rc, e, strerror(e), __FILE__, __LINE__);
+	}
+
+	return(FALSE);
+    }
+    return(TRUE);
+}
+
+/* the last MDA command we split, and its words (NULL: needs a shell) */
+static char *mda_split_cmd;
+static char **mda_words;
+
+static char **mda_split(const char *cmd)
+/* split an MDA command at blanks if it has nothing a shell would have to
+ * interpret; returns NULL otherwise */
+{
+    char **words, *buf, *cp;
+    int nwords = 0;
+
+    if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]{}#~=\n"))
+	return((char **)NULL);
+
+    buf = xstrdup(cmd);
+    words = (char **)xmalloc(sizeof(char *) * (strlen(cmd) / 2 + 2));
+    for (cp = strtok(buf, " \t"); cp; cp = strtok((char *)NULL, " \t"))
+	words[nwords++] = xstrdup(cp);
+    words[nwords] = (char *)NULL;
+    free(buf);
+
+    if (nwords == 0)
+    {
+	free(words);
+	return((char **)NULL);
+    }
+    return(words);
+}
+
+static char *mda_expand(const char *src, const char *names, const char *from,
+			flag quote)
+/* expand %s, %T and %F in an MDA command or word, quoting for the shell */
+{
+    const char *sp, *ins;
+    char *dp, *dst;
+    size_t length = strlen(src) + 1;
+
+    for (sp = src; (sp = strchr(sp, '%')); sp++)
+	if ((sp[1] == 's' || sp[1] == 'T') && names)
+	    length += strlen(names) + 2;
+	else if (sp[1] == 'F' && from)
+	    length += strlen(from) + 2;
+
+    dst = (char *)xmalloc(length);
+    for (dp = dst, sp = src; *sp; sp++)
+    {
+	ins = NULL;
+	if (sp[0] == '%' && (sp[1] == 's' || sp[1] == 'T'))
+	    ins = names;
+	else if (sp[0] == '%' && sp[1] == 'F')
+	    ins = from;
+	if (!ins)
+	{
+	    *dp++ = *sp;
+	    continue;
+	}
+
+	if (quote)
+	    *dp++ = '\'';
+	strcpy(dp, ins);
+	dp += strlen(ins);
+	if (quote)
+	    *dp++ = '\'';
+	sp++;	/* position sp over [sTF] */
+    }
+    *dp = '\0';
+    return(dst);
+}
+
+static int open_mda_sink(struct query *ctl, struct msgblk *msg,
+	      int *good_addresses, int *bad_addresses)
+/* open a stream to a local MDA */
+{
+#ifdef HAVE_SETEUID
+    uid_t orig_uid;
+#endif /* HAVE_SETEUID */
+    struct	idlist *idp;
+    int	i, nameslen = 0;
+    char	*names = NULL, *command, *from = NULL;
+    char	*shell[4], **argv;
+
+    (void)bad_addresses;
+    xfree(ctl->destaddr);
+    ctl->destaddr = xstrdup("localhost");
+
+    for (idp = msg->recipients; idp; idp = idp->next)
+	if (idp->val.status.mark == XMIT_ACCEPT)
+	    (*good_addresses)++;
+
+    /* get user addresses for %T (or %s for backward compatibility) */
+    if (strstr(ctl->mda, "%s") || strstr(ctl->mda, "%T"))
+    {
+	/*
 	 * We go through this in order to be able to handle very
 	 * long lists of users and (re)implement %s.
 	 */
@@ -1143,124 +1810,1392 @@ static int open_mda_sink(struct query *ctl, struct msgblk *msg,
 	    names[--nameslen] = '\0';	/* chop trailing space */
 	}
 
-	sanitize(names);
+	sanitize(names);
+    }
+
+    /* get From address for %F */
+    if (strstr(ctl->mda, "%F"))
+    {
+	from = xstrdup(msg->return_path);
+
+	sanitize(from);
+    }
+
+    /*
+     * Commands without shell syntax are split into words once and
+     * then run directly, with %T and %F expanded within each word,
+     * which saves starting a shell for every message.
+     */
+    if (!mda_split_cmd || strcmp(mda_split_cmd, ctl->mda))
+    {
+	if (mda_words)
+	{
+	    for (i = 0; mda_words[i]; i++)
+		free(mda_words[i]);
+	    free(mda_words);
+	}
+	xfree(mda_split_cmd);
+	mda_split_cmd = xstrdup(ctl->mda);
+	mda_words = mda_split(ctl->mda);
+    }
+
+    if (mda_words)
+    {
+	for (i = 0; mda_words[i]; i++)
+	    continue;
+	argv = (char **)xmalloc(sizeof(char *) * (i + 1));
+	for (i = 0; mda_words[i]; i++)
+	    argv[i] = mda_expand(mda_words[i], names, from, FALSE);
+	argv[i] = (char *)NULL;
+	command = NULL;
+    }
+    else
+    {
+	command = mda_expand(ctl->mda, names, from, TRUE);
+	shell[0] = "/bin/sh";
+	shell[1] = "-c";
+	shell[2] = command;
+	shell[3] = (char *)NULL;
+	argv = shell;
+    }
+    xfree(names);
+    xfree(from);
+
+    if (outlevel >= O_DEBUG)
+    {
+	if (command)
+	    report(stdout, GT_("about to deliver with: %s\n"), command);
+	else
+	{
+	    report_build(stdout, GT_("about to deliver with:"));
+	    for (i = 0; argv[i]; i++)
+		report_build(stdout, " %s", argv[i]);
+	    report_complete(stdout, "\n");
+	}
+    }
+
+#ifdef HAVE_SETEUID
+    /*
+     * Arrange to run with user's permissions if we're root.
+     * This will initialize the ownership of any files the
+     * MDA creates properly.  (The seteuid call is available
+     * under all BSDs and Linux)
+     */
+    orig_uid = getuid();
+    if (seteuid(ctl->uid)) {
+	report(stderr, GT_("Cannot switch effective user id to %ld: %s\n"), (long)ctl->uid, strerror(errno));
+	sinkfp = (FILE *)NULL;
+	goto freeargs;
+    }
+#endif /* HAVE_SETEUID */
+
+    /*
+     * We need to disable the normal SIGCHLD handling here because 
+     * sigchld_handler() would reap away the error status, returning
+     * error status instead of 0 for successful completion.
+     */
+    set_signal_handler(SIGCHLD, SIG_DFL);
+
+    sinkfp = mda_open(argv[0], argv, &mda_pid, -1);
+
+#ifdef HAVE_SETEUID
+    /* this will fail quietly if we didn't start as root */
+    if (seteuid(orig_uid)) {
+	report(stderr, GT_("Cannot switch effective user id back to original %ld: %s\n"), (long)orig_uid, strerror(errno));
+	if (sinkfp)
+	{
+	    fclose(sinkfp);
+	    sinkfp = (FILE *)NULL;
+	    mda_wait(mda_pid, TRUE);
+	}
+	goto freeargs;
+    }
+#endif /* HAVE_SETEUID */
+
+    if (!sinkfp)
+	report(stderr, GT_("MDA open failed\n"));
+
+#ifdef HAVE_SETEUID
+freeargs:
+#endif /* HAVE_SETEUID */
+    if (command)
+	free(command);
+    else
+    {
+	for (i = 0; argv[i]; i++)
+	    free(argv[i]);
+	free(argv);
+    }
+
+    if (!sinkfp)
+    {
+	if (mda_jobs == 0)
+	    deal_with_sigchld();
+	return(PS_IOERR);
+    }
+
+    return(PS_SUCCESS);
+}
+
+/*
+ * Verdicts of messages written by the local file sinks (Maildir, mbox).
+ * When their disk syncs are batched, these are known only once the
+ * batch has been synced.
+ */
+static long batch_seq;		/* messages closed so far */
+static long batch_synced;	/* messages synced so far */
+static flag batch_result[MDA_MAXJOBS + 1];
+#define BATCH_RESULT(seq)	batch_result[(seq) % (MDA_MAXJOBS + 1)]
+
+/* Maildir delivery: one file per target Maildir for the current message */
+static struct maildir_file
+{
+    char	*dir;		/* the Maildir */
+    char	*name;		/* unique file name, still in tmp/ */
+    FILE	*fp;
+    long	seq;		/* message the file belongs to */
+    flag	moved;		/* it is in new/ */
+} *md_files, *md_batch;
+static int md_nfiles;
+static int md_nbatch;		/* closed, but not yet synced and in new/ */
+
+static char *maildir_path(const char *dir, const char *sub, const char *name)
+/* build dir/sub/name */
+{
+    char *path = (char *)xmalloc(strlen(dir) + strlen(sub) + strlen(name) + 3);
+
+    sprintf(path, "%s/%s/%s", dir, sub, name);
+    return(path);
+}
+
+static int maildir_add(const char *dir)
+/* create a uniquely named file in dir/tmp for the current message */
+{
+    static char host[256];
+    static unsigned int counter;
+    struct maildir_file *mf;
+    char name[400], *path, *cp;
+    int fd, tries;
+
+    /* RFC-less but well-known Maildir naming: time.MmicrosPpidQn.host */
+    if (!host[0])
+    {
+	if (gethostname(host, sizeof(host) - 1) != 0 || !host[0])
+	    strcpy(host, "localhost");
+	for (cp = host; *cp; cp++)
+	    if (*cp == '/' || *cp == ':')
+		*cp = '_';
+    }
+
+    for (tries = 0; ; tries++)
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	snprintf(name, sizeof(name), "%ld.M%ldP%ldQ%u.%s", (long)tv.tv_sec,
+		 (long)tv.tv_usec, (long)getpid(), ++counter, host);
+	path = maildir_path(dir, "tmp", name);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) != -1)
+	    break;
+	free(path);
+	if (errno != EEXIST || tries >= 3)
+	{
+	    report(stderr, GT_("cannot create file in Maildir %s: %s\n"),
+		   dir, strerror(errno));
+	    return(-1);
+	}
+    }
+    free(path);
+
+    md_files = (struct maildir_file *)xrealloc(md_files,
+				(md_nfiles + 1) * sizeof(*md_files));
+    mf = md_files + md_nfiles;
+    if ((mf->fp = fdopen(fd, "w")) == NULL)
+    {
+	close(fd);
+	path = maildir_path(dir, "tmp", name);
+	unlink(path);
+	free(path);
+	return(-1);
+    }
+    setvbuf(mf->fp, (char *)NULL, _IOFBF, MDA_PIPEBUFSIZE);
+    mf->dir = xstrdup(dir);
+    mf->name = xstrdup(name);
+    md_nfiles++;
+    return(0);
+}
+
+static void maildir_free(struct maildir_file *mf, flag discard)
+/* release a Maildir file entry, deleting the file from tmp/ if asked */
+{
+    if (mf->fp)
+	fclose(mf->fp);
+    if (discard)
+    {
+	char *path = maildir_path(mf->dir, "tmp", mf->name);
+
+	unlink(path);
+	free(path);
+    }
+    free(mf->dir);
+    free(mf->name);
+}
+
+static void maildir_release(void)
+/* abandon the message being written */
+{
+    int i;
+
+    for (i = 0; i < md_nfiles; i++)
+	maildir_free(&md_files[i], TRUE);
+    md_nfiles = 0;
+}
+
+static flag maildir_fsync(const char *path)
+/* make sure a file or directory has hit the disk */
+{
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+	return(FALSE);
+    err = fsync(fd);
+    if (close(fd) != 0)
+	err = -1;
+    return(err == 0);
+}
+
+static flag maildir_sync(void)
+/* sync the batch of closed messages and move them to new/: first the
+ * data of all files, then their new names, once per Maildir.  A message
+ * fails as a whole: none of its copies may stay behind in new/, or the
+ * retry would deliver them twice */
+{
+    int i, j;
+
+    for (i = 0; i < md_nbatch; i++)
+    {
+	struct maildir_file *mf = &md_batch[i];
+	char *tmp = maildir_path(mf->dir, "tmp", mf->name);
+
+	mf->moved = FALSE;
+	if (!maildir_fsync(tmp))
+	{
+	    report(stderr, GT_("cannot deliver %s to Maildir %s: %s\n"),
+		   mf->name, mf->dir, strerror(errno));
+	    BATCH_RESULT(mf->seq) = FALSE;
+	}
+	free(tmp);
+    }
+
+    for (i = 0; i < md_nbatch; i++)
+    {
+	struct maildir_file *mf = &md_batch[i];
+	char *tmp, *new;
+
+	tmp = maildir_path(mf->dir, "tmp", mf->name);
+	if (!BATCH_RESULT(mf->seq))
+	{
+	    unlink(tmp);
+	    free(tmp);
+	    continue;
+	}
+	new = maildir_path(mf->dir, "new", mf->name);
+	if (rename(tmp, new) == 0)
+	    mf->moved = TRUE;
+	else
+	{
+	    report(stderr, GT_("cannot deliver %s to Maildir %s: %s\n"),
+		   mf->name, mf->dir, strerror(errno));
+	    unlink(tmp);
+	    BATCH_RESULT(mf->seq) = FALSE;
+	}
+	free(tmp);
+	free(new);
+    }
+
+    for (i = 0; i < md_nbatch; i++)
+    {
+	for (j = 0; j < i; j++)
+	    if (strcmp(md_batch[j].dir, md_batch[i].dir) == 0)
+		break;
+	if (j == i)
+	{
+	    char *newdir = maildir_path(md_batch[i].dir, "new", ".");
+
+	    /* the new names may be lost, so are the messages behind them */
+	    if (!maildir_fsync(newdir))
+	    {
+		report(stderr, GT_("cannot sync Maildir %s: %s\n"),
+		       md_batch[i].dir, strerror(errno));
+		for (j = i; j < md_nbatch; j++)
+		    if (strcmp(md_batch[j].dir, md_batch[i].dir) == 0)
+			BATCH_RESULT(md_batch[j].seq) = FALSE;
+	    }
+	    free(newdir);
+	}
+    }
+
+    /* take back the copies of failed messages that did make it to new/ */
+    for (i = 0; i < md_nbatch; i++)
+    {
+	struct maildir_file *mf = &md_batch[i];
+
+	if (mf->moved && !BATCH_RESULT(mf->seq))
+	{
+	    char *new = maildir_path(mf->dir, "new", mf->name);
+
+	    unlink(new);
+	    free(new);
+	}
+    }
+
+    for (i = 0; i < md_nbatch; i++)
+	maildir_free(&md_batch[i], FALSE);
+    md_nbatch = 0;
+    batch_synced = batch_seq;
+    return(TRUE);
+}
+
+static int open_maildir_sink(struct query *ctl, struct msgblk *msg,
+	      int *good_addresses, int *bad_addresses)
+/* create the message file(s) in the Maildir(s) */
+{
+#ifdef HAVE_SETEUID
+    uid_t orig_uid;
+#endif /* HAVE_SETEUID */
+    struct	idlist *idp;
+    int		err = 0;
+
+    xfree(ctl->destaddr);
+    ctl->destaddr = xstrdup("localhost");
+
+#ifdef HAVE_SETEUID
+    /* files are created with the same identity an MDA would run as */
+    orig_uid = getuid();
+    if (seteuid(ctl->uid)) {
+	report(stderr, GT_("Cannot switch effective user id to %ld: %s\n"), (long)ctl->uid, strerror(errno));
+	return PS_IOERR;
+    }
+#endif /* HAVE_SETEUID */
+
+    if (!strstr(ctl->maildir, "%T"))
+    {
+	for (idp = msg->recipients; idp; idp = idp->next)
+	    if (idp->val.status.mark == XMIT_ACCEPT)
+		(*good_addresses)++;
+	err = maildir_add(ctl->maildir);
+    }
+    else
+    {
+	/* multidrop: one copy in each recipient's Maildir */
+	for (idp = msg->recipients; idp && !err; idp = idp->next)
+	{
+	    char *dir;
+
+	    if (idp->val.status.mark != XMIT_ACCEPT)
+		continue;
+	    if (!idp->id[0] || idp->id[0] == '.' || strchr(idp->id, '/'))
+	    {
+		report(stderr, GT_("no Maildir for recipient %s\n"), idp->id);
+		idp->val.status.mark = XMIT_REJECT;
+		(*bad_addresses)++;
+		continue;
+	    }
+	    dir = mda_expand(ctl->maildir, idp->id, NULL, FALSE);
+	    err = maildir_add(dir);
+	    free(dir);
+	    (*good_addresses)++;
+	}
+
+	if (!err && *good_addresses == 0)
+	{
+	    char *dir = mda_expand(ctl->maildir, run.postmaster, NULL, FALSE);
+
+	    err = maildir_add(dir);
+	    free(dir);
+	}
+    }
+
+#ifdef HAVE_SETEUID
+    /* this will fail quietly if we didn't start as root */
+    if (seteuid(orig_uid)) {
+	report(stderr, GT_("Cannot switch effective user id back to original %ld: %s\n"), (long)orig_uid, strerror(errno));
+	err = -1;
+    }
+#endif /* HAVE_SETEUID */
+
+    if (err)
+    {
+	maildir_release();
+	return(PS_IOERR);
+    }
+    return(PS_SUCCESS);
+}
+
+static int maildir_write(const char *buf, size_t len)
+/* append text to all files of the current message */
+{
+    int i;
+
+    for (i = 0; i < md_nfiles; i++)
+	if (fwrite(buf, 1, len, md_files[i].fp) != len)
+	    return(-1);
+    return((int)len);
+}
+
+static flag maildir_check(void)
+/* flush the current message's files, reporting write errors */
+{
+    int i;
+
+    for (i = 0; i < md_nfiles; i++)
+	if (ferror(md_files[i].fp) || fflush(md_files[i].fp))
+	{
+	    report(stderr, GT_("Error writing to Maildir %s: %s\n"),
+		   md_files[i].dir, strerror(errno));
+	    return(FALSE);
+	}
+    return(TRUE);
+}
+
+static int close_maildir_sink(flag defer)
+/* finish the current message; unless deferred, sync and publish it now
+ * together with the rest of the batch */
+{
+    flag ok = maildir_check();
+    int i;
+
+    batch_seq++;
+    for (i = 0; i < md_nfiles; i++)
+    {
+	struct maildir_file *mf = &md_files[i];
+
+	if (ok)
+	{
+	    if (fclose(mf->fp) != 0)
+	    {
+		report(stderr, GT_("Error writing to Maildir %s: %s\n"),
+		       mf->dir, strerror(errno));
+		ok = FALSE;
+	    }
+	    mf->fp = NULL;
+	}
+	mf->seq = batch_seq;
+	if (!ok)
+	    maildir_free(mf, TRUE);
+	else
+	{
+	    md_batch = (struct maildir_file *)xrealloc(md_batch,
+				(md_nbatch + 1) * sizeof(*md_batch));
+	    md_batch[md_nbatch++] = *mf;
+	}
+    }
+    md_nfiles = 0;
+
+    /* a failed message leaves no copies behind */
+    if (!ok)
+	while (md_nbatch > 0 && md_batch[md_nbatch - 1].seq == batch_seq)
+	    maildir_free(&md_batch[--md_nbatch], TRUE);
+
+    BATCH_RESULT(batch_seq) = ok;
+    if (!defer)
+	maildir_sync();
+    return(BATCH_RESULT(batch_seq));
+}
+
+/*
+ * Spooling: messages for the listener are first made durable in a
+ * Maildir-like spool (tmp/, new/), each file holding the BSMTP-style
+ * envelope followed by the message, and are deleted on the server as
+ * soon as that is done.  drain_spool() delivers them later on.
+ */
+static int open_spool_sink(struct query *ctl, struct msgblk *msg,
+	      int *good_addresses, int *bad_addresses)
+/* create the spool file and write the envelope to it */
+{
+    struct	idlist *idp;
+    FILE	*fp;
+    char	addr[HOSTLEN+USERNAMELEN+1];
+    const char	*ap;
+    size_t	len;
+
+    (void)bad_addresses;
+    xfree(ctl->destaddr);
+    ctl->destaddr = xstrdup(ctl->smtpaddress ? ctl->smtpaddress : "localhost");
+
+    if (maildir_add(ctl->spool))
+	return(PS_IOERR);
+    fp = md_files[0].fp;
+
+    /* the sender goes between brackets of its own, so "<>" is empty */
+    ap = mail_from(ctl, msg, addr, sizeof(addr));
+    len = strlen(ap);
+    if (len >= 2 && ap[0] == '<' && ap[len - 1] == '>')
+    {
+	ap++;
+	len -= 2;
+    }
+    fprintf(fp, "MAIL FROM:<%.*s>", (int)len, ap);
+    if (ctl->pass8bits || (ctl->mimemsg & MSG_IS_8BIT))
+	fputs(" BODY=8BITMIME", fp);
+    else if (ctl->mimemsg & MSG_IS_7BIT)
+	fputs(" BODY=7BIT", fp);
+    fputs("\r\n", fp);
+
+    for (idp = msg->recipients; idp; idp = idp->next)
+	if (idp->val.status.mark == XMIT_ACCEPT)
+	{
+	    fprintf(fp, "RCPT TO:<%s>\r\n", rcpt_address(ctl, idp->id, 1));
+	    (*good_addresses)++;
+	}
+    if (*good_addresses == 0)
+    {
+	if (!run.postmaster[0])
+	{
+	    if (outlevel >= O_VERBOSE)
+		report(stderr, GT_("no address matches; no postmaster set.\n"));
+	    maildir_release();
+	    return(PS_REFUSED);
+	}
+	fprintf(fp, "RCPT TO:<%s>\r\n", rcpt_address(ctl, run.postmaster, 0));
+    }
+    fputs("DATA\r\n", fp);
+
+    if (ferror(fp))
+    {
+	report(stderr, GT_("Error writing to spool %s: %s\n"), ctl->spool, strerror(errno));
+	maildir_release();
+	return(PS_IOERR);
+    }
+    return(PS_SUCCESS);
+}
+
+/*
+ * While a spooled message is tried, its recipients are marked
+ * XMIT_ACCEPT (still to do), XMIT_DEFERRED (refused for now),
+ * XMIT_FAILED (refused for good, to be bounced) or XMIT_DONE.
+ */
+#define SPOOL_TRIED	0	/* the recipients tell how it went */
+#define SPOOL_BAD	1	/* not a spool file we can make sense of */
+#define SPOOL_DOWN	2	/* no listener; try all messages later */
+
+static int spool_envelope(FILE *fp, struct msgblk *msg,
+			  char *options, size_t optlen)
+/* read the envelope of a spool file up to and including DATA */
+{
+    char	buf[MSGBUFSIZE + 1], *cp;
+
+    /* MAIL FROM:<sender> [options], the sender may hold a '>' */
+    if (!fgets(buf, sizeof(buf), fp) || strncmp(buf, "MAIL FROM:<", 11)
+	    || (cp = strrchr(buf, '>')) == NULL)
+	return(FALSE);
+    *cp++ = '\0';
+    cp[strcspn(cp, "\r\n")] = '\0';
+    strlcpy(msg->return_path, buf + 11, sizeof(msg->return_path));
+    strlcpy(options, cp, optlen);
+
+    /* RCPT TO:<recipient>, as many as there are, then DATA */
+    while (fgets(buf, sizeof(buf), fp) && !strncmp(buf, "RCPT TO:<", 9))
+    {
+	buf[strcspn(buf, ">\r\n")] = '\0';
+	save_str(&msg->recipients, buf + 9, XMIT_ACCEPT);
+    }
+    return(msg->recipients && !strncmp(buf, "DATA", 4));
+}
+
+static void spool_mark(struct msgblk *msg, int from, int to, char **errors)
+/* re-mark recipients; those that fail for good keep the listener's word */
+{
+    struct idlist *idp;
+    int i;
+
+    for (i = 0, idp = msg->recipients; idp; idp = idp->next, i++)
+	if (idp->val.status.mark == from)
+	{
+	    idp->val.status.mark = to;
+	    if (to == XMIT_FAILED)
+	    {
+		xfree(errors[i]);
+		errors[i] = xstrdup(smtp_response);
+	    }
+	}
+}
+
+static int spool_deliver(struct query *ctl, FILE *fp, struct msgblk *msg,
+			 const char *options, char **errors)
+/* ship one spool file, positioned after DATA, to the listener */
+{
+    char	buf[MSGBUFSIZE], *sp, *nl, *end;
+    struct idlist *idp;
+    int		smtp_err, accepted = 0, i;
+    flag	bol = TRUE, cr = FALSE;
+    size_t	n;
+    char	mode;
+
+    if (smtp_setup(ctl) == -1)
+	return(SPOOL_DOWN);
+    mode = ctl->smtphostmode;
+
+    if ((smtp_err = SMTP_from(ctl->smtp_socket, mode, msg->return_path,
+			      (ctl->server.esmtp_options & ESMTP_8BITMIME)
+			      && options[0] ? options : NULL)) != SM_OK)
+	goto refused;
+
+    for (i = 0, idp = msg->recipients; idp; idp = idp->next, i++)
+    {
+	if ((smtp_err = SMTP_rcpt(ctl->smtp_socket, mode, idp->id)) == SM_OK)
+	    accepted++;
+	else if (smtp_err == SM_UNRECOVERABLE)
+	    goto refused;
+	else if (smtp_response[0] == '5')
+	{
+	    report(stderr, GT_("%cMTP listener refused spooled message for %s: %s\n"),
+		   mode, idp->id, smtp_response);
+	    idp->val.status.mark = XMIT_FAILED;
+	    errors[i] = xstrdup(smtp_response);
+	}
+	else
+	    idp->val.status.mark = XMIT_DEFERRED;
+    }
+    if (accepted == 0)
+    {
+	smtp_rset(ctl);
+	return(SPOOL_TRIED);
+    }
+    if ((smtp_err = SMTP_data(ctl->smtp_socket, mode)) != SM_OK)
+	goto refused;
+
+    /*
+     * The message text, byte-stuffed, with any CR stripcr took put
+     * back.  It is read in blocks, as a line may hold NUL bytes.
+     */
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+	for (sp = buf, end = buf + n; sp < end; sp = nl)
+	{
+	    if (bol && *sp == '.' && SockWrite(ctl->smtp_socket, ".", 1) < 0)
+		break;
+	    if ((nl = (char *)memchr(sp, '\n', end - sp)) == NULL)
+		nl = end;
+	    if (nl > sp && SockWrite(ctl->smtp_socket, sp, nl - sp) < 0)
+		break;
+	    if (nl == end)
+	    {
+		bol = FALSE;
+		cr = (nl[-1] == '\r');
+		continue;
+	    }
+	    if (nl > sp)
+		cr = (nl[-1] == '\r');
+	    if (SockWrite(ctl->smtp_socket, cr ? "\n" : "\r\n", cr ? 1 : 2) < 0)
+		break;
+	    bol = TRUE;
+	    cr = FALSE;
+	    nl++;
+	}
+	if (sp < end)
+	    break;
+    }
+    if (ferror(fp) || !feof(fp))
+    {
+	/* a half-shipped message must not be taken for complete */
+	smtp_close(ctl, 0);
+	return(SPOOL_TRIED);
+    }
+    if (!bol)
+	SockWrite(ctl->smtp_socket, cr ? "\n" : "\r\n", cr ? 1 : 2);
+    if ((smtp_err = SMTP_eom(ctl->smtp_socket, mode)) != SM_OK)
+	goto refused;
+    if (mode != LMTP_MODE)
+    {
+	spool_mark(msg, XMIT_ACCEPT, XMIT_DONE, errors);
+	return(SPOOL_TRIED);
+    }
+
+    /* LMTP answers once per accepted recipient, in order */
+    for (i = 0, idp = msg->recipients; idp; idp = idp->next, i++)
+    {
+	if (idp->val.status.mark != XMIT_ACCEPT)
+	    continue;
+	if ((smtp_err = SMTP_ok(ctl->smtp_socket, mode, TIMEOUT_EOM)) == SM_UNRECOVERABLE)
+	{
+	    smtp_close(ctl, 0);
+	    return(SPOOL_TRIED);
+	}
+	if (smtp_err == SM_OK)
+	    idp->val.status.mark = XMIT_DONE;
+	else
+	{
+	    report(stderr, GT_("%cMTP listener refused spooled message for %s: %s\n"),
+		   mode, idp->id, smtp_response);
+	    if (smtp_response[0] == '5')
+	    {
+		idp->val.status.mark = XMIT_FAILED;
+		errors[i] = xstrdup(smtp_response);
+	    }
+	    else
+		idp->val.status.mark = XMIT_DEFERRED;
+	}
+    }
+    return(SPOOL_TRIED);
+
+refused:
+    /* the recipients not yet settled share the fate of the transaction */
+    if (smtp_err == SM_UNRECOVERABLE)
+    {
+	smtp_close(ctl, 0);
+	return(SPOOL_TRIED);
+    }
+    report(stderr, GT_("%cMTP listener refused spooled message: %s\n"),
+	   mode, smtp_response);
+    smtp_rset(ctl);
+    spool_mark(msg, XMIT_ACCEPT,
+	       smtp_response[0] == '5' ? XMIT_FAILED : XMIT_DEFERRED, errors);
+    return(SPOOL_TRIED);
+}
+
+static int spool_bounce(struct query *ctl, FILE *fp, long text,
+			struct msgblk *msg, char **errors)
+/* bounce a spooled message for the recipients that failed for good */
+{
+    char	buf[MSGBUFSIZE + 1], **failed;
+    struct idlist *idp;
+    size_t	len = 0, n;
+    int		nfailed = 0, i, ok;
+
+    failed = (char **)xmalloc(sizeof(char *) * (count_list(&msg->recipients) + 1));
+    for (i = 0, idp = msg->recipients; idp; idp = idp->next, i++)
+	if (idp->val.status.mark == XMIT_FAILED)
+	    failed[nfailed++] = errors[i];
+
+    /* the bounce quotes the headers, with CRLF line ends */
+    if (fseek(fp, text, SEEK_SET) == 0)
+	while (fgets(buf, sizeof(buf), fp))
+	{
+	    n = strcspn(buf, "\r\n");
+	    if (n == 0 && buf[n])
+		break;
+	    msg->headers = (char *)xrealloc(msg->headers, len + n + 3);
+	    memcpy(msg->headers + len, buf, n);
+	    len += n;
+	    if (buf[n])
+	    {
+		memcpy(msg->headers + len, "\r\n", 2);
+		len += 2;
+	    }
+	    msg->headers[len] = '\0';
+	}
+
+    ok = send_bouncemail(ctl, msg, XMIT_FAILED,
+			 "Delivery of spooled message failed.\r\n",
+			 nfailed, failed);
+    free(failed);
+    return(ok);
+}
+
+static int spool_rewrite(struct query *ctl, FILE *fp, const char *name,
+			 struct msgblk *msg)
+/* keep only the recipients still to do in a spool file, atomically */
+{
+    char	buf[MSGBUFSIZE + 1], *tmp, *path;
+    struct idlist *idp;
+    FILE	*out;
+    size_t	n;
+    int		ok = FALSE;
+
+    tmp = maildir_path(ctl->spool, "tmp", name);
+    path = maildir_path(ctl->spool, "new", name);
+    if ((out = fopen(tmp, "w")) != NULL)
+    {
+	/* the MAIL FROM line stays, RCPT lines go unless still needed */
+	rewind(fp);
+	if (fgets(buf, sizeof(buf), fp))
+	    fputs(buf, out);
+	for (idp = msg->recipients; idp; idp = idp->next)
+	    if (fgets(buf, sizeof(buf), fp)
+		    && (idp->val.status.mark == XMIT_ACCEPT
+			|| idp->val.status.mark == XMIT_DEFERRED))
+		fputs(buf, out);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+	    fwrite(buf, 1, n, out);
+	ok = !ferror(fp) && fflush(out) == 0 && !ferror(out)
+	    && fsync(fileno(out)) == 0;
+	ok = (fclose(out) == 0) && ok && rename(tmp, path) == 0;
+    }
+    if (!ok)
+    {
+	report(stderr, GT_("cannot rewrite spooled message %s: %s\n"),
+	       path, strerror(errno));
+	unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    return(ok);
+}
+
+int drain_spool(struct query *ctl)
+/* deliver what is in the spool; returns the number of messages delivered */
+{
+    char	*newdir, *path, *faildir, **errors, options[64];
+    DIR		*dp;
+    struct dirent *de;
+    struct stat	st;
+    struct msgblk msg;
+    struct idlist *idp;
+    time_t	now = time((time_t *)NULL), age, wait;
+    int		delivered = 0, rc = SPOOL_TRIED, nrcpt, left, settled, i;
+    long	text;
+    FILE	*fp;
+
+    newdir = maildir_path(ctl->spool, "new", "");
+    if ((dp = opendir(newdir)) == NULL)
+    {
+	report(stderr, GT_("cannot read spool %s: %s\n"), newdir, strerror(errno));
+	free(newdir);
+	return(0);
+    }
+    free(newdir);
+
+    while (rc != SPOOL_DOWN && (de = readdir(dp)) != NULL)
+    {
+	if (de->d_name[0] == '.')
+	    continue;
+
+	/* a file's mtime is when the next attempt is due */
+	path = maildir_path(ctl->spool, "new", de->d_name);
+	if (stat(path, &st) != 0 || st.st_mtime > now
+		|| (fp = fopen(path, "r")) == NULL)
+	{
+	    free(path);
+	    continue;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	errors = NULL;
+	nrcpt = 0;
+	if (!spool_envelope(fp, &msg, options, sizeof(options)))
+	    rc = SPOOL_BAD;
+	else
+	{
+	    text = ftell(fp);
+	    nrcpt = count_list(&msg.recipients);
+	    errors = (char **)xmalloc(sizeof(char *) * nrcpt);
+	    memset(errors, 0, sizeof(char *) * nrcpt);
+	    rc = spool_deliver(ctl, fp, &msg, options, errors);
+	}
+
+	if (rc == SPOOL_BAD)
+	{
+	    /* keep it where the postmaster can look at it */
+	    faildir = maildir_path(ctl->spool, "failed", "");
+	    mkdir(faildir, 0700);
+	    free(faildir);
+	    faildir = maildir_path(ctl->spool, "failed", de->d_name);
+	    report(stderr, GT_("malformed spool file %s\n"), path);
+	    if (rename(path, faildir) != 0)
+		report(stderr, GT_("cannot move %s out of the spool: %s\n"),
+		       path, strerror(errno));
+	    else
+		report(stderr, GT_("spooled message moved to %s\n"), faildir);
+	    free(faildir);
+	}
+	else
+	{
+	    /* file names start with the time the message was spooled */
+	    age = now - strtol(de->d_name, NULL, 10);
+	    if (age > SPOOL_EXPIRE)
+	    {
+		report(stderr, GT_("spooled message %s expired\n"), de->d_name);
+		strlcpy(smtp_response, "554 5.4.7 Delivery time expired",
+			sizeof(smtp_response));
+		spool_mark(&msg, XMIT_ACCEPT, XMIT_FAILED, errors);
+		spool_mark(&msg, XMIT_DEFERRED, XMIT_FAILED, errors);
+	    }
+
+	    /* a recipient is settled once it got the message or a bounce */
+	    for (idp = msg.recipients; idp; idp = idp->next)
+		if (idp->val.status.mark == XMIT_FAILED)
+		    break;
+	    if (idp && !spool_bounce(ctl, fp, text, &msg, errors))
+	    {
+		report(stderr, GT_("bounce for spooled message %s failed, will retry\n"),
+		       de->d_name);
+		for (; idp; idp = idp->next)
+		    if (idp->val.status.mark == XMIT_FAILED)
+			idp->val.status.mark = XMIT_DEFERRED;
+	    }
+	    left = settled = 0;
+	    for (idp = msg.recipients; idp; idp = idp->next)
+		if (idp->val.status.mark == XMIT_DONE
+			|| idp->val.status.mark == XMIT_FAILED)
+		    settled++;
+		else
+		    left++;
+
+	    if (left == 0)
+	    {
+		unlink(path);
+		delivered++;
+	    }
+	    else
+	    {
+		/* back off: wait about as long again as the message already did */
+		struct utimbuf ut;
+
+		if (settled)
+		    spool_rewrite(ctl, fp, de->d_name, &msg);
+		wait = age < SPOOL_MINRETRY ? SPOOL_MINRETRY
+		    : age > SPOOL_MAXRETRY ? SPOOL_MAXRETRY : age;
+		ut.actime = now;
+		ut.modtime = now + wait;
+		utime(path, &ut);
+	    }
+	}
+
+	fclose(fp);
+	for (i = 0; i < nrcpt; i++)
+	    xfree(errors[i]);
+	xfree(errors);
+	xfree(msg.headers);
+	free_str_list(&msg.recipients);
+	free(path);
+    }
+    closedir(dp);
+
+    if (outlevel >= O_VERBOSE && delivered)
+	report(stdout, GT_("%d spooled messages delivered from %s\n"),
+	       delivered, ctl->spool);
+    smtp_park(ctl);
+    return(delivered);
+}
+
+/* mbox delivery: the mailbox stays open and locked for a whole batch */
+static int mbox_fd = -1;
+static char *mbox_lockname;	/* dot-lock file, if we hold one */
+static char *mbox_buf;		/* appends are collected here */
+static size_t mbox_buflen;
+static flag mbox_failed;	/* write error in the current message */
+static off_t mbox_batchstart;	/* mailbox size before the batch */
+static off_t mbox_msgstart;	/* mailbox size before this message */
+static struct scan_from mbox_from;	/* From_ quoting across writes */
+
+static int mbox_append(const char *buf, size_t len)
+/* write text to the mailbox file */
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	if ((n = write(mbox_fd, buf, len)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    mbox_failed = TRUE;
+	    return(-1);
+	}
+	buf += n;
+	len -= n;
+    }
+    return(0);
+}
+
+static int mbox_flush(void)
+/* write out the append buffer */
+{
+    size_t len = mbox_buflen;
+
+    mbox_buflen = 0;
+    return(mbox_failed ? -1 : mbox_append(mbox_buf, len));
+}
+
+static void mbox_put(const char *buf, size_t len)
+/* append text to the buffer, flushing it when full */
+{
+    if (mbox_failed)
+	return;
+    if (mbox_buflen + len > MBOX_BUFSIZE && mbox_flush())
+	return;
+    if (len >= MBOX_BUFSIZE)
+    {
+	mbox_append(buf, len);	/* too big to copy */
+	return;
+    }
+    if (!mbox_buf)
+	mbox_buf = (char *)xmalloc(MBOX_BUFSIZE);
+    memcpy(mbox_buf + mbox_buflen, buf, len);
+    mbox_buflen += len;
+}
+
+static void mbox_unlock(void)
+/* close the mailbox, dropping its locks */
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl(mbox_fd, F_SETLK, &fl);
+    close(mbox_fd);
+    mbox_fd = -1;
+
+    if (mbox_lockname)
+    {
+	unlink(mbox_lockname);
+	free(mbox_lockname);
+	mbox_lockname = NULL;
+    }
+}
+
+static int mbox_lock(const char *path)
+/* open the mailbox for appending and lock it the way MUAs expect:
+ * a path.lock dot-lock where we may create one, plus an fcntl() lock */
+{
+    struct flock fl;
+    struct stat st;
+    int fd, tries;
+    char *lockname;
+
+    lockname = (char *)xmalloc(strlen(path) + sizeof(".lock"));
+    strcpy(lockname, path);
+    strcat(lockname, ".lock");
+    for (tries = 0; ; tries++)
+    {
+	if ((fd = open(lockname, O_WRONLY | O_CREAT | O_EXCL, 0600)) != -1)
+	{
+	    close(fd);
+	    mbox_lockname = lockname;
+	    break;
+	}
+	if (errno != EEXIST)
+	{
+	    /* no write access to the spool directory, rely on fcntl() */
+	    free(lockname);
+	    break;
+	}
+	if (stat(lockname, &st) == 0
+		&& time((time_t *)NULL) - st.st_mtime > MBOX_LOCKSTALE)
+	{
+	    report(stderr, GT_("removing stale lock file %s\n"), lockname);
+	    unlink(lockname);
+	    continue;
+	}
+	if (tries >= MBOX_LOCKTRIES)
+	{
+	    report(stderr, GT_("mailbox %s is locked\n"), path);
+	    free(lockname);
+	    return(-1);
+	}
+	sleep(1);
+    }
+
+    if ((mbox_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+    {
+	report(stderr, GT_("cannot open mailbox %s: %s\n"), path, strerror(errno));
+	if (mbox_lockname)
+	{
+	    unlink(mbox_lockname);
+	    free(mbox_lockname);
+	    mbox_lockname = NULL;
+	}
+	return(-1);
+    }
+#ifdef FD_CLOEXEC
+    fcntl(mbox_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    for (tries = 0; fcntl(mbox_fd, F_SETLK, &fl) == -1; tries++)
+    {
+	if ((errno != EACCES && errno != EAGAIN) || tries >= MBOX_LOCKTRIES)
+	{
+	    report(stderr, GT_("cannot lock mailbox %s: %s\n"), path, strerror(errno));
+	    mbox_unlock();
+	    return(-1);
+	}
+	sleep(1);
+    }
+
+    mbox_batchstart = lseek(mbox_fd, 0, SEEK_END);
+    return(0);
+}
+
+static void mbox_cut(off_t size)
+/* drop what was appended after the mailbox had this size */
+{
+    mbox_buflen = 0;
+    if (ftruncate(mbox_fd, size) != 0)
+	report(stderr, GT_("cannot remove partial message from mailbox: %s\n"),
+	       strerror(errno));
+}
+
+static flag mbox_sync(void)
+/* sync the batch to disk and unlock the mailbox; if that fails, cut the
+ * batch off again so its messages are fetched once more */
+{
+    flag ok = TRUE;
+
+    if (mbox_fd != -1)
+    {
+	if (mbox_flush() || fsync(mbox_fd))
+	{
+	    report(stderr, GT_("Error writing to mailbox: %s\n"), strerror(errno));
+	    mbox_cut(mbox_batchstart);
+	    ok = FALSE;
+	}
+	mbox_unlock();
     }
 
-    /* get From address for %F */
-    if (strstr(before, "%F"))
+    if (!ok)
     {
-	from = xstrdup(msg->return_path);
+	long seq;
 
-	sanitize(from);
+	for (seq = batch_synced + 1; seq <= batch_seq; seq++)
+	    BATCH_RESULT(seq) = FALSE;
+    }
+    batch_synced = batch_seq;
+    return(ok);
+}
 
-	fromlen = strlen(from);
-    }
-
-    /* do we have to build an mda string? */
-    if (names || from) 
-    {		
-	char	*sp, *dp;
-
-	/* find length of resulting mda string */
-	sp = before;
-	while ((sp = strstr(sp, "%s"))) {
-	    length += nameslen;	/* subtract %s and add '' */
-	    sp += 2;
-	}
-	sp = before;
-	while ((sp = strstr(sp, "%T"))) {
-	    length += nameslen;	/* subtract %T and add '' */
-	    sp += 2;
-	}
-	sp = before;
-	while ((sp = strstr(sp, "%F"))) {
-	    length += fromlen;	/* subtract %F and add '' */
-	    sp += 2;
-	}
-
-	after = (char *)xmalloc(length + 1);
-
-	/* copy mda source string to after, while expanding %[sTF] */
-	for (dp = after, sp = before; (*dp = *sp); dp++, sp++) {
-	    if (sp[0] != '%')	continue;
-
-	    /* need to expand? BTW, no here overflow, because in
-	    ** the worst case (end of string) sp[1] == '\0' */
-	    if (sp[1] == 's' || sp[1] == 'T') {
-		*dp++ = '\'';
-		strcpy(dp, names);
-		dp += nameslen;
-		*dp++ = '\'';
-		sp++;	/* position sp over [sT] */
-		dp--;	/* adjust dp */
-	    } else if (sp[1] == 'F') {
-		*dp++ = '\'';
-		strcpy(dp, from);
-		dp += fromlen;
-		*dp++ = '\'';
-		sp++;	/* position sp over F */
-		dp--;	/* adjust dp */
-	    }
-	}
+static void mbox_release(void)
+/* cut off the message being written, keeping the rest of the batch */
+{
+    if (mbox_fd == -1)
+	return;
+    mbox_cut(mbox_msgstart);
+    if (batch_synced == batch_seq)	/* nothing else in this batch */
+	mbox_unlock();
+}
+
+static int open_mbox_sink(struct query *ctl, struct msgblk *msg,
+	      int *good_addresses, int *bad_addresses)
+/* lock the mailbox unless the batch holds it, and write the From_ line */
+{
+    struct	idlist *idp;
+    time_t	now;
+    char	*cp, *date;
+
+    (void)bad_addresses;
+    xfree(ctl->destaddr);
+    ctl->destaddr = xstrdup("localhost");
+
+    for (idp = msg->recipients; idp; idp = idp->next)
+	if (idp->val.status.mark == XMIT_ACCEPT)
+	    (*good_addresses)++;
+
+    if (mbox_fd == -1)
+    {
+#ifdef HAVE_SETEUID
+	uid_t orig_uid = getuid();
+	int err;
 
-	if (names) {
-	    free(names);
-	    names = NULL;
+	/* the mailbox is created with the same identity an MDA would run as */
+	if (seteuid(ctl->uid)) {
+	    report(stderr, GT_("Cannot switch effective user id to %ld: %s\n"), (long)ctl->uid, strerror(errno));
+	    return PS_IOERR;
 	}
-	if (from) {
-	    free(from);
-	    from = NULL;
+	err = mbox_lock(ctl->mbox);
+	/* this will fail quietly if we didn't start as root */
+	if (seteuid(orig_uid)) {
+	    report(stderr, GT_("Cannot switch effective user id back to original %ld: %s\n"), (long)orig_uid, strerror(errno));
+	    if (!err)
+		mbox_unlock();
+	    return PS_IOERR;
 	}
+	if (err)
+	    return PS_IOERR;
+#else
+	if (mbox_lock(ctl->mbox))
+	    return PS_IOERR;
+#endif /* HAVE_SETEUID */
+    }
 
-	free(before);
+    mbox_msgstart = lseek(mbox_fd, 0, SEEK_END);
+    mbox_failed = FALSE;
 
-	before = after;
+    /* the envelope sender must be a single word on the From_ line */
+    mbox_put("From ", 5);
+    if (msg->return_path[0] && strcmp(msg->return_path, "<>"))
+    {
+	for (cp = msg->return_path; *cp; cp++)
+	    mbox_put(isspace((unsigned char)*cp) ? "_" : cp, 1);
     }
+    else
+	mbox_put("MAILER-DAEMON", 13);
+    now = time((time_t *)NULL);
+    date = ctime(&now);
+    mbox_put(" ", 1);
+    mbox_put(date, strlen(date));
+    memset(&mbox_from, 0, sizeof(mbox_from));
+    return(mbox_failed ? PS_IOERR : PS_SUCCESS);
+}
 
+static int mbox_write(const char *buf, size_t len)
+/* append text to the mailbox, quoting From_ lines (mboxrd style) */
+{
+    scan_mboxrd(&mbox_from, buf, len, mbox_put);
+    return(mbox_failed ? -1 : (int)len);
+}
 
-    if (outlevel >= O_DEBUG)
-	report(stdout, GT_("about to deliver with: %s\n"), before);
+static int close_mbox_sink(flag defer)
+/* terminate the current message; unless deferred, sync the batch now */
+{
+    flag ok = TRUE;
 
-#ifdef HAVE_SETEUID
-    /*
-     * Arrange to run with user's permissions if we're root.
-     * This will initialize the ownership of any files the
-     * MDA creates properly.  (The seteuid call is available
-     * under all BSDs and Linux)
-     */
-    orig_uid = getuid();
-    if (seteuid(ctl->uid)) {
-	report(stderr, GT_("Cannot switch effective user id to %ld: %s\n"), (long)ctl->uid, strerror(errno));
-	return PS_IOERR;
+    /* a message ends in a newline and is followed by an empty line */
+    scan_mboxrd(&mbox_from, NULL, 0, mbox_put);
+    if (mbox_from.midline)
+	mbox_put("\n", 1);
+    mbox_put("\n", 1);
+
+    /* only the disk sync waits for the end of the batch */
+    mbox_flush();
+    if (mbox_failed)
+    {
+	report(stderr, GT_("Error writing to mailbox: %s\n"), strerror(errno));
+	mbox_cut(mbox_msgstart);
+	mbox_failed = FALSE;
+	ok = FALSE;
     }
-#endif /* HAVE_SETEUID */
+    BATCH_RESULT(++batch_seq) = ok;
+    if (!defer)
+	ok = mbox_sync() && ok;
+    return(ok);
+}
 
-    sinkfp = popen(before, "w");
-    free(before);
-    before = NULL;
+static int bsmtp_open(struct query *ctl)
+/* open the BSMTP stream unless it's still open from the last message */
+{
+    char *argv[3];
 
-#ifdef HAVE_SETEUID
-    /* this will fail quietly if we didn't start as root */
-    if (seteuid(orig_uid)) {
-	report(stderr, GT_("Cannot switch effective user id back to original %ld: %s\n"), (long)orig_uid, strerror(errno));
-	return PS_IOERR;
+    if (sinkfp)
+	return(0);
+    if (strcmp(ctl->bsmtp, "-") == 0)
+    {
+	sinkfp = stdout;
+	return(0);
     }
-#endif /* HAVE_SETEUID */
-
-    if (!sinkfp)
+    if (!ctl->bsmtpcompress)
     {
-	report(stderr, GT_("MDA open failed\n"));
-	return(PS_IOERR);
+	if ((sinkfp = fopen(ctl->bsmtp, "a")) == NULL)
+	    return(-1);
+	setvbuf(sinkfp, (char *)NULL, _IOFBF, BSMTP_BUFSIZE);
+	return(0);
     }
 
-    /*
-     * We need to disable the normal SIGCHLD handling here because 
-     * sigchld_handler() would reap away the error status, returning
-     * error status instead of 0 for successful completion.
-     */
+    if ((bsmtp_fd = open(ctl->bsmtp, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1)
+	return(-1);
+    fcntl(bsmtp_fd, F_SETFD, FD_CLOEXEC);
+    argv[0] = ctl->bsmtpcompress;
+    argv[1] = "-c";
+    argv[2] = NULL;
+    /* we reap the compressor ourselves */
     set_signal_handler(SIGCHLD, SIG_DFL);
+    if ((sinkfp = mda_open(argv[0], argv, &bsmtp_zpid, bsmtp_fd)) == NULL)
+    {
+	report(stderr, GT_("cannot start BSMTP compressor %s: %s\n"),
+	       ctl->bsmtpcompress, strerror(errno));
+	close(bsmtp_fd);
+	bsmtp_fd = -1;
+	bsmtp_zpid = 0;
+	if (mda_jobs == 0)
+	    deal_with_sigchld();
+	return(-1);
+    }
+    setvbuf(sinkfp, (char *)NULL, _IOFBF, BSMTP_BUFSIZE);
+    return(0);
+}
 
-    return(PS_SUCCESS);
+static flag bsmtp_end(flag durable, flag keep)
+/* push out what has been written so far; durable means fsync() it,
+ * keep means the file may stay open for more messages */
+{
+    flag ok = TRUE;
+
+    if (sinkfp == stdout)
+	ok = !fflush(stdout);
+    else if (sinkfp && bsmtp_zpid)
+    {
+	/*
+	 * Compressed output is complete only at the end of a stream,
+	 * whatever keep says: until the compressor has written it all
+	 * and exited happily, the messages are not safe.
+	 */
+	int rc;
+
+	if (fclose(sinkfp))
+	    ok = FALSE;
+	sinkfp = (FILE *)NULL;
+	rc = mda_wait(bsmtp_zpid, TRUE);
+	bsmtp_zpid = 0;
+	if (mda_jobs == 0)
+	    deal_with_sigchld();
+	if (rc != 0)
+	{
+	    report(stderr, GT_("BSMTP compressor failed\n"));
+	    ok = FALSE;
+	}
+	if (ok && durable && fsync(bsmtp_fd))
+	    ok = FALSE;
+	if (close(bsmtp_fd))
+	    ok = FALSE;
+	bsmtp_fd = -1;
+    }
+    else if (sinkfp)
+    {
+	if (fflush(sinkfp))
+	    ok = FALSE;
+	if (ok && durable && fsync(fileno(sinkfp)))
+	    ok = FALSE;
+	if (!keep)
+	{
+	    if (fclose(sinkfp))
+		ok = FALSE;
+	    sinkfp = (FILE *)NULL;
+	}
+    }
+
+    if (!ok)
+    {
+	long seq;
+
+	report(stderr, 
+	       GT_("Message termination or close of BSMTP file failed: %s\n"), strerror(errno));
+	for (seq = batch_synced + 1; seq <= batch_seq; seq++)
+	    BATCH_RESULT(seq) = FALSE;
+    }
+    bsmtp_bytes = 0;
+    batch_synced = batch_seq;
+    return(ok);
+}
+
+static int close_bsmtp_sink(struct query *ctl, flag defer)
+/* terminate the current message; unless deferred, push it out now */
+{
+    flag durable = (NUM_VALUE_OUT(ctl->bsmtpsync) > 0);
+
+    /* implicit disk-full check here... */
+    fputs(".\r\n", sinkfp);
+    bsmtp_bytes += 3;
+    BATCH_RESULT(++batch_seq) = !ferror(sinkfp);
+    if (ferror(sinkfp))
+    {
+	bsmtp_end(durable, FALSE);
+	return(FALSE);
+    }
+
+    /* a group commit also happens once enough data piled up */
+    if (defer && bsmtp_bytes < BSMTP_SYNCBYTES)
+	return(TRUE);
+    return(bsmtp_end(durable, TRUE));
+}
+
+void finish_sink(struct query *ctl)
+/* end of poll: close what the sinks kept open between messages */
+{
+    if (ctl->bsmtp && !MAILDIR_SINK(ctl) && !ctl->mbox)
+	bsmtp_end(NUM_VALUE_OUT(ctl->bsmtpsync) > 0, FALSE);
 }
 
 int open_sink(struct query *ctl, struct msgblk *msg,
@@ -1268,10 +3203,19 @@ int open_sink(struct query *ctl, struct msgblk *msg,
 /* set up sinkfp to be an input sink we can ship a message to */
 {
     *bad_addresses = *good_addresses = 0;
-
-    if (want_progress() && outlevel >= O_VERBOSE && !ctl->mda && !ctl->bsmtp) puts("");
-
-    if (ctl->bsmtp)		/* dump to a BSMTP batch file */
+    lmtp_responses = 0;
+    stuff_bol = TRUE;
+    stuff_cr = FALSE;
+
+    if (want_progress() && outlevel >= O_VERBOSE && !ctl->mda && !ctl->bsmtp && !MAILDIR_SINK(ctl) && !ctl->mbox) puts("");
+
+    if (ctl->spool)		/* stage for the listener */
+	return(open_spool_sink(ctl, msg, good_addresses, bad_addresses));
+    else if (ctl->maildir)	/* write straight into a Maildir */
+	return(open_maildir_sink(ctl, msg, good_addresses, bad_addresses));
+    else if (ctl->mbox)		/* append to an mbox file */
+	return(open_mbox_sink(ctl, msg, good_addresses, bad_addresses));
+    else if (ctl->bsmtp)	/* dump to a BSMTP batch file */
 	return(open_bsmtp_sink(ctl, msg, good_addresses, bad_addresses));
     /* 
      * Try to forward to an SMTP or LMTP listener.  If the attempt to 
@@ -1329,50 +3273,207 @@ void release_sink(struct query *ctl)
     if (ctl->bsmtp && sinkfp)
     {
 	if (strcmp(ctl->bsmtp, "-"))
-	{
-	    fclose(sinkfp);
-	    sinkfp = (FILE *)NULL;
-	}
+	    bsmtp_end(NUM_VALUE_OUT(ctl->bsmtpsync) > 0, FALSE);
+    }
+    else if (bdat_mode)
+    {
+	bdat_mode = FALSE;
+	bdat_len = 0;
     }
+    else if (MAILDIR_SINK(ctl))
+	maildir_release();
+    else if (ctl->mbox)
+	mbox_release();
     else if (ctl->mda)
     {
 	if (sinkfp)
 	{
-	    pclose(sinkfp);
+	    fclose(sinkfp);
 	    sinkfp = (FILE *)NULL;
+	    mda_wait(mda_pid, TRUE);
 	}
-	deal_with_sigchld(); /* Restore SIGCHLD handling to reap zombies */
+	if (mda_jobs == 0)
+	    deal_with_sigchld(); /* Restore SIGCHLD handling to reap zombies */
     }
+    else if (ctl->smtp_socket != -1)
+	lsn_push(ctl, TRUE);
 }
 
-int close_sink(struct query *ctl, struct msgblk *msg, flag forward)
-/* perform end-of-message actions on the current output sink */
+static int eom_reply(struct query *ctl, struct msgblk *msg, int smtp_err)
+/* digest the listener's verdict on a message we shipped completely */
 {
-    int smtp_err;
+    if (smtp_err == SM_UNRECOVERABLE)
+    {
+	smtp_close(ctl, 0);
+	return(FALSE);
+    }
+    if (smtp_err != SM_OK)
+    {
+	if (handle_smtp_report(ctl, msg) != PS_REFUSED)
+	{
+	    smtp_rset(ctl);    /* stay on the safe side */
+	    return(FALSE);
+	}
+	else
+	{
+	    report(stderr, GT_("SMTP listener refused delivery\n"));
+	    smtp_rset(ctl);    /* stay on the safe side */
+	    return(TRUE);
+	}
+    }
 
-    if (want_progress() && outlevel >= O_VERBOSE && !ctl->mda && !ctl->bsmtp) puts("");
+    /*
+     * If this is an SMTP connection, SMTP_eom() ate the response.
+     * But could be this is an LMTP connection, in which case we have to
+     * interpret either (a) a single 503 response meaning there
+     * were no successful RCPT TOs, or (b) a variable number of
+     * responses, one for each successful RCPT TO.  Each of these is
+     * kept in lmtp_rcpt: a permanent failure is bounced, and
+     * counts as done once the bounce is out, so the message isn't
+     * resent to people who got it the first time.  A temporary failure
+     * keeps the whole message on the server; the caller may note the
+     * recipients it did reach (see lmtp_deferred()), otherwise they get it
+     * again with the retry, as we rather deliver twice than risk losing
+     * mail.
+     */
+    if (ctl->smtphostmode == LMTP_MODE)
+    {
+	if (lmtp_responses == 0)
+	{
+	    SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_EOM);
 
-    if (ctl->bsmtp && sinkfp) {
-	int error, oerrno;
+	    /*
+	     * According to RFC2033, 503 is the only legal response
+	     * if no RCPT TO commands succeeded.  No error recovery
+	     * is really possible here, as we have no idea what
+	     * insane thing the listener might be doing if it doesn't
+	     * comply.
+	     */
+	    if (atoi(smtp_response) == 503)
+		report(stderr, GT_("LMTP delivery error on EOM\n"));
+	    else
+		report(stderr,
+		      GT_("Unexpected non-503 response to LMTP EOM: %s\n"),
+		      smtp_response);
 
-	/* implicit disk-full check here... */
-	fputs(".\r\n", sinkfp);
-	error = ferror(sinkfp);
-	oerrno = errno;
-	if (strcmp(ctl->bsmtp, "-"))
+	    /*
+	     * It's not completely clear what to do here.  We choose to
+	     * interpret delivery failure here as a transient error, 
+	     * the same way SMTP delivery failure is handled.  If we're
+	     * wrong, an undead message will get stuck in the queue.
+	     */
+	    return(FALSE);
+	}
+	else
 	{
-	    if (fclose(sinkfp) == EOF) {
-		error = 1;
-		oerrno = errno;
+	    int	i, failed, deferred, rc = FALSE;
+	    char	**responses;
+
+	    /*
+	     * Eat the RFC2033-required responses, saving errors.  They
+	     * come in lmtp_rcpt order, and all of them must be drained
+	     * before we decide, or the next command gets out of step.
+	     */
+	    responses = (char **)xmalloc(sizeof(char *) * lmtp_responses);
+	    for (failed = deferred = i = 0; i < lmtp_responses; i++)
+	    {
+		struct lmtp_rcpt *rp = &lmtp_rcpt[i];
+
+		if ((smtp_err = SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_EOM))
+			== SM_UNRECOVERABLE)
+		{
+		    smtp_close(ctl, 0);
+		    goto unrecov;
+		}
+		if (smtp_err == SM_OK)
+		{
+		    rp->status = LMTP_OK;
+		    continue;
+		}
+
+		if (outlevel >= O_VERBOSE)
+		    report(stderr,
+			   GT_("LMTP listener did not deliver to `%s': %s\n"),
+			   rp->id ? rp->id : run.postmaster, smtp_response);
+		if (smtp_response[0] == '4')
+		{
+		    rp->status = LMTP_DEFERRED;
+		    deferred++;
+		}
+		else if (rp->id)
+		{
+		    rp->status = LMTP_FAILED;
+		    responses[failed++] = xstrdup(smtp_response);
+		}
+		else
+		{
+		    rp->status = LMTP_FAILED;
+		    report(stderr, GT_("can't even send to %s!\n"), run.postmaster);
+		}
 	    }
-	    sinkfp = (FILE *)NULL;
+
+	    /*
+	     * If we can bounce a failures list back to the sender,
+	     * those recipients are done with.  If not, they have to
+	     * wait for another attempt like the deferred ones.  The
+	     * bounce goes out for a copy of msg listing just them.
+	     */
+	    rc = TRUE;
+	    if (failed)
+	    {
+		struct msgblk bounce = *msg;
+
+		bounce.recipients = NULL;
+		for (i = 0; i < lmtp_responses; i++)
+		    if (lmtp_rcpt[i].id && lmtp_rcpt[i].status == LMTP_FAILED)
+			save_str(&bounce.recipients, lmtp_rcpt[i].id, XMIT_ACCEPT);
+		if (!send_bouncemail(ctl, &bounce, XMIT_ACCEPT,
+			"LMTP partial delivery failure.\r\n",
+			failed, responses))
+		{
+		    for (i = 0; i < lmtp_responses; i++)
+			if (lmtp_rcpt[i].id && lmtp_rcpt[i].status == LMTP_FAILED)
+			    lmtp_rcpt[i].status = LMTP_DEFERRED;
+		    deferred += failed;
+		}
+		free_str_list(&bounce.recipients);
+	    }
+	    if (deferred)
+	    {
+		/* keep the message on the server and try again later */
+		report(stderr,
+		       GT_("LMTP delivery deferred for %d of %d recipients\n"),
+		       deferred, lmtp_responses);
+		rc = FALSE;
+	    }
+
+unrecov:
+	    for (i = 0; i < failed; i++)
+		free(responses[i]);
+	    free(responses);
+	    return rc;
 	}
-	if (error)
-	{
-	    report(stderr, 
-		   GT_("Message termination or close of BSMTP file failed: %s\n"), strerror(oerrno));
+    }
+
+    return(TRUE);
+}
+
+int close_sink(struct query *ctl, struct msgblk *msg, flag forward)
+/* perform end-of-message actions on the current output sink */
+{
+    int smtp_err;
+
+    if (want_progress() && outlevel >= O_VERBOSE && !ctl->mda && !ctl->bsmtp && !MAILDIR_SINK(ctl) && !ctl->mbox) puts("");
+
+    if (MAILDIR_SINK(ctl)) {
+	if (!close_maildir_sink(FALSE))
+	    return(FALSE);
+    } else if (ctl->mbox) {
+	if (mbox_fd == -1 || !close_mbox_sink(FALSE))
+	    return(FALSE);
+    } else if (ctl->bsmtp && sinkfp) {
+	if (!close_bsmtp_sink(ctl, FALSE))
 	    return(FALSE);
-	}
     } else if (ctl->mda) {
 	int rc = 0, e = 0, e2 = 0, err = 0;
 
@@ -1384,142 +3485,127 @@ int close_sink(struct query *ctl, struct msgblk *msg, flag forward)
 	    if ((fflush(sinkfp)))
 		err = 1, e2 = errno;
 
+	    fclose(sinkfp);
+	    sinkfp = (FILE *)NULL;
 	    errno = 0;
-	    rc = pclose(sinkfp);
+	    rc = mda_wait(mda_pid, TRUE);
 	    e = errno;
-	    sinkfp = (FILE *)NULL;
 	}
 
-	deal_with_sigchld(); /* Restore SIGCHLD handling to reap zombies */
-
-	if (rc || err)
-	{
-	    if (err) {
-		report(stderr, GT_("Error writing to MDA: %s\n"), strerror(e2));
-	    } else if (WIFSIGNALED(rc)) {
-		report(stderr, 
-			GT_("MDA died of signal %d\n"), WTERMSIG(rc));
-	    } else if (WIFEXITED(rc)) {
-		report(stderr, 
-			GT_("MDA returned nonzero status %d\n"), WEXITSTATUS(rc));
-	    } else {
-		report(stderr,
-			GT_("Strange: MDA pclose returned %d and errno %d/%s, cannot handle at %s:%d\n"),
-			rc, e, strerror(e), __FILE__, __LINE__);
-	    }
+	if (mda_jobs == 0)
+	    deal_with_sigchld(); /* Restore SIGCHLD handling to reap zombies */
 
+	if (!mda_status(rc, err, e, e2))
 	    return(FALSE);
-	}
     }
     else if (forward)
     {
-	/* write message terminator */
-	if ((smtp_err = SMTP_eom(ctl->smtp_socket, ctl->smtphostmode))
-		== SM_UNRECOVERABLE)
-	{
-	    smtp_close(ctl, 0);
-	    return(FALSE);
-	}
-	if (smtp_err != SM_OK)
+	/* write message terminator, or the last BDAT chunk */
+	if (bdat_mode)
 	{
-	    if (handle_smtp_report(ctl, msg) != PS_REFUSED)
-	    {
-	        smtp_rset(ctl);    /* stay on the safe side */
-		return(FALSE);
-	    }
-	    else
-	    {
-		report(stderr, GT_("SMTP listener refused delivery\n"));
-	        smtp_rset(ctl);    /* stay on the safe side */
-		return(TRUE);
-	    }
+	    smtp_err = bdat_ship(ctl, TRUE);
+	    bdat_mode = FALSE;
 	}
+	else if (lsn_push(ctl, TRUE) < 0)
+	    smtp_err = SM_UNRECOVERABLE;
+	else
+	    smtp_err = SMTP_eom(ctl->smtp_socket, ctl->smtphostmode);
+	return(eom_reply(ctl, msg, smtp_err));
+    }
 
-	/*
-	 * If this is an SMTP connection, SMTP_eom() ate the response.
-	 * But could be this is an LMTP connection, in which case we have to
-	 * interpret either (a) a single 503 response meaning there
-	 * were no successful RCPT TOs, or (b) a variable number of
-	 * responses, one for each successful RCPT TO.  We need to send
-	 * bouncemail on each failed response and then return TRUE anyway,
-	 * otherwise the message will get left in the queue and resent
-	 * to people who got it the first time.
-	 */
-	if (ctl->smtphostmode == LMTP_MODE)
-	{
-	    if (lmtp_responses == 0)
-	    {
-		SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_EOM);
-
-		/*
-		 * According to RFC2033, 503 is the only legal response
-		 * if no RCPT TO commands succeeded.  No error recovery
-		 * is really possible here, as we have no idea what
-		 * insane thing the listener might be doing if it doesn't
-		 * comply.
-		 */
-		if (atoi(smtp_response) == 503)
-		    report(stderr, GT_("LMTP delivery error on EOM\n"));
-		else
-		    report(stderr,
-			  GT_("Unexpected non-503 response to LMTP EOM: %s\n"),
-			  smtp_response);
-
-		/*
-		 * It's not completely clear what to do here.  We choose to
-		 * interpret delivery failure here as a transient error, 
-		 * the same way SMTP delivery failure is handled.  If we're
-		 * wrong, an undead message will get stuck in the queue.
-		 */
-		return(FALSE);
-	    }
-	    else
-	    {
-		int	i, errors, rc = FALSE;
-		char	**responses;
+    return(TRUE);
+}
 
-		/* eat the RFC2033-required responses, saving errors */ 
-		responses = (char **)xmalloc(sizeof(char *) * lmtp_responses);
-		for (errors = i = 0; i < lmtp_responses; i++)
-		{
-		    if ((smtp_err = SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_EOM))
-			    == SM_UNRECOVERABLE)
-		    {
-			smtp_close(ctl, 0);
-			goto unrecov;
-		    }
-		    if (smtp_err != SM_OK)
-		    {
-			responses[errors] = xstrdup(smtp_response);
-			errors++;
-		    }
-		}
+pid_t close_sink_nowait(struct query *ctl)
+/* finish shipping the message without waiting for the delivery verdict;
+ * returns the MDA's process ID, 0 if the listener owes us its reply,
+ * or -1 if this sink can't do that and close_sink() must be used */
+{
+    if (MAILDIR_SINK(ctl) || ctl->mbox || ctl->bsmtp)
+    {
+	/* the verdict waits in batch_result until the batch is synced */
+	if (MAILDIR_SINK(ctl) && md_nfiles > 0)
+	    close_maildir_sink(TRUE);
+	else if (!MAILDIR_SINK(ctl) && ctl->mbox && mbox_fd != -1)
+	    close_mbox_sink(TRUE);
+	else if (!MAILDIR_SINK(ctl) && !ctl->mbox && sinkfp)
+	    close_bsmtp_sink(ctl, TRUE);
+	else
+	    return(-1);
+	return((pid_t)batch_seq);
+    }
 
-		if (errors == 0)
-		    rc = TRUE;	/* all deliveries succeeded */
-		else
-		    /*
-		     * One or more deliveries failed.
-		     * If we can bounce a failures list back to the
-		     * sender, and the postmaster does not want to
-		     * deal with the bounces return TRUE, deleting the
-		     * message from the server so it won't be
-		     * re-forwarded on subsequent poll cycles.
-		     */
-		    rc = send_bouncemail(ctl, msg, XMIT_ACCEPT,
-			    "LMTP partial delivery failure.\r\n",
-			    errors, responses);
+    if (ctl->mda)
+    {
+	/* let close_sink() report write errors */
+	if (!sinkfp || ferror(sinkfp) || fflush(sinkfp))
+	    return(-1);
+	fclose(sinkfp);
+	sinkfp = (FILE *)NULL;
+	mda_jobs++;
+	return(mda_pid);
+    }
 
-unrecov:
-		for (i = 0; i < errors; i++)
-		    free(responses[i]);
-		free(responses);
-		return rc;
-	    }
+    if (ctl->bsmtp || bdat_mode || ctl->smtp_socket == -1)
+	return(-1);
+
+    /*
+     * Stage the terminator behind the text, and leave what the listener
+     * can't take right now for close_sink_finish(), so that the rest of
+     * this message goes out while the server sends us the next one.
+     */
+    if (want_progress() && outlevel >= O_VERBOSE) puts("");
+    if (outlevel >= O_MONITOR)
+	report(stdout, "%cMTP>. (EOM)\n", ctl->smtphostmode);
+    if (lsn_write(ctl, ".\r\n", 3) >= 0)
+	lsn_push(ctl, FALSE);
+    return(0);
+}
+
+int close_sink_finish(struct query *ctl, struct msgblk *msg, pid_t job,
+		      flag block)
+/* collect the verdict close_sink_nowait() left behind; returns TRUE or
+ * FALSE like close_sink(), or -1 if the MDA is still running and we
+ * must not block */
+{
+    int smtp_err = SM_OK;
+
+    if (MAILDIR_SINK(ctl) || ctl->mbox || ctl->bsmtp)
+    {
+	if (job > batch_synced)
+	{
+	    if (!block)
+		return(-1);
+	    if (MAILDIR_SINK(ctl))
+		maildir_sync();
+	    else if (ctl->mbox)
+		mbox_sync();
+	    else
+		bsmtp_end(NUM_VALUE_OUT(ctl->bsmtpsync) > 0, TRUE);
 	}
+	return(BATCH_RESULT(job));
     }
 
-    return(TRUE);
+    if (job > 0)
+    {
+	int rc, e;
+
+	errno = 0;
+	if ((rc = mda_wait(job, block)) == -2)
+	    return(-1);
+	e = errno;
+	if (--mda_jobs == 0 && !sinkfp)
+	    deal_with_sigchld();
+	return(mda_status(rc, 0, e, 0));
+    }
+
+    if (ctl->smtp_socket == -1)
+	return(FALSE);
+    if (lsn_push(ctl, TRUE) < 0)
+	smtp_err = SM_UNRECOVERABLE;
+    else if (ctl->smtphostmode == SMTP_MODE)
+	smtp_err = SMTP_ok(ctl->smtp_socket, ctl->smtphostmode, TIMEOUT_EOM);
+    return(eom_reply(ctl, msg, smtp_err));
 }
 
 int open_warning_by_mail(struct query *ctl)
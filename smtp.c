@@ -32,6 +32,9 @@ static struct opt extensions[] =
     {"SIZE",    	ESMTP_SIZE},
     {"ETRN",		ESMTP_ETRN},
     {"AUTH ",		ESMTP_AUTH},
+    {"PIPELINING",	ESMTP_PIPELINING},
+    {"CHUNKING",	ESMTP_CHUNKING},
+    {"BINARYMIME",	ESMTP_BINARYMIME},
 #ifdef ODMR_ENABLE
     {"ATRN",		ESMTP_ATRN},
 #endif /* ODMR_ENABLE */
@@ -40,6 +43,10 @@ static struct opt extensions[] =
 
 char smtp_response[MSGBUFSIZE];
 
+/* commands queued for a single PIPELINING (RFC 2920) write */
+static char *queue;
+static size_t queuelen, queuesize;
+
 /* XXX: this must not be used for LMTP! */
 int SMTP_helo(int sock, char smtp_mode, const char *host)
 /* send a "HELO" message to the SMTP listener */
@@ -221,18 +228,24 @@ int SMTP_ehlo(int sock, char smtp_mode, const char *host, char *name, char *pass
   return SM_UNRECOVERABLE;
 }
 
+static void SMTP_from_cmd(char *buf, size_t len, const char *from, const char *opts)
+/* compose a "MAIL FROM:" command */
+{
+    if (from[0]=='<')
+	snprintf(buf, len, "MAIL FROM:%s", from);
+    else
+	snprintf(buf, len, "MAIL FROM:<%s>", from);
+    if (opts)
+	snprintf(buf+strlen(buf), len-strlen(buf), "%s", opts);
+}
+
 int SMTP_from(int sock, char smtp_mode, const char *from, const char *opts)
 /* send a "MAIL FROM:" message to the SMTP listener */
 {
     int ok;
     char buf[MSGBUFSIZE];
 
-    if (from[0]=='<')
-	snprintf(buf, sizeof(buf), "MAIL FROM:%s", from);
-    else
-	snprintf(buf, sizeof(buf), "MAIL FROM:<%s>", from);
-    if (opts)
-	snprintf(buf+strlen(buf), sizeof(buf)-strlen(buf), "%s", opts);
+    SMTP_from_cmd(buf, sizeof(buf), from, opts);
     SockPrintf(sock,"%s\r\n", buf);
     if (outlevel >= O_MONITOR)
 	report(stdout, "%cMTP> %s\n", smtp_mode, buf);
@@ -252,6 +265,53 @@ int SMTP_rcpt(int sock, char smtp_mode, const char *to)
   return ok;
 }
 
+static void SMTP_queue(char smtp_mode, const char *cmd)
+/* queue a command for the next SMTP_flush() */
+{
+    size_t len = strlen(cmd);
+
+    if (outlevel >= O_MONITOR)
+	report(stdout, "%cMTP> %s\n", smtp_mode, cmd);
+
+    if (queuelen + len + 2 > queuesize)
+    {
+	queuesize = 2 * (queuelen + len + 2);
+	queue = (char *)xrealloc(queue, queuesize);
+    }
+    memcpy(queue + queuelen, cmd, len);
+    memcpy(queue + queuelen + len, "\r\n", 2);
+    queuelen += len + 2;
+}
+
+void SMTP_queue_from(char smtp_mode, const char *from, const char *opts)
+/* queue a "MAIL FROM:" message; the reply is read by SMTP_ok() after SMTP_flush() */
+{
+    char buf[MSGBUFSIZE];
+
+    SMTP_from_cmd(buf, sizeof(buf), from, opts);
+    SMTP_queue(smtp_mode, buf);
+}
+
+void SMTP_queue_rcpt(char smtp_mode, const char *to)
+/* queue a "RCPT TO:" message; the reply is read by SMTP_ok() after SMTP_flush() */
+{
+    char buf[MSGBUFSIZE];
+
+    snprintf(buf, sizeof(buf), "RCPT TO:<%s>", to);
+    SMTP_queue(smtp_mode, buf);
+}
+
+int SMTP_flush(int sock)
+/* ship all queued commands to the SMTP listener in one write */
+{
+    int ok = 0;
+
+    if (queuelen)
+	ok = SockWrite(sock, queue, (int)queuelen);
+    queuelen = 0;
+    return (ok < 0) ? SM_UNRECOVERABLE : SM_OK;
+}
+
 int SMTP_data(int sock, char smtp_mode)
 /* send a "DATA" message to the SMTP listener */
 {
@@ -288,12 +348,18 @@ int SMTP_quit(int sock, char smtp_mode)
   return ok;
 }
 
-int SMTP_eom(int sock, char smtp_mode)
-/* send a message data terminator to the SMTP listener */
+void SMTP_eom_send(int sock, char smtp_mode)
+/* send a message data terminator, leaving the reply to the caller */
 {
   SockPrintf(sock,".\r\n");
   if (outlevel >= O_MONITOR)
       report(stdout, "%cMTP>. (EOM)\n", smtp_mode);
+}
+
+int SMTP_eom(int sock, char smtp_mode)
+/* send a message data terminator to the SMTP listener */
+{
+  SMTP_eom_send(sock, smtp_mode);
 
   /* 
    * When doing LMTP, must process many of these at the outer level. 
@@ -304,6 +370,29 @@ int SMTP_eom(int sock, char smtp_mode)
       return SM_OK;
 }
 
+int SMTP_bdat(int sock, char smtp_mode, const char *buf, size_t len, int last)
+/* ship a chunk of message text with "BDAT" (RFC 3030) to the SMTP listener */
+{
+  if (SockPrintf(sock, "BDAT %lu%s\r\n", (unsigned long)len, last ? " LAST" : "") < 0)
+      return SM_UNRECOVERABLE;
+  if (outlevel >= O_MONITOR)
+      report(stdout, "%cMTP> BDAT %lu%s\n", smtp_mode, (unsigned long)len,
+	     last ? " LAST" : "");
+  if (len > 0 && SockWrite(sock, buf, (int)len) < 0)
+      return SM_UNRECOVERABLE;
+
+  /* 
+   * As with SMTP_eom(), the LMTP replies to the last chunk are
+   * processed at the outer level.
+   */
+  if (!last)
+      return SMTP_ok(sock, smtp_mode, TIMEOUT_DATALINE);
+  else if (smtp_mode == SMTP_MODE)
+      return SMTP_ok(sock, smtp_mode, TIMEOUT_EOM);
+  else
+      return SM_OK;
+}
+
 time_t last_smtp_ok = 0;
 
 int SMTP_ok(int sock, char smtp_mode, int mintimeout)
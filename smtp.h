@@ -22,6 +22,9 @@
 #define ESMTP_ETRN	0x04
 #define ESMTP_ATRN	0x08		/* used with ODMR, RFC 2645 */
 #define ESMTP_AUTH	0x10
+#define ESMTP_PIPELINING	0x20	/* RFC 2920 */
+#define ESMTP_CHUNKING	0x40		/* RFC 3030 */
+#define ESMTP_BINARYMIME	0x80	/* RFC 3030 */
 
 /* SMTP timeouts (seconds) - SHOULD clauses from RFC-5321 sec. 4.5.3.2. */
 #define TIMEOUT_STARTSMTP	300
@@ -39,8 +42,13 @@ int SMTP_helo(int socket, char smtp_mode, const char *host);
 int SMTP_ehlo(int socket, char smtp_mode, const char *host, char *name, char *passwd, int *opt);
 int SMTP_from(int socket, char smtp_mode, const char *from,const char *opts);
 int SMTP_rcpt(int socket, char smtp_mode, const char *to);
+void SMTP_queue_from(char smtp_mode, const char *from, const char *opts);
+void SMTP_queue_rcpt(char smtp_mode, const char *to);
+int SMTP_flush(int socket);
 int SMTP_data(int socket, char smtp_mode);
 int SMTP_eom(int socket, char smtp_mode);
+void SMTP_eom_send(int socket, char smtp_mode);
+int SMTP_bdat(int socket, char smtp_mode, const char *buf, size_t len, int last);
 int SMTP_rset(int socket, char smtp_mode);
 int SMTP_quit(int socket, char smtp_mode);
 int SMTP_ok(int socket, char smtp_mode, int mintimeout);
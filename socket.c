@@ -524,6 +524,37 @@ int SockRead(int sock, char *buf, int len)
     return bp - buf;
 }
 
+int SockReadBlock(int sock, char *buf, int len)
+/* read whatever is there, up to len bytes, without regard to lines */
+{
+    int n;
+#ifdef	SSL_ENABLE
+    SSL *ssl;
+#endif
+
+    if (len < 1)
+	return(-1);
+#ifdef __BEOS__
+    if (peeked != 0){
+	*buf = peeked;
+	peeked = 0;
+	return(1);
+    }
+#endif
+#ifdef	SSL_ENABLE
+    if( NULL != ( ssl = SSLGetContext( sock ) ) ) {
+	/* as in SockRead(), a zero return may or may not be an error */
+	while ((n = SSL_read(ssl, buf, len)) <= 0)
+	    if (SSL_get_error(ssl, n))
+		return(-1);
+	return(n);
+    }
+#endif /* SSL_ENABLE */
+    if ((n = fm_read(sock, buf, len)) <= 0)
+	return(-1);
+    return(n);
+}
+
 int SockPeek(int sock)
 /* peek at the next socket character without actually reading it */
 {
@@ -29,6 +29,13 @@ returns length of buffer on success, -1 on failure.
 */
 int SockRead(int sock, char *buf, int len);
 
+/**
+Read up to len bytes that are available, at least one, regardless of
+line boundaries.  No NUL is appended.  Returns the number of bytes
+read, -1 on failure or end of file.
+*/
+int SockReadBlock(int sock, char *buf, int len);
+
 /**
  * Peek at the next socket character without actually reading it.
  */
@@ -25,17 +25,20 @@
 #endif
 #include <limits.h>
 #include <assert.h>
+#include <regex.h>
 
 #ifdef HAVE_NET_SOCKET_H
 #include <net/socket.h>
 #endif
 #include <sys/socket.h>
 #include <netdb.h>
-#include "fm_md5.h"
+#include "digest.h"
 
 #include "i18n.h"
 #include "socket.h"
 #include "fetchmail.h"
+#include "tunable.h"
+#include "scan.h"
 
 /** Macro to clamp the argument so it is >= INT_MIN. */
 #define _FIX_INT_MIN(x) ((x) < INT_MIN ? INT_MIN : (x))
@@ -65,6 +68,36 @@ int mytimeout;		/**< value of nonreponse timeout */
 struct msgblk msgblk;   /**< stores attributes of the currently processed message */
 static int accept_count /** count of accepted recipients */, reject_count /** count of rejected recipients */;
 
+/** \return the local name that \a name maps to by the localnames list
+ * of \a ctl, NULL if it maps to none */
+static const char *local_name(struct query *ctl, const char *name)
+{
+    struct idlist *idp = idhash_find(&ctl->localindex, &ctl->localnames, name);
+
+    if (!idp)
+	return NULL;
+    return idp->val.id2 ? idp->val.id2 : idp->id;
+}
+
+/** \return the localdomains entry of \a ctl that the domain \a domain,
+ * or a trailing segment of it beginning after a dot, matches; NULL if
+ * none does */
+static struct idlist *local_domain(struct query *ctl, const char *domain)
+{
+    struct idlist *idp;
+    const char *cp;
+
+    for (cp = domain; ; cp++)
+    {
+	if ((cp == domain || cp[-1] == '.')
+		&& (idp = idhash_find(&ctl->server.domainindex,
+				      &ctl->server.localdomains, cp)))
+	    return idp;
+	if (!*cp)
+	    return NULL;
+    }
+}
+
 /** add given address to xmit_names if it exactly matches a full address
  * \returns nonzero if matched */
 static int map_address(const char *addr,/**< address to match */
@@ -73,7 +106,7 @@ static int map_address(const char *addr,/**< address to match */
 {
     const char	*lname;
 
-    lname = idpair_find(&ctl->localnames, addr);
+    lname = local_name(ctl, addr);
     if (lname) {
 	if (outlevel >= O_DEBUG)
 	    report(stdout, GT_("mapped address %s to local %s\n"), addr, lname);
@@ -91,7 +124,7 @@ static void map_name(const char *name, struct query *ctl, struct idlist **xmit_n
 {
     const char	*lname;
 
-    lname = idpair_find(&ctl->localnames, name);
+    lname = local_name(ctl, name);
     if (!lname && ctl->wildcard)
 	lname = name;
 
@@ -105,10 +138,12 @@ static void map_name(const char *name, struct query *ctl, struct idlist **xmit_n
 }
 
 static void find_server_names(const char *hdr,
+			      size_t len,
 			      struct query *ctl,
 			      struct idlist **xmit_names)
 /** parse names out of a RFC822 header into an ID list */
 /** \param hdr		RFC822 header in question */
+/** \param len		its length */
 /** \param ctl		list of permissible aliases */
 /** \param xmit_names	list of recipient names parsed out */
 {
@@ -116,12 +151,22 @@ static void find_server_names(const char *hdr,
 	return;
     else
     {
-	char	*cp;
+	struct rfc822_iter	it;
+	struct rfc822_addr	addr;
+	char			address[BUFSIZ], *cp;
 
-	for (cp = nxtaddr(hdr); cp != NULL; cp = nxtaddr(NULL))
+	for (rfc822_begin(&it, hdr, len);
+	     rfc822_next(&it, &addr, address, sizeof(address)); )
 	{
 	    char	*atsign;
 
+	    cp = address;
+
+	    /* keep xmit_names at the end of the list, so that save_str()
+	     * need not walk all names saved so far for each new one */
+	    while (*xmit_names)
+		xmit_names = &(*xmit_names)->next;
+
 	    /* 
 	     * Handle empty address from a To: header containing only 
 	     * a comment.
@@ -156,38 +201,27 @@ static void find_server_names(const char *hdr,
 		 * on the localdomains list?  If so, save the whole name
 		 * and keep going.
 		 */
-		for (idp = ctl->server.localdomains; idp; idp = idp->next) {
-		    char	*rhs;
-
-		    rhs = atsign + (strlen(atsign) - strlen(idp->id));
-		    if (rhs > atsign &&
-			(rhs[-1] == '.' || rhs[-1] == '@') &&
-			strcasecmp(rhs, idp->id) == 0)
-		    {
-			if (outlevel >= O_DEBUG)
-			    report(stdout, GT_("passed through %s matching %s\n"), 
-				  cp, idp->id);
-			save_str(xmit_names, (const char *)cp, XMIT_ACCEPT);
-			accept_count++;
-			goto nomap;
-		    }
+		if ((idp = local_domain(ctl, atsign + 1)))
+		{
+		    if (outlevel >= O_DEBUG)
+			report(stdout, GT_("passed through %s matching %s\n"), 
+			      cp, idp->id);
+		    save_str(xmit_names, (const char *)cp, XMIT_ACCEPT);
+		    accept_count++;
+		    goto nomap;
 		}
 
-		/* if we matched a local domain, idp != NULL */
-		if (!idp)
+		/*
+		 * Check to see if the right-hand part is an alias
+		 * or MX equivalent of the mailserver.  If it's
+		 * not, skip this name.  If it is, we'll keep
+		 * going and try to find a mapping to a client name.
+		 */
+		if (!is_host_alias(atsign+1, ctl, &ai0))
 		{
-		    /*
-		     * Check to see if the right-hand part is an alias
-		     * or MX equivalent of the mailserver.  If it's
-		     * not, skip this name.  If it is, we'll keep
-		     * going and try to find a mapping to a client name.
-		     */
-		    if (!is_host_alias(atsign+1, ctl, &ai0))
-		    {
-			save_str(xmit_names, cp, XMIT_REJECT);
-			reject_count++;
-			continue;
-		    }
+		    save_str(xmit_names, cp, XMIT_REJECT);
+		    reject_count++;
+		    continue;
 		}
 		atsign[0] = '\0';
 		map_name(cp, ctl, xmit_names);
@@ -216,11 +250,11 @@ static void find_server_names(const char *hdr,
 
 /** Try to extract real address from the Received line.
  * If a valid Received: line is found, we return the full address in
- * a buffer which can be parsed from nxtaddr().  This is to ensure that
+ * a buffer which can be parsed by rfc822_next().  This is to ensure that
  * the local domain part of the address can be passed along in 
  * find_server_names() if it contains one.
  * Note: We should return a dummy header containing the address 
- * which makes nxtaddr() behave correctly. 
+ * which makes rfc822_next() behave correctly. 
  */
 static char *parse_received(struct query *ctl, char *bufp)
 {
@@ -322,7 +356,7 @@ static char *parse_received(struct query *ctl, char *bufp)
 		continue;
 	    tp = rbuf;
 	    RBUF_WRITE(':');	/* Here is the hack.  This is to be friends */
-	    RBUF_WRITE(' ');	/* with nxtaddr()... */
+	    RBUF_WRITE(' ');	/* with rfc822_next()... */
 	    if (*sp == '<')
 	    {
 		want_gt = TRUE;
@@ -405,6 +439,317 @@ static int end_of_header (const char *s)
     return (s[0] == '\n' && s[1] == '\0');
 }
 
+/*
+ * Per-message header arena.  msgblk.headers points into it.  Each
+ * header line, continuation lines included, is read straight onto its
+ * end and kept by moving the fill mark past it, or dropped by leaving
+ * the mark alone.  It grows geometrically and is reused, not freed,
+ * for the next message, so headers normally cost no allocation.
+ */
+static char	*hdr_arena;
+static size_t	hdr_size;
+
+/** Make the header arena hold at least \a need bytes, return its base. */
+static char *hdr_room(size_t need)
+{
+    if (need > hdr_size)
+    {
+	while (hdr_size < need)
+	    hdr_size = hdr_size ? 2 * hdr_size : 4 * MSGBUFSIZE;
+	hdr_arena = (char *)xrealloc(hdr_arena, hdr_size);
+    }
+    return hdr_arena;
+}
+
+/*
+ * Index of the header lines readheaders() cares about.  A perfect hash
+ * maps each recognised header name to an id; every kept line with such
+ * a name is entered, in header order, into hdr_lines and onto the
+ * occurrence list of its id.  To recognise another header, add it to
+ * enum hdr_ids and hdr_names; hdr_slot() keeps working if the hash
+ * ever stops being perfect, it just takes more than one probe.
+ */
+enum hdr_ids {
+    H_FROM, H_REPLY_TO, H_RESENT_FROM, H_APP_FROM, H_SENDER,
+    H_RESENT_SENDER, H_MESSAGE_ID, H_TO, H_CC, H_BCC, H_APP_TO,
+    H_RESENT_TO, H_RESENT_CC, H_RESENT_BCC, H_RECEIVED, H_QRECEIVED,
+    H_RETURN_PATH, H_DELIVERED_TO, H_STATUS, H_X_MOZILLA_STATUS, H_X_IMAP,
+    H_X_ENVELOPE_TO, H_X_ORIGINAL_TO, H_ENVELOPE_TO, H_LIST_ID,
+    H_NONE				/* not a recognised header */
+};
+
+static const char *const hdr_names[H_NONE] = {
+    "From", "Reply-To", "Resent-From", "Apparently-From", "Sender",
+    "Resent-Sender", "Message-ID", "To", "Cc", "Bcc", "Apparently-To",
+    "Resent-To", "Resent-Cc", "Resent-Bcc", "Received", ">Received",
+    "Return-Path", "Delivered-To", "Status", "X-Mozilla-Status", "X-IMAP",
+    "X-Envelope-To", "X-Original-To", "Envelope-To", "List-Id",
+};
+
+#define HDR_BIT(id)	(1UL << (id))
+#define HDR_SLOTS	64		/* power of two */
+
+struct hdr_line
+{
+    int	offs, len;			/* where in msgblk.headers */
+    int	id;
+    int	next;				/* next line with this id, or -1 */
+};
+
+static signed char	hdr_table[HDR_SLOTS];
+static struct hdr_line	*hdr_lines;
+static int		hdr_nlines, hdr_maxlines;
+static int		hdr_first[H_NONE], hdr_last[H_NONE];
+
+/** Hash a header name; collision-free over hdr_names. */
+static unsigned int hdr_hash(const char *name, size_t len)
+{
+    return (8 * len + 7 * tolower((unsigned char)name[0])
+	    + 6 * tolower((unsigned char)name[len / 2])
+	    + tolower((unsigned char)name[len - 1])) & (HDR_SLOTS - 1);
+}
+
+/** Return the hash table slot of header name \a name, or the free one
+ * it belongs in. */
+static int hdr_slot(const char *name, size_t len)
+{
+    unsigned int i = hdr_hash(name, len);
+
+    while (hdr_table[i] != H_NONE
+	   && (strlen(hdr_names[(int)hdr_table[i]]) != len
+	       || strncasecmp(hdr_names[(int)hdr_table[i]], name, len)))
+	i = (i + 1) & (HDR_SLOTS - 1);
+    return i;
+}
+
+/** Return the id of header name \a name of length \a len, H_NONE if it
+ * isn't recognised. */
+static int hdr_lookup(const char *name, size_t len)
+{
+    static flag	initialized;
+
+    if (!initialized)
+    {
+	int	id;
+
+	memset(hdr_table, H_NONE, sizeof(hdr_table));
+	for (id = 0; id < H_NONE; id++)
+	    hdr_table[hdr_slot(hdr_names[id], strlen(hdr_names[id]))] = id;
+	initialized = TRUE;
+    }
+    if (len == 0)
+	return H_NONE;
+    return hdr_table[hdr_slot(name, len)];
+}
+
+/** Return the id of the header \a line starts, H_NONE if none. */
+static int hdr_id(const char *line)
+{
+    const char	*cp;
+
+    for (cp = line; *cp && *cp != ':'; cp++)
+	if (isspace((unsigned char)*cp))
+	    return H_NONE;
+    if (*cp != ':')
+	return H_NONE;
+    return hdr_lookup(line, cp - line);
+}
+
+/** Empty the header index for a new message. */
+static void hdr_reset(void)
+{
+    int	id;
+
+    hdr_nlines = 0;
+    for (id = 0; id < H_NONE; id++)
+	hdr_first[id] = hdr_last[id] = -1;
+}
+
+/** Enter the \a len bytes long header line at \a offs with id \a id. */
+static void hdr_add(int offs, int len, int id)
+{
+    if (id == H_NONE)
+	return;
+    if (hdr_nlines >= hdr_maxlines)
+    {
+	hdr_maxlines = hdr_maxlines ? 2 * hdr_maxlines : 32;
+	hdr_lines = (struct hdr_line *)xrealloc(hdr_lines,
+		hdr_maxlines * sizeof(struct hdr_line));
+    }
+    hdr_lines[hdr_nlines].offs = offs;
+    hdr_lines[hdr_nlines].len = len;
+    hdr_lines[hdr_nlines].id = id;
+    hdr_lines[hdr_nlines].next = -1;
+    if (hdr_last[id] == -1)
+	hdr_first[id] = hdr_nlines;
+    else
+	hdr_lines[hdr_last[id]].next = hdr_nlines;
+    hdr_last[id] = hdr_nlines++;
+}
+
+/** Return the offset of the last \a id header, or -1.  With \a need_host,
+ * consider only lines that hold an @ or !. */
+static int hdr_offs(int id, flag need_host)
+{
+    int	i, offs = -1;
+
+    for (i = hdr_first[id]; i != -1; i = hdr_lines[i].next)
+    {
+	const char	*line = msgblk.headers + hdr_lines[i].offs;
+
+	if (!need_host || memchr(line, '@', hdr_lines[i].len)
+		|| memchr(line, '!', hdr_lines[i].len))
+	    offs = hdr_lines[i].offs;
+    }
+    return offs;
+}
+
+/*
+ * Header rules let the user decide a message's fate from its headers,
+ * before its body is fetched.  The first rule whose pattern matches
+ * wins.  Patterns are POSIX extended regular expressions, matched
+ * case-insensitively against header lines without their line end, or
+ * against single addresses.
+ */
+const char *const rule_whats[] = {
+    NULL, "header", "sender", "recipient", "listid",
+};
+const char *const rule_actions[] = {
+    NULL, "skip", "keep", "reject", "to",
+};
+
+const char *add_hdrrule(struct hdrrule **rules, const char *what,
+			char *pattern, int action, char *route)
+/* append a header rule; returns an error message, or NULL */
+{
+    static char		errbuf[128];
+    struct hdrrule	*rule, **rp;
+    int			i, err;
+
+    for (i = RULE_HEADER; i <= RULE_LISTID; i++)
+	if (strcasecmp(what, rule_whats[i]) == 0)
+	    break;
+    if (i > RULE_LISTID)
+	return(GT_("rule must match header, sender, recipient or listid"));
+
+    rule = (struct hdrrule *)xmalloc(sizeof(struct hdrrule));
+    rule->what = i;
+    rule->action = action;
+    rule->pattern = pattern;
+    rule->route = route;
+    rule->next = NULL;
+    rule->regex = xmalloc(sizeof(regex_t));
+    if ((err = regcomp((regex_t *)rule->regex, pattern,
+		       REG_EXTENDED | REG_ICASE | REG_NOSUB)))
+    {
+	regerror(err, (regex_t *)rule->regex, errbuf, sizeof(errbuf));
+	free(rule->regex);
+	free(rule);
+	return(errbuf);
+    }
+
+    for (rp = rules; *rp; rp = &(*rp)->next)
+	continue;
+    *rp = rule;
+    return(NULL);
+}
+
+/** Match \a re against the text from \a start to \a end, less any
+ * line end; the headers are terminated there for the while. */
+static flag rule_exec(const regex_t *re, char *start, char *end)
+{
+    char	save;
+    int		rc;
+
+    while (end > start && (end[-1] == '\n' || end[-1] == '\r'))
+	end--;
+    save = *end;
+    *end = '\0';
+    rc = regexec(re, start, 0, NULL, 0);
+    *end = save;
+    return(rc == 0);
+}
+
+/** Match \a re against each address in the header lines whose id is in
+ * \a mask. */
+static flag rule_addrs(const regex_t *re, unsigned long mask)
+{
+    struct rfc822_iter	it;
+    struct rfc822_addr	addr;
+    char		address[BUFSIZ];
+    int			i;
+
+    for (i = 0; i < hdr_nlines; i++)
+	if (mask & HDR_BIT(hdr_lines[i].id))
+	    for (rfc822_begin(&it, msgblk.headers + hdr_lines[i].offs,
+			      hdr_lines[i].len);
+		 rfc822_next(&it, &addr, address, sizeof(address)); )
+		if (regexec(re, address, 0, NULL, 0) == 0)
+		    return(TRUE);
+    return(FALSE);
+}
+
+/** Return the first of the user's header rules that the message in
+ * msgblk matches, NULL if none does. */
+static struct hdrrule *hdr_rules(struct query *ctl)
+{
+    struct hdrrule	*rule;
+    char		*line, *end;
+    flag		hit;
+    int			i;
+
+    for (rule = ctl->rules; rule; rule = rule->next)
+    {
+	const regex_t	*re = (const regex_t *)rule->regex;
+
+	hit = FALSE;
+	switch (rule->what)
+	{
+	case RULE_HEADER:
+	    /* every line, not just the indexed ones, continuations included */
+	    for (line = msgblk.headers; !hit && *line; line = end)
+	    {
+		for (end = line; (end = strchr(end, '\n'))
+			 && (end[1] == ' ' || end[1] == '\t'); end++)
+		    continue;
+		end = end ? end + 1 : line + strlen(line);
+		hit = rule_exec(re, line, end);
+	    }
+	    break;
+	case RULE_SENDER:
+	    hit = (msgblk.return_path[0]
+		   && regexec(re, msgblk.return_path, 0, NULL, 0) == 0)
+		|| rule_addrs(re, HDR_BIT(H_FROM) | HDR_BIT(H_SENDER)
+			      | HDR_BIT(H_RESENT_FROM)
+			      | HDR_BIT(H_RESENT_SENDER));
+	    break;
+	case RULE_RECIPIENT:
+	    hit = rule_addrs(re, HDR_BIT(H_TO) | HDR_BIT(H_CC)
+			     | HDR_BIT(H_BCC) | HDR_BIT(H_APP_TO)
+			     | HDR_BIT(H_RESENT_TO) | HDR_BIT(H_RESENT_CC)
+			     | HDR_BIT(H_RESENT_BCC) | HDR_BIT(H_DELIVERED_TO)
+			     | HDR_BIT(H_X_ENVELOPE_TO)
+			     | HDR_BIT(H_X_ORIGINAL_TO)
+			     | HDR_BIT(H_ENVELOPE_TO));
+	    break;
+	case RULE_LISTID:
+	    for (i = hdr_first[H_LIST_ID]; !hit && i != -1; i = hdr_lines[i].next)
+	    {
+		line = msgblk.headers + hdr_lines[i].offs;
+		end = line + hdr_lines[i].len;
+		for (line += strlen(hdr_names[H_LIST_ID]) + 1;
+		     line < end && isspace((unsigned char)*line); line++)
+		    continue;
+		hit = rule_exec(re, line, end);
+	    }
+	    break;
+	}
+	if (hit)
+	    return(rule);
+    }
+    return(NULL);
+}
+
 /** read message headers and ship to SMTP or MDA */
 int readheaders(int sock,
 		       long fetchlen,
@@ -419,20 +764,8 @@ int readheaders(int sock,
 /** \param num		index of message */
 /** \param suppress_readbody	output: whether call to readbody() should be supressed */
 {
-    struct addrblk
-    {
-	int		offset;
-	struct addrblk	*next;
-    };
-    struct addrblk	*to_addrchain = NULL;
-    struct addrblk	**to_chainptr = &to_addrchain;
-    struct addrblk	*resent_to_addrchain = NULL;
-    struct addrblk	**resent_to_chainptr = &resent_to_addrchain;
-
     char		buf[MSGBUFSIZE+1];
-    int			from_offs, reply_to_offs, resent_from_offs;
-    int			app_from_offs, sender_offs, resent_sender_offs;
-    int			env_offs;
+    int			env_offs, env_id, msgid_offs, hid;
     char		*received_for, *rcv, *cp;
     static char		*delivered_to = NULL;
     int 		n, oldlen, ch, remaining, skipcount;
@@ -442,8 +775,13 @@ int readheaders(int sock,
     flag		no_local_matches = FALSE;
     flag		has_nuls;
     int			olderrs, good_addresses, bad_addresses;
+    size_t		room;
     int			retain_mail = 0, refuse_mail = 0;
     flag		already_has_return_path = FALSE;
+    DIGEST_CTX		digest;
+    struct hdrrule	*rule;
+    struct rfc822_iter	it;
+    struct rfc822_addr	addr;
 
     sizeticker = 0;
     has_nuls = FALSE;
@@ -457,18 +795,24 @@ int readheaders(int sock,
      * We used to free the header block unconditionally at the end of 
      * readheaders, but it turns out that if close_sink() hits an error
      * condition the code for sending bouncemail will actually look
-     * at the freed storage and coredump...
+     * at the freed storage and coredump...  Now it lives in the
+     * header arena until the next message starts over.
      */
-    xfree(msgblk.headers);
+    msgblk.headers = NULL;
     free_str_list(&msgblk.recipients);
     xfree(delivered_to);
 
-    /* initially, no message digest */
+    /* initially, no message digest; kept lines are added as they come */
     memset(ctl->digest, '\0', sizeof(ctl->digest));
+    DigestInit(&digest, run.digest);
 
     received_for = NULL;
-    from_offs = reply_to_offs = resent_from_offs = app_from_offs = 
-	sender_offs = resent_sender_offs = env_offs = -1;
+    env_offs = -1;
+    hdr_reset();
+    if (ctl->server.envelope && ctl->server.envelope != STRING_DISABLED)
+	env_id = hdr_lookup(ctl->server.envelope, strlen(ctl->server.envelope));
+    else
+	env_id = H_NONE;
     oldlen = 0;
     msgblk.msglen = 0;
     skipcount = 0;
@@ -477,19 +821,16 @@ int readheaders(int sock,
 
     for (remaining = fetchlen; remaining > 0 || protocol->delimited; )
     {
-	char *line, *rline;
+	char *line, *rp;
 
-	line = (char *)xmalloc(sizeof(buf));
 	linelen = 0;
-	line[0] = '\0';
 	do {
 	    do {
-		char	*sp, *tp;
-
+		/* read onto the end of the line, with room for a CR */
+		rp = hdr_room(oldlen + linelen + MSGBUFSIZE + 2) + oldlen + linelen;
 		set_timeout(mytimeout);
-		if ((n = SockRead(sock, buf, sizeof(buf)-1)) == -1) {
+		if ((n = SockRead(sock, rp, MSGBUFSIZE)) == -1) {
 		    set_timeout(0);
-		    free(line);
 		    return(PS_SOCKET);
 		}
 		set_timeout(0);
@@ -500,14 +841,12 @@ int readheaders(int sock,
 		 * especially (according to reports) at the beginning of the
 		 * first read.  NULs are illegal in RFC822 format.
 		 */
-		for (sp = tp = buf; sp < buf + n; sp++)
-		    if (*sp)
-			*tp++ = *sp;
-		*tp = '\0';
-		n = tp - buf;
+		n = scan_strip(rp, n, '\0');
+		rp[n] = '\0';
 	    } while
 		  (n == 0);
 
+	    line = hdr_arena + oldlen;
 	    remaining -= n;
 	    linelen += n;
 	    msgblk.msglen += n;
@@ -516,52 +855,21 @@ int readheaders(int sock,
 	     * Try to gracefully handle the case where the length of a
 	     * line exceeds MSGBUFSIZE.
 	     */
-	    if (n && buf[n-1] != '\n') 
+	    if (n && rp[n-1] != '\n') 
 	    {
-		rline = (char *) realloc(line, linelen + 1);
-		if (rline == NULL)
-		{
-		    free (line);
-		    return(PS_IOERR);
-		}
-		line = rline;
-		memcpy(line + linelen - n, buf, n);
-		line[linelen] = '\0';
 		ch = ' '; /* So the next iteration starts */
 		continue;
 	    }
 
 	    /* lines may not be properly CRLF terminated; fix this for qmail */
-	    /* we don't want to overflow the buffer here */
-	    if (ctl->forcecr && buf[n-1]=='\n' && (n==1 || buf[n-2]!='\r'))
+	    if (ctl->forcecr && rp[n-1]=='\n' && (n==1 || rp[n-2]!='\r'))
 	    {
-		char * tcp;
-		rline = (char *) realloc(line, linelen + 2);
-		if (rline == NULL)
-		{
-		    free (line);
-		    return(PS_IOERR);
-		}
-		line = rline;
-		memcpy(line + linelen - n, buf, n - 1);
-		tcp = line + linelen - 1;
-		*tcp++ = '\r';
-		*tcp++ = '\n';
-		*tcp = '\0';
+		rp[n-1] = '\r';
+		rp[n] = '\n';
+		rp[n+1] = '\0';
 		/* n++; - not used later on */
 		linelen++;
 	    }
-	    else
-	    {
-		rline = (char *) realloc(line, linelen + 1);
-		if (rline == NULL)
-		{
-		    free (line);
-		    return(PS_IOERR);
-		}
-		line = rline;
-		memcpy(line + linelen - n, buf, n + 1);
-	    }
 
 	    /* check for end of headers */
 	    if (end_of_header(line))
@@ -569,7 +877,6 @@ int readheaders(int sock,
 eoh:
 		if (linelen != strlen (line))
 		    has_nuls = TRUE;
-		free(line);
 		goto process_headers;
 	    }
 
@@ -649,10 +956,9 @@ eoh:
 
 	/* skip processing if we are going to retain or refuse this mail */
 	if (retain_mail || refuse_mail)
-	{
-	    free(line);
 	    continue;
-	}
+
+	hid = hdr_id(line);
 
 	/* we see an ordinary (non-header, non-message-delimiter) line */
 	if (linelen != strlen (line))
@@ -697,8 +1003,7 @@ eoh:
 	 */
 	if (servport("pop2") != servport(protocol->service))
 #endif /* POP2_ENABLE */
-	    if (num == 1 && !strncasecmp(line, "X-IMAP:", 7)) {
-		free(line);
+	    if (num == 1 && hid == H_X_IMAP) {
 		retain_mail = 1;
 		continue;
 	    }
@@ -725,10 +1030,7 @@ eoh:
 	 * These aren't RFC822 so our conscience is clear...
 	 */
 	if (!strncasecmp(line, ">From ", 6) || !strncasecmp(line, "From ", 5))
-	{
-	    free(line);
 	    continue;
-	}
 
 	/*
 	 * We remove all Delivered-To: headers if dropdelivered is set
@@ -738,16 +1040,12 @@ eoh:
 	 * This is to avoid false mail loops errors when delivering
 	 * local messages to and from a Postfix or qmail mailserver.
 	 */
-	if (ctl->dropdelivered && !strncasecmp(line, "Delivered-To:", 13)) 
+	if (ctl->dropdelivered && hid == H_DELIVERED_TO)
 	{
-	    if (delivered_to ||
-	    	ctl->server.envelope == STRING_DISABLED ||
-		!ctl->server.envelope ||
-		strcasecmp(ctl->server.envelope, "Delivered-To") ||
-		delivered_to_count != ctl->server.envskip)
-		free(line);
-	    else 
-		delivered_to = line;
+	    if (!delivered_to &&
+		env_id == H_DELIVERED_TO &&
+		delivered_to_count == ctl->server.envskip)
+		delivered_to = xstrdup(line);	/* the arena space is reused */
 	    delivered_to_count++;
 	    continue;
 	}
@@ -769,24 +1067,23 @@ eoh:
 	{
 	    char	*tcp;
 
-	    if (!strncasecmp(line, "Status:", 7))
-		tcp = line + 7;
-	    else if (!strncasecmp(line, "X-Mozilla-Status:", 17))
-		tcp = line + 17;
+	    if (hid == H_STATUS || hid == H_X_MOZILLA_STATUS)
+		tcp = line + strlen(hdr_names[hid]) + 1;
 	    else
 		tcp = NULL;
 	    if (tcp) {
 		while (*tcp && isspace((unsigned char)*tcp)) tcp++;
 		if (!*tcp || ctl->dropstatus)
-		{
-		    free(line);
 		    continue;
-		}
 	    }
 	}
 
-	if (ctl->rewrite)
-	    line = reply_hack(line, ctl->server.truename, &linelen);
+	if (ctl->rewrite
+		&& (room = reply_hack_room(line, ctl->server.truename)) > 0)
+	{
+	    line = hdr_room(oldlen + linelen + room + 1) + oldlen;
+	    linelen = reply_hack(line, linelen, room, ctl->server.truename);
+	}
 
 	/*
 	 * OK, this is messy.  If we're forwarding by SMTP, it's the
@@ -815,82 +1112,32 @@ eoh:
 	 * Return-Path.
 	 *
 	 */
-	if ((already_has_return_path==FALSE) && !strncasecmp("Return-Path:", line, 12) && (cp = nxtaddr(line)))
+	if ((already_has_return_path==FALSE) && hid == H_RETURN_PATH)
 	{
-	    char nulladdr[] = "<>";
-	    already_has_return_path = TRUE;
-	    if (cp[0]=='\0')	/* nxtaddr() strips the brackets... */
-		cp=nulladdr;
-	    strncpy(msgblk.return_path, cp, sizeof(msgblk.return_path));
-	    msgblk.return_path[sizeof(msgblk.return_path)-1] = '\0';
-	    if (!ctl->mda) {
-		free(line);
-		continue;
+	    rfc822_begin(&it, line, linelen);
+	    if (rfc822_next(&it, &addr, msgblk.return_path,
+			    sizeof(msgblk.return_path)))
+	    {
+		already_has_return_path = TRUE;
+		if (!msgblk.return_path[0])	/* the brackets are stripped... */
+		    strcpy(msgblk.return_path, "<>");
+		if (!ctl->mda && !ctl->maildir && !ctl->mbox)
+		    continue;
 	    }
 	}
 
-	if (!msgblk.headers)
-	{
-	    oldlen = linelen;
-	    msgblk.headers = (char *)xmalloc(oldlen + 1);
-	    (void) memcpy(msgblk.headers, line, linelen);
-	    msgblk.headers[oldlen] = '\0';
-	    free(line);
-	    line = msgblk.headers;
-	}
-	else
-	{
-	    char *newhdrs;
-	    int	newlen;
-
-	    newlen = oldlen + linelen;
-	    newhdrs = (char *) realloc(msgblk.headers, newlen + 1);
-	    if (newhdrs == NULL) {
-		free(line);
-		return(PS_IOERR);
-	    }
-	    msgblk.headers = newhdrs;
-	    memcpy(msgblk.headers + oldlen, line, linelen);
-	    msgblk.headers[newlen] = '\0';
-	    free(line);
-	    line = msgblk.headers + oldlen;
-	    oldlen = newlen;
-	}
+	/* keep the line, it's in place already */
+	msgblk.headers = hdr_arena;
+	oldlen += linelen;
+	msgblk.headers[oldlen] = '\0';
+	if (MULTIDROP(ctl))
+	    DigestUpdate(&digest, line, linelen);
 
-	/* find offsets of various special headers */
-	if (!strncasecmp("From:", line, 5))
-	    from_offs = (line - msgblk.headers);
-	else if (!strncasecmp("Reply-To:", line, 9))
-	    reply_to_offs = (line - msgblk.headers);
-	else if (!strncasecmp("Resent-From:", line, 12))
-	    resent_from_offs = (line - msgblk.headers);
-	else if (!strncasecmp("Apparently-From:", line, 16))
-	    app_from_offs = (line - msgblk.headers);
-	/*
-	 * Netscape 4.7 puts "Sender: zap" in mail headers.  Perverse...
-	 *
-	 * But a literal reading of RFC822 sec. 4.4.2 supports the idea
-	 * that Sender: *doesn't* have to be a working email address.
-	 *
-	 * The definition of the Sender header in RFC822 says, in
-	 * part, "The Sender mailbox specification includes a word
-	 * sequence which must correspond to a specific agent (i.e., a
-	 * human user or a computer program) rather than a standard
-	 * address."  That implies that the contents of the Sender
-	 * field don't need to be a legal email address at all So
-	 * ignore any Sender or Resent-Sender lines unless they
-	 * contain @.
-	 *
-	 * (RFC2822 says the contents of Sender must be a valid mailbox
-	 * address, which is also what RFC822 4.4.4 implies.)
-	 */
-	else if (!strncasecmp("Sender:", line, 7) && (strchr(line, '@') || strchr(line, '!')))
-	    sender_offs = (line - msgblk.headers);
-	else if (!strncasecmp("Resent-Sender:", line, 14) && (strchr(line, '@') || strchr(line, '!')))
-	    resent_sender_offs = (line - msgblk.headers);
+	/* index the special headers */
+	hdr_add(line - msgblk.headers, linelen, hid);
 
 #ifdef __UNUSED__
- 	else if (!strncasecmp("Message-Id:", line, 11))
+ 	if (hid == H_MESSAGE_ID)
 	{
 	    if (ctl->server.uidl)
  	    {
@@ -907,45 +1154,24 @@ eoh:
  	}
 #endif /* __UNUSED__ */
 
-	/* if multidrop is on, gather addressee headers */
+	/* if multidrop is on, look for the envelope addressee */
 	if (MULTIDROP(ctl))
 	{
-	    if (!strncasecmp("To:", line, 3)
-		|| !strncasecmp("Cc:", line, 3)
-		|| !strncasecmp("Bcc:", line, 4)
-		|| !strncasecmp("Apparently-To:", line, 14))
+	    if (ctl->server.envelope != STRING_DISABLED)
 	    {
-		*to_chainptr = (struct addrblk *)xmalloc(sizeof(struct addrblk));
-		(*to_chainptr)->offset = (line - msgblk.headers);
-		to_chainptr = &(*to_chainptr)->next; 
-		*to_chainptr = NULL;
-	    }
-
-	    else if (!strncasecmp("Resent-To:", line, 10)
-		     || !strncasecmp("Resent-Cc:", line, 10)
-		     || !strncasecmp("Resent-Bcc:", line, 11))
-	    {
-		*resent_to_chainptr = (struct addrblk *)xmalloc(sizeof(struct addrblk));
-		(*resent_to_chainptr)->offset = (line - msgblk.headers);
-		resent_to_chainptr = &(*resent_to_chainptr)->next; 
-		*resent_to_chainptr = NULL;
-	    }
-
-	    else if (ctl->server.envelope != STRING_DISABLED)
-	    {
-		if (ctl->server.envelope 
-		    && strcasecmp(ctl->server.envelope, "Received"))
+		if (ctl->server.envelope && env_id != H_RECEIVED)
 		{
-		    if (env_offs == -1 && !strncasecmp(ctl->server.envelope,
-						       line,
-						       strlen(ctl->server.envelope)))
+		    /* envelope headers we don't index are matched by prefix */
+		    if (env_offs == -1 && (env_id != H_NONE ? hid == env_id
+			    : !strncasecmp(ctl->server.envelope, line,
+					   strlen(ctl->server.envelope))))
 		    {				
 			if (skipcount++ < ctl->server.envskip)
 			    continue;
 			env_offs = (line - msgblk.headers);
 		    }    
 		}
-		else if (!received_for && !strncasecmp("Received:", line, 9))
+		else if (!received_for && hid == H_RECEIVED)
 		{
 		    if (skipcount++ < ctl->server.envskip)
 			continue;
@@ -957,6 +1183,13 @@ eoh:
 
 process_headers:
 
+    /* the arena may have moved, and dropped lines ran past the mark */
+    if (msgblk.headers)
+    {
+	msgblk.headers = hdr_arena;
+	msgblk.headers[oldlen] = '\0';
+    }
+
     if (retain_mail) {
 	return(PS_RETAINED);
     }
@@ -998,18 +1231,14 @@ process_headers:
      */
     if (MULTIDROP(ctl) && msgblk.headers)
     {
-	MD5_CTX context;
-
-	MD5Init(&context);
-	MD5Update(&context, (unsigned char *)msgblk.headers, strlen(msgblk.headers));
-	MD5Final(ctl->digest, &context);
+	DigestFinal(ctl->digest, &digest);
 
 	if (!received_for && env_offs == -1 && !delivered_to)
 	{
 	    /*
-	     * Hmmm...can MD5 ever yield all zeroes as a hash value?
-	     * If so there is a one in 18-quadrillion chance this 
-	     * code will incorrectly nuke the first message.
+	     * The digest carries its algorithm in the last byte, so it
+	     * never matches the all-zeroes lastdigest of a fresh
+	     * connection, nor one made with another algorithm.
 	     */
 	    if (!memcmp(ctl->lastdigest, ctl->digest, DIGESTLEN))
 		return(PS_REFUSED);
@@ -1033,7 +1262,7 @@ process_headers:
 		"To: %s@%s\r\n"
 		"Subject: Headerless mail from %s's mailbox on %s\r\n",
 		user, fetchmailhost, ctl->remotename, ctl->server.truename);
-	msgblk.headers = xstrdup(buf);
+	msgblk.headers = strcpy(hdr_room(strlen(buf) + 1), buf);
     }
 
     /*
@@ -1069,26 +1298,70 @@ process_headers:
      * (ex: specified by "Sender:") which is much less annoying.  This 
      * is true for most mailing list packages.
      */
+    /*
+     * Netscape 4.7 puts "Sender: zap" in mail headers.  Perverse...
+     *
+     * But a literal reading of RFC822 sec. 4.4.2 supports the idea
+     * that Sender: *doesn't* have to be a working email address.
+     *
+     * The definition of the Sender header in RFC822 says, in
+     * part, "The Sender mailbox specification includes a word
+     * sequence which must correspond to a specific agent (i.e., a
+     * human user or a computer program) rather than a standard
+     * address."  That implies that the contents of the Sender
+     * field don't need to be a legal email address at all So
+     * ignore any Sender or Resent-Sender lines unless they
+     * contain @.
+     *
+     * (RFC2822 says the contents of Sender must be a valid mailbox
+     * address, which is also what RFC822 4.4.4 implies.)
+     */
     if( !msgblk.return_path[0] ){
-	char *ap = NULL;
-	if (resent_sender_offs >= 0 && (ap = nxtaddr(msgblk.headers + resent_sender_offs)));
-	else if (sender_offs >= 0 && (ap = nxtaddr(msgblk.headers + sender_offs)));
-	else if (resent_from_offs >= 0 && (ap = nxtaddr(msgblk.headers + resent_from_offs)));
-	else if (from_offs >= 0 && (ap = nxtaddr(msgblk.headers + from_offs)));
-	else if (reply_to_offs >= 0 && (ap = nxtaddr(msgblk.headers + reply_to_offs)));
-	else if (app_from_offs >= 0 && (ap = nxtaddr(msgblk.headers + app_from_offs))) {}
+	static const struct { int id; flag need_host; } senders[] = {
+	    { H_RESENT_SENDER, TRUE }, { H_SENDER, TRUE },
+	    { H_RESENT_FROM, FALSE }, { H_FROM, FALSE },
+	    { H_REPLY_TO, FALSE }, { H_APP_FROM, FALSE },
+	};
+	char address[BUFSIZ];
+	flag found = FALSE;
+	int i, offs;
+
+	for (i = 0; !found && i < (int)(sizeof(senders) / sizeof(senders[0])); i++)
+	    if ((offs = hdr_offs(senders[i].id, senders[i].need_host)) >= 0)
+	    {
+		rfc822_begin(&it, msgblk.headers + offs,
+			     rfc822_hdrlen(msgblk.headers + offs));
+		found = rfc822_next(&it, &addr, address, sizeof(address));
+	    }
 	/* multi-line MAIL FROM addresses confuse SMTP terribly */
-	if (ap && !strchr(ap, '\n')) {
-	    strncpy(msgblk.return_path, ap, sizeof(msgblk.return_path));
+	if (found && !strchr(address, '\n')) {
+	    strncpy(msgblk.return_path, address, sizeof(msgblk.return_path));
 	    msgblk.return_path[sizeof(msgblk.return_path)-1] = '\0';
 	}
     }
 
+    /* the user's header rules may settle the message's fate right here */
+    if ((rule = hdr_rules(ctl)))
+    {
+	if (outlevel >= O_VERBOSE)
+	    report(stdout, GT_("header rule %s \"%s\" matched, action %s\n"),
+		   rule_whats[rule->what], rule->pattern,
+		   rule_actions[rule->action]);
+	if (rule->action == RULE_SKIP)
+	    return(PS_RETAINED);
+	else if (rule->action == RULE_KEEP)
+	    return(PS_SEEN);
+	else if (rule->action == RULE_REJECT)
+	    return(PS_REFUSED);
+    }
+
     /* cons up a list of local recipients */
     msgblk.recipients = (struct idlist *)NULL;
     accept_count = reject_count = 0;
+    if (rule)		/* routed by a header rule */
+	save_str(&msgblk.recipients, rule->route, XMIT_ACCEPT);
     /* is this a multidrop box? */
-    if (MULTIDROP(ctl))
+    else if (MULTIDROP(ctl))
     {
 #ifdef SDPS_ENABLE
 	if (ctl->server.sdps && sdps_envto)
@@ -1096,7 +1369,7 @@ process_headers:
 	    /* We have the real envelope recipient, stored out of band by
 	     * SDPS - that's more accurate than any header is going to be.
 	     */
-	    find_server_names(sdps_envto, ctl, &msgblk.recipients);
+	    find_server_names(sdps_envto, strlen(sdps_envto), ctl, &msgblk.recipients);
 	    free(sdps_envto);
 	} else
 #endif /* SDPS_ENABLE */ 
@@ -1106,17 +1379,18 @@ process_headers:
 		    size_t l = strcspn(tmps, "\r\n");
 		    report(stdout, GT_("Parsing envelope \"%s\" names \"%-.*s\"\n"), ctl->server.envelope, UCAST_TO_INT(l), tmps);
 		}
-		find_server_names(msgblk.headers + env_offs, ctl, &msgblk.recipients);
+		find_server_names(msgblk.headers + env_offs,
+				  rfc822_hdrlen(msgblk.headers + env_offs),
+				  ctl, &msgblk.recipients);
 	    }
-	else if (delivered_to && ctl->server.envelope != STRING_DISABLED &&
-		ctl->server.envelope && !strcasecmp(ctl->server.envelope, "Delivered-To"))
+	else if (delivered_to && env_id == H_DELIVERED_TO)
 	{
 	    if (outlevel >= O_DEBUG) {
 		const char *tmps = delivered_to + 2 + strlen(ctl->server.envelope);
 		size_t l = strcspn(tmps, "\r\n");
 		report(stdout, GT_("Parsing envelope \"%s\" names \"%-.*s\"\n"), ctl->server.envelope, UCAST_TO_INT(l), tmps);
 	    }
-	    find_server_names(delivered_to, ctl, &msgblk.recipients);
+	    find_server_names(delivered_to, strlen(delivered_to), ctl, &msgblk.recipients);
 	    xfree(delivered_to);
 	} else if (received_for) {
 	    /*
@@ -1131,7 +1405,7 @@ process_headers:
 		size_t l = strcspn(tmps, "\r\n");
 		report(stdout, GT_("Parsing Received names \"%-.*s\"\n"), UCAST_TO_INT(l), tmps);
 	    }
-	    find_server_names(received_for, ctl, &msgblk.recipients);
+	    find_server_names(received_for, strlen(received_for), ctl, &msgblk.recipients);
 	} else {
 	    /*
 	     * We haven't extracted the envelope address.
@@ -1139,33 +1413,30 @@ process_headers:
 	     * they exist.  If and only if they don't, consider
 	     * the "To" addresses.
 	     */
-	    register struct addrblk *nextptr;
+	    unsigned long mask;
+	    int i;
+
 	   if (outlevel >= O_DEBUG)
 		   report(stdout, GT_("No envelope recipient found, resorting to header guessing.\n"));
-	    if (resent_to_addrchain) {
-		/* delete the "To" chain and substitute it 
-		 * with the "Resent-To" list 
-		 */
-		while (to_addrchain) {
-		    nextptr = to_addrchain->next;
-		    free(to_addrchain);
-		    to_addrchain = nextptr;
-		}
-		to_addrchain = resent_to_addrchain;
-		resent_to_addrchain = NULL;
-	    }
+	    mask = HDR_BIT(H_RESENT_TO) | HDR_BIT(H_RESENT_CC)
+		| HDR_BIT(H_RESENT_BCC);
+	    if (hdr_first[H_RESENT_TO] == -1 && hdr_first[H_RESENT_CC] == -1
+		    && hdr_first[H_RESENT_BCC] == -1)
+		mask = HDR_BIT(H_TO) | HDR_BIT(H_CC) | HDR_BIT(H_BCC)
+		    | HDR_BIT(H_APP_TO);
 	    /* now look for remaining adresses */
-	    while (to_addrchain) {
+	    for (i = 0; i < hdr_nlines; i++)
+	    {
+		const char *tmps = msgblk.headers + hdr_lines[i].offs;
+
+		if (!(mask & HDR_BIT(hdr_lines[i].id)))
+		    continue;
 		if (outlevel >= O_DEBUG) {
-		    const char *tmps = msgblk.headers+to_addrchain->offset;
 		    size_t l = strcspn(tmps, "\r\n");
 		    report(stdout, GT_("Guessing from header \"%-.*s\".\n"), UCAST_TO_INT(l), tmps);
 		}
 
-		find_server_names(msgblk.headers+to_addrchain->offset, ctl, &msgblk.recipients);
-		nextptr = to_addrchain->next;
-		free(to_addrchain);
-		to_addrchain = nextptr;
+		find_server_names(tmps, hdr_lines[i].len, ctl, &msgblk.recipients);
 	    }
 	}
 	if (!accept_count)
@@ -1181,6 +1452,38 @@ process_headers:
     else	/* it's a single-drop box, use first localname */
 	save_str(&msgblk.recipients, ctl->localnames->id, XMIT_ACCEPT);
 
+    /*
+     * The cross-account duplicate killer.  Drop the recipients this
+     * message has been delivered to before, through whatever account,
+     * and the whole message if that leaves none; its body needn't
+     * even be fetched then.  The key is the Message-ID, as trace
+     * headers differ between copies of a message in different
+     * mailboxes.  Messages without one are always delivered.
+     */
+    if (run.dupfile && (msgid_offs = hdr_offs(H_MESSAGE_ID, FALSE)) >= 0)
+    {
+	struct idlist	*idp;
+	const char	*msgid = msgblk.headers + msgid_offs + 11;
+	int		fresh = 0;
+
+	for (idp = msgblk.recipients; idp; idp = idp->next)
+	    if (idp->val.status.mark == XMIT_ACCEPT)
+	    {
+		if (!dup_check(num, msgid, idp->id))
+		    fresh++;
+		else
+		{
+		    idp->val.status.mark = XMIT_REJECT;
+		    if (outlevel >= O_VERBOSE)
+			report(stdout,
+			       GT_("message was delivered to %s before\n"),
+			       idp->id);
+		}
+	    }
+	if (!fresh)
+	    return(PS_REFUSED);
+    }
+
 
     /*
      * Time to either address the message or decide we can't deliver it yet.
@@ -1202,17 +1505,20 @@ process_headers:
 	}
     }
 
-    n = 0;
     /*
      * Some server/sendmail combinations cause problems when our
      * synthetic Received line is before the From header.  Cope
      * with this...
      */
-    if ((rcv = strstr(msgblk.headers, "Received:")) == (char *)NULL)
-	rcv = msgblk.headers;
+    rcv = msgblk.headers;
     /* handle ">Received:" lines too */
-    while (rcv > msgblk.headers && rcv[-1] != '\n')
-	rcv--;
+    for (n = 0; n < hdr_nlines; n++)
+	if (hdr_lines[n].id == H_RECEIVED || hdr_lines[n].id == H_QRECEIVED)
+	{
+	    rcv = msgblk.headers + hdr_lines[n].offs;
+	    break;
+	}
+    n = 0;
     if (rcv > msgblk.headers)
     {
 	char	c = *rcv;
@@ -1384,12 +1690,12 @@ process_headers:
 }
 
 /** Convenience function factored out from readbody(): 
- * send buffer \a buf via stuffline() and handle errors and progress.
+ * send \a len bytes at \a buf via stuffbuf() and handle errors and progress.
  * Store return value in \a *n, and return PS_IOERR for failure or
  * PS_SUCCESS otherwise. */
-static int rb_send(struct query *ctl, char *buf, int *n)
+static int rb_send(struct query *ctl, char *buf, size_t len, int *n)
 {
-    *n = stuffline(ctl, buf);
+    *n = stuffbuf(ctl, buf, len);
 
     if (*n < 0)
     {
@@ -1405,6 +1711,56 @@ static int rb_send(struct query *ctl, char *buf, int *n)
     return PS_SUCCESS;
 }
 
+/** Read and dispose of the \a len bytes long body of a message from an
+ * undelimited protocol in big blocks, regardless of line boundaries. */
+static int readbody_blocks(int sock, struct query *ctl, flag forward, int len)
+{
+    static char *blkbuf;
+    int n, blklen;
+    flag at_bol = TRUE;
+
+    if (!blkbuf)
+	blkbuf = (char *)xmalloc(BODY_BLOCKSIZE);
+
+    while (len > 0)
+    {
+	set_timeout(mytimeout);
+	blklen = SockReadBlock(sock, blkbuf,
+			       len < BODY_BLOCKSIZE ? len : BODY_BLOCKSIZE);
+	set_timeout(0);
+	if (blklen == -1)
+	{
+	    release_sink(ctl);
+	    return(PS_SOCKET);
+	}
+
+	/* write the message size dots */
+	print_ticker(&sizeticker, blklen);
+
+	len -= blklen;
+	msgblk.msglen += blklen;
+
+	if (forward)
+	{
+	    int	err;
+
+	    at_bol = (blkbuf[blklen - 1] == '\n');
+	    if ((err = rb_send(ctl, blkbuf, blklen, &n)) != PS_SUCCESS)
+		return err;
+	}
+    }
+
+    /* terminate a last line that lacks its line break, see readbody() */
+    if (forward && !at_bol)
+    {
+	char crlf[] = "\r\n";
+
+	return rb_send(ctl, crlf, 2, &n);
+    }
+
+    return(PS_SUCCESS);
+}
+
 int readbody(int sock, struct query *ctl, flag forward, int len)
 /** read and dispose of a message body presented on \a sock */
 /** \param ctl		query control record */
@@ -1416,6 +1772,18 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
     char buf[MSGBUFSIZE+4];
     char *inbufp = buf;
     flag issoftline = FALSE;
+    flag at_bol = TRUE;		/* is the text shipped so far whole lines? */
+
+    /*
+     * For undelimited protocols that ship the size, such as IMAP,
+     * the length is what remains of the literal.  Unless the MIME
+     * decoder needs to see the body line by line, read that in big
+     * blocks; the tail of the server response stays unread for the
+     * protocol's trail method.
+     */
+    if (!protocol->delimited && len > 0
+	    && !(ctl->mimedecode && (ctl->mimemsg & MSG_NEEDS_DECODE)))
+	return(readbody_blocks(sock, ctl, forward, len));
 
     /*
      * Pass through the text lines in the body.
@@ -1430,9 +1798,6 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
     while (protocol->delimited || len > 0)
     {
 	set_timeout(mytimeout);
-	/* XXX FIXME: for undelimited protocols that ship the size, such
-	 * as IMAP, we might want to use the count of remaining characters
-	 * instead of the buffer size -- not for fetchmail 6.3.X though */
 	if ((linelen = SockRead(sock, inbufp, sizeof(buf)-4-(inbufp-buf)))==-1)
 	{
 	    set_timeout(0);
@@ -1457,15 +1822,8 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
 	 * so we might end truncating messages prematurely.
 	 */
 	if (!protocol->delimited && linelen > len) {
-	    /* FIXME: HACK ALERT! This \r\n is only here to make sure the
-	     * \n\0 hunt works later on. The \n generated here was not
-	     * part of the original message!
-	     * The real fix will be to use buffer + length strings,
-	     * rather than 0-terminated C strings. */
-	    inbufp[len++] = '\r';
-	    inbufp[len++] = '\n';
-	    inbufp[len] = '\0';
 	    linelen = len;
+	    inbufp[linelen] = '\0';	/* UnMimeBodyline() wants a string */
 	}
 
 	len -= linelen;
@@ -1482,7 +1840,7 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
 	msgblk.msglen += linelen;
 
 	if (ctl->mimedecode && (ctl->mimemsg & MSG_NEEDS_DECODE)) {
-	    issoftline = UnMimeBodyline(&inbufp, protocol->delimited, issoftline);
+	    issoftline = UnMimeBodyline(&inbufp, linelen, protocol->delimited, issoftline);
 	    if (issoftline && (sizeof(buf)-1-(inbufp-buf) < 200))
 	    {
 		/*
@@ -1492,25 +1850,26 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
 		 * deliver what we have now.
 		 * (Who writes lines longer than 2K anyway?)
 		 */
-		*inbufp = '\n'; *(inbufp+1) = '\0';
+		*inbufp++ = '\n';
 		issoftline = 0;
 	    }
 	}
+	else
+	    inbufp += linelen;
 
-	/* ship out the text line */
-	if (forward && (!issoftline))
+	/* ship out the text line, or as much of it as we read */
+	if (!issoftline)
 	{
-	    int	n, err;
-	    inbufp = buf;
-
-	    /* guard against very long lines */
-	    buf[MSGBUFSIZE+1] = '\r';
-	    buf[MSGBUFSIZE+2] = '\n';
-	    buf[MSGBUFSIZE+3] = '\0';
+	    if (forward && inbufp > buf)
+	    {
+		int	n, err;
 
-	    err = rb_send(ctl, buf, &n);
-	    if (err != PS_SUCCESS)
-		return err;
+		at_bol = (inbufp[-1] == '\n');
+		err = rb_send(ctl, buf, inbufp - buf, &n);
+		if (err != PS_SUCCESS)
+		    return err;
+	    }
+	    inbufp = buf;
 	}
     }
 
@@ -1520,17 +1879,20 @@ int readbody(int sock, struct query *ctl, flag forward, int len)
      * Trouble reported in June 2011 by Lars Hecking, with
      * text/html quoted-printable messages generated by
      * Outlook/Exchange that got mutilated by fetchmail.
+     *
+     * This also ends a last line that lacks its line terminator,
+     * as IMAP ships messages that don't end in one.  The sink's
+     * end-of-message marker must be on a line of its own.
      */
-    if (forward && issoftline)
+    if (forward && (issoftline || !at_bol))
     {
 	int n;
 
 	/* force proper line termination */
-	inbufp[0] = '\r';
-	inbufp[1] = '\n';
-	inbufp[2] = '\0';
+	*inbufp++ = '\r';
+	*inbufp++ = '\n';
 
-	return rb_send(ctl, buf, &n);
+	return rb_send(ctl, buf, inbufp - buf, &n);
     }
 
     return(PS_SUCCESS);
@@ -24,3 +24,46 @@
 
 /* maximum transient errors to accept */
 #define MAX_TRANSIENT_ERRORS	20
+
+/* blocks in which message bodies of known length are read */
+#define BODY_BLOCKSIZE		65536
+
+/* size of message text chunks shipped with BDAT to CHUNKING listeners */
+#define BDAT_CHUNKSIZE		65536
+
+/* message text staged for the SMTP/LMTP listener, and the amount that
+ * is shipped at once without waiting for it */
+#define LISTENER_BUFSIZE	(256 * 1024)
+#define LISTENER_CHUNK		16384
+
+/* maximum number of idle listener connections kept for reuse */
+#define SMTP_POOLSIZE		4
+
+/* maximum number of MDA processes running at once ("mdajobs") */
+#define MDA_MAXJOBS		16
+
+/* stdio buffer and (where settable) kernel pipe size for MDA input */
+#define MDA_PIPEBUFSIZE		65536
+
+/* append buffer for mbox delivery */
+#define MBOX_BUFSIZE		65536
+
+/* seconds to retry an mbox lock, and age of a dot-lock considered stale */
+#define MBOX_LOCKTRIES		10
+#define MBOX_LOCKSTALE		300
+
+/* stdio buffer for BSMTP output, and data volume that forces a group
+ * commit before "bsmtpsync" messages are complete */
+#define BSMTP_BUFSIZE		65536
+#define BSMTP_SYNCBYTES		(8 * 1024 * 1024)
+
+/* seconds between attempts to deliver a spooled message, and after
+ * which it is given up on */
+#define SPOOL_MINRETRY		60
+#define SPOOL_MAXRETRY		3600
+#define SPOOL_EXPIRE		(5 * 24 * 3600)
+
+/* seconds a delivery is remembered in the duplicate index ("dupfile"),
+ * and log size in records below which it is never rewritten */
+#define DUP_EXPIRE		(14 * 24 * 3600)
+#define DUP_MINREWRITE		4096
@@ -507,13 +507,13 @@ int MimeBodyType(char *hdrs, int WantDecode)
 
 
 /*
- * Decode one line of data containing QP data.
+ * Decode one line of data containing QP data, len bytes at *bufp.
  * Return flag set if this line ends with a soft line-break.
  * 'bufp' is modified to point to the end of the output buffer.
  */
-static int DoOneQPLine(char **bufp, flag delimited, flag issoftline)
+static int DoOneQPLine(char **bufp, size_t len, flag delimited, flag issoftline)
 {
-  char *buf = *bufp;
+  char *buf = *bufp, *end = buf + len;
   char *p_in, *p_out, *p;
   int n;
   int ret = 0;
@@ -522,22 +522,22 @@ static int DoOneQPLine(char **bufp, flag delimited, flag issoftline)
    * Special case: line consists of a single =2E and messages are 
    * dot-terminated.  Line has to be dot-stuffed after decoding.
    */
-  if (delimited && !issoftline && buf[0]=='=' && !strncmp(*bufp, "=2E\r\n", 5))
+  if (delimited && !issoftline && len == 5 && !memcmp(buf, "=2E\r\n", 5))
   {
-      strcpy(buf, "..\r\n");
-      *bufp += 5;
+      memcpy(buf, "..\r\n", 4);
+      *bufp += 4;
       return(FALSE);
   }
 
   p_in = buf;
-  if (delimited && issoftline && (strncmp(buf, "..", 2) == 0))
+  if (delimited && issoftline && len >= 2 && (strncmp(buf, "..", 2) == 0))
     p_in++;
 
-  for (p_out = buf; (*p_in); ) {
-    p = strchr(p_in, '=');
+  for (p_out = buf; p_in < end; ) {
+    p = (char *)memchr(p_in, '=', end - p_in);
     if (p == NULL) {
       /* No more QP data, just move remainder into place */
-      n = strlen(p_in);
+      n = end - p_in;
       memmove(p_out, p_in, n);
       p_in += n; p_out += n;
     }
@@ -549,18 +549,18 @@ static int DoOneQPLine(char **bufp, flag delimited, flag issoftline)
 	p_out += n;
       }
               
-      switch (*(p+1)) {
+      switch (p + 1 < end ? *(p+1) : '\0') {
       case '\0': case '\r': case '\n':
 	/* Soft line break, skip '=' */
 	p_in = p+1; 
-	if (*p_in == '\r') p_in++;
-	if (*p_in == '\n') p_in++;
+	if (p_in < end && *p_in == '\r') p_in++;
+	if (p_in < end && *p_in == '\n') p_in++;
         ret = 1;
 	break;
 
       default:
 	/* There is a QP encoded byte */
-	if (qp_char(*(p+1), *(p+2), p_out) == 0) {
+	if (p + 2 < end && qp_char(*(p+1), *(p+2), p_out) == 0) {
 	  p_in = p+3;
 	}
 	else {
@@ -580,7 +580,8 @@ static int DoOneQPLine(char **bufp, flag delimited, flag issoftline)
 }
 
 
-/* This is called once per line in the message body.  We need to scan
+/* This is called once per line in the message body, len bytes at
+ * *bufp, followed by a NUL.  We need to scan
  * all lines in the message body for the multipart delimiter string,
  * and handle any body-part headers in such messages (these can toggle
  * qp-decoding on and off).
@@ -593,7 +594,7 @@ static int DoOneQPLine(char **bufp, flag delimited, flag issoftline)
  * 'bufp' is modified to point to the end of the output buffer.
  */
 
-int UnMimeBodyline(char **bufp, flag delimited, flag softline)
+int UnMimeBodyline(char **bufp, size_t len, flag delimited, flag softline)
 {
   char *buf = *bufp;
   int ret = 0;
@@ -637,9 +638,9 @@ int UnMimeBodyline(char **bufp, flag delimited, flag softline)
     }
 
     if (CurrEncodingIsQP && CurrTypeNeedsDecode) 
-      ret = DoOneQPLine(bufp, delimited, softline);
+      ret = DoOneQPLine(bufp, len, delimited, softline);
     else
-     *bufp = (buf + strlen(buf));
+     *bufp = (buf + len);
     break;
   }
 
@@ -738,8 +739,9 @@ int main(int argc, char *argv[])
 
      if (buf_p > buffer) {
         if (bodytype & MSG_NEEDS_DECODE) {
+           size_t len = buf_p - buffer;
            buf_p = buffer;
-           UnMimeBodyline(&buf_p, 0, 0);
+           UnMimeBodyline(&buf_p, len, 0, 0);
         }
         DBG_FWRITE(buffer, (buf_p - buffer), 1, fd_conv);
         if (fwrite(buffer, (buf_p - buffer), 1, stdout) < 1) {